@@ -0,0 +1,552 @@
+/*
+  ifbench.c: End-to-end fan-out benchmark
+  Copyright (C) 2025 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, version 3.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+/*
+ * Runs ifserver in replay mode against a synthetic capture and attaches
+ * a number of PDU sinks to it over loopback. Every sink parses the
+ * stream exactly like ifclient does (minus the TAP write) and measures
+ * the latency from the PDU timestamp to its arrival. Results are printed
+ * as one key=value line per run, so they can be diffed across commits.
+ *
+ * Needs neither root nor a NIC.
+ */
+
+#define _GNU_SOURCE
+
+#include <ifshare.h>
+#include <client.h>
+#include <hist.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define IFBENCH_DEFAULT_FRAMES    200000
+#define IFBENCH_DEFAULT_CLIENTS   4
+#define IFBENCH_DEFAULT_RUNS      3
+#define IFBENCH_CONNECT_TIMEOUT   5000 /* ms */
+#define IFBENCH_RECV_BUFFER       (1 << 20)
+
+#define PCAP_MAGIC_NS             0xa1b23c4d
+#define LINKTYPE_ETHERNET         1
+
+struct ifbench_mix {
+  const char     *name;
+  const uint16_t *sizes; /* Picked round-robin */
+  unsigned int    count;
+};
+
+static const uint16_t g_sizes_64[]   = {64};
+static const uint16_t g_sizes_512[]  = {512};
+static const uint16_t g_sizes_1500[] = {1514};
+
+/* Simple IMIX: 7 small, 4 medium and 1 large frame */
+static const uint16_t g_sizes_imix[] = {
+  64, 594, 64, 594, 64, 1514, 64, 594, 64, 594, 64, 64
+};
+
+#define IFBENCH_MIX(name, sizes) \
+  {name, sizes, sizeof(sizes) / sizeof(sizes[0])}
+
+static const struct ifbench_mix g_mixes[] = {
+  IFBENCH_MIX("64",   g_sizes_64),
+  IFBENCH_MIX("512",  g_sizes_512),
+  IFBENCH_MIX("1500", g_sizes_1500),
+  IFBENCH_MIX("imix", g_sizes_imix),
+};
+
+#define IFBENCH_MIX_COUNT (sizeof(g_mixes) / sizeof(g_mixes[0]))
+
+struct ifbench_params {
+  const char  *server;
+  const char  *mix;     /* NULL: all of them */
+  unsigned int clients;
+  unsigned int frames;
+  unsigned int runs;
+  unsigned int max_queue;
+  bool         verbose;
+};
+
+struct ifbench_sink {
+  int       fd;
+  pthread_t thread;
+  bool      thread_started;
+
+  uint64_t  frames;
+  uint64_t  bytes;
+  uint64_t  first_ns;
+  uint64_t  last_ns;
+  hist_t    latency;
+};
+
+static uint64_t
+ifbench_now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static bool
+ifbench_write_pcap(int fd, const struct ifbench_mix *mix, unsigned int frames)
+{
+  FILE *fp = NULL;
+  uint8_t packet[IFSHARE_MAX_MTU];
+  uint32_t header[6] = {
+    PCAP_MAGIC_NS,
+    2 | (4 << 16), /* Version 2.4 */
+    0,
+    0,
+    IFSHARE_MAX_MTU,
+    LINKTYPE_ETHERNET
+  };
+  uint32_t record[4];
+  unsigned int i, size;
+  bool ok = false;
+
+  TRY(fp = fdopen(dup(fd), "wb"));
+
+  /* Broadcast Ethernet frames carrying a counter */
+  memset(packet, 0xff, 6);
+  memcpy(packet + 6, "\x02\x00\x00\x00\x00\x01\x08\x00", 8);
+  for (i = 14; i < sizeof(packet); ++i)
+    packet[i] = i;
+
+  TRY(fwrite(header, sizeof(header), 1, fp) == 1);
+
+  for (i = 0; i < frames; ++i) {
+    size = mix->sizes[i % mix->count];
+
+    record[0] = i / 1000000;
+    record[1] = (i % 1000000) * 1000;
+    record[2] = size;
+    record[3] = size;
+
+    memcpy(packet + 14, &i, sizeof(uint32_t));
+
+    TRY(fwrite(record, sizeof(record), 1, fp) == 1);
+    TRY(fwrite(packet, size, 1, fp) == 1);
+  }
+
+  ok = true;
+
+done:
+  if (fp != NULL)
+    fclose(fp);
+
+  return ok;
+}
+
+static pid_t
+ifbench_spawn_server(
+  const struct ifbench_params *params,
+  const char *pcap)
+{
+  char clients[32], queue[32];
+  pid_t pid;
+  int null;
+
+  snprintf(clients, sizeof(clients), "--wait-clients=%u", params->clients);
+  snprintf(queue, sizeof(queue), "--max-queue=%u", params->max_queue);
+
+  if ((pid = fork()) == -1) {
+    Err("fork: %s\n", strerror(errno));
+    return -1;
+  }
+
+  if (pid == 0) {
+    if (!params->verbose && (null = open("/dev/null", O_WRONLY)) != -1) {
+      dup2(null, STDOUT_FILENO);
+      dup2(null, STDERR_FILENO);
+    }
+
+    execl(
+      params->server,
+      params->server,
+      "--replay",
+      "--speed=0",
+      "--pdu-timestamps",
+      clients,
+      queue,
+      pcap,
+      (char *) NULL);
+
+    _exit(127);
+  }
+
+  return pid;
+}
+
+static int
+ifbench_connect(void)
+{
+  struct sockaddr_in addr;
+  unsigned int waited;
+  int fd = -1;
+
+  memset(&addr, 0, sizeof(struct sockaddr_in));
+  addr.sin_family      = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port        = htons(IFSHARE_SERVER_PORT);
+
+  /* The server may still be starting up */
+  for (waited = 0; waited < IFBENCH_CONNECT_TIMEOUT; waited += 10) {
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+      return -1;
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0)
+      return fd;
+
+    close(fd);
+    usleep(10000);
+  }
+
+  Err("Cannot connect to the server: %s\n", strerror(errno));
+
+  return -1;
+}
+
+static void *
+ifbench_sink_thread(void *userdata)
+{
+  struct ifbench_sink *self = (struct ifbench_sink *) userdata;
+  struct ifshare_pdu_ts header;
+  uint8_t *buffer = NULL;
+  size_t avail = 0, p, hdrsize;
+  uint64_t now, ts;
+  ssize_t got;
+
+  TRY(buffer = malloc(IFBENCH_RECV_BUFFER));
+
+  while ((got = recv(
+    self->fd,
+    buffer + avail,
+    IFBENCH_RECV_BUFFER - avail,
+    0)) > 0) {
+    now    = ifbench_now_ns();
+    avail += got;
+    p      = 0;
+
+    if (self->first_ns == 0)
+      self->first_ns = now;
+    self->last_ns = now;
+
+    while (avail - p >= sizeof(struct ifshare_pdu)) {
+      memcpy(&header, buffer + p, sizeof(struct ifshare_pdu));
+
+      if ((hdrsize = ifshare_header_size(header.is_magic)) == 0) {
+        Err("Invalid PDU magic (0x%x)\n", header.is_magic);
+        goto done;
+      }
+
+      if (avail - p < hdrsize + header.is_size)
+        break;
+
+      if (header.is_magic == IFSHARE_MAGIC_TS) {
+        memcpy(&header, buffer + p, sizeof(struct ifshare_pdu_ts));
+        ts = header.is_ts_sec * 1000000000ull + header.is_ts_nsec;
+        hist_record(&self->latency, now > ts ? now - ts : 0);
+      }
+
+      ++self->frames;
+      self->bytes += header.is_size;
+      p += hdrsize + header.is_size;
+    }
+
+    if (p > 0) {
+      memmove(buffer, buffer + p, avail - p);
+      avail -= p;
+    }
+  }
+
+done:
+  if (buffer != NULL)
+    free(buffer);
+
+  return NULL;
+}
+
+static bool
+ifbench_run(
+  const struct ifbench_params *params,
+  const struct ifbench_mix *mix,
+  const char *pcap,
+  unsigned int run)
+{
+  struct ifbench_sink *sinks = NULL;
+  hist_t *latency = NULL;
+  uint64_t first = UINT64_MAX, last = 0, frames = 0, bytes = 0, expected;
+  double elapsed;
+  pid_t pid = -1;
+  int status;
+  unsigned int i;
+  bool ok = false;
+
+  TRY(sinks = calloc(params->clients, sizeof(struct ifbench_sink)));
+  TRY(latency = calloc(1, sizeof(hist_t)));
+
+  for (i = 0; i < params->clients; ++i)
+    sinks[i].fd = -1;
+
+  TRYC(pid = ifbench_spawn_server(params, pcap));
+
+  for (i = 0; i < params->clients; ++i) {
+    TRYC(sinks[i].fd = ifbench_connect());
+    TRYZ(pthread_create(
+      &sinks[i].thread,
+      NULL,
+      ifbench_sink_thread,
+      sinks + i));
+    sinks[i].thread_started = true;
+  }
+
+  /* The server drains its clients and closes them once replay is over */
+  for (i = 0; i < params->clients; ++i) {
+    pthread_join(sinks[i].thread, NULL);
+    sinks[i].thread_started = false;
+  }
+
+  TRYC(waitpid(pid, &status, 0));
+  pid = -1;
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    Err("Server failed (status %d)\n", status);
+    goto done;
+  }
+
+  for (i = 0; i < params->clients; ++i) {
+    frames += sinks[i].frames;
+    bytes  += sinks[i].bytes;
+    if (sinks[i].frames > 0) {
+      first = MIN(first, sinks[i].first_ns);
+      last  = MAX(last, sinks[i].last_ns);
+    }
+    hist_merge(latency, &sinks[i].latency);
+  }
+
+  expected = (uint64_t) params->frames * params->clients;
+  elapsed  = last > first ? (last - first) * 1e-9 : 0;
+
+  printf(
+    "mix=%s run=%u clients=%u frames=%u rx_frames=%llu drops=%llu "
+    "rx_pps=%.0f rx_gbps=%.3f "
+    "lat_p50_us=%.1f lat_p99_us=%.1f lat_p999_us=%.1f lat_max_us=%.1f\n",
+    mix->name,
+    run,
+    params->clients,
+    params->frames,
+    (unsigned long long) frames,
+    (unsigned long long) (expected - MIN(expected, frames)),
+    elapsed > 0 ? frames / elapsed : 0,
+    elapsed > 0 ? bytes * 8e-9 / elapsed : 0,
+    hist_percentile(latency, .5) * 1e-3,
+    hist_percentile(latency, .99) * 1e-3,
+    hist_percentile(latency, .999) * 1e-3,
+    hist_max(latency) * 1e-3);
+  fflush(stdout);
+
+  ok = true;
+
+done:
+  if (sinks != NULL) {
+    for (i = 0; i < params->clients; ++i) {
+      if (sinks[i].fd != -1)
+        shutdown(sinks[i].fd, SHUT_RDWR);
+
+      if (sinks[i].thread_started)
+        pthread_join(sinks[i].thread, NULL);
+
+      if (sinks[i].fd != -1)
+        close(sinks[i].fd);
+    }
+
+    free(sinks);
+  }
+
+  if (pid != -1) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+  }
+
+  if (latency != NULL)
+    free(latency);
+
+  return ok;
+}
+
+static bool
+ifbench_mix(const struct ifbench_params *params, const struct ifbench_mix *mix)
+{
+  char pcap[] = "/tmp/ifbench-XXXXXX";
+  unsigned int i;
+  int fd = -1;
+  bool ok = false;
+
+  TRYC(fd = mkstemp(pcap));
+  TRY(ifbench_write_pcap(fd, mix, params->frames));
+
+  for (i = 0; i < params->runs; ++i)
+    TRY(ifbench_run(params, mix, pcap, i));
+
+  ok = true;
+
+done:
+  if (fd != -1) {
+    close(fd);
+    unlink(pcap);
+  }
+
+  return ok;
+}
+
+static struct option g_options[] = {
+  {"server",    required_argument, NULL, 's'},
+  {"clients",   required_argument, NULL, 'c'},
+  {"frames",    required_argument, NULL, 'n'},
+  {"runs",      required_argument, NULL, 'r'},
+  {"mix",       required_argument, NULL, 'm'},
+  {"max-queue", required_argument, NULL, 'Q'},
+  {"verbose",   no_argument,       NULL, 'v'},
+  {"help",      no_argument,       NULL, 'h'},
+  {NULL,        0,                 NULL, 0}
+};
+
+static void
+help(const char *argv0)
+{
+  unsigned int i;
+
+  fprintf(stderr, "Usage:\n");
+  fprintf(stderr, "\t%s [OPTIONS]\n\n", argv0);
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  -s, --server=PATH    ifserver binary (default: ./ifserver)\n");
+  fprintf(stderr, "  -c, --clients=N      Number of clients (default: %d)\n", IFBENCH_DEFAULT_CLIENTS);
+  fprintf(stderr, "  -n, --frames=N       Frames per run (default: %d)\n", IFBENCH_DEFAULT_FRAMES);
+  fprintf(stderr, "  -r, --runs=N         Runs per mix (default: %d)\n", IFBENCH_DEFAULT_RUNS);
+  fprintf(stderr, "  -m, --mix=MIX        Only run this packet size mix:");
+  for (i = 0; i < IFBENCH_MIX_COUNT; ++i)
+    fprintf(stderr, " %s", g_mixes[i].name);
+  fprintf(stderr, "\n");
+  fprintf(stderr, "  -Q, --max-queue=N    Server per-client queue (default: %d)\n", CLIENT_DEFAULT_MAX_QUEUE);
+  fprintf(stderr, "  -v, --verbose        Show the server output\n");
+  fprintf(stderr, "  -h, --help           This help\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct ifbench_params params = {
+    "./ifserver",
+    NULL,
+    IFBENCH_DEFAULT_CLIENTS,
+    IFBENCH_DEFAULT_FRAMES,
+    IFBENCH_DEFAULT_RUNS,
+    CLIENT_DEFAULT_MAX_QUEUE,
+    false
+  };
+  unsigned int i, ran = 0;
+  int code = EXIT_FAILURE;
+  int c;
+
+  while ((c = getopt_long(argc, argv, "s:c:n:r:m:Q:vh", g_options, NULL)) != -1) {
+    switch (c) {
+      case 's':
+        params.server = optarg;
+        break;
+
+      case 'c':
+        if (sscanf(optarg, "%u", &params.clients) != 1 || params.clients == 0) {
+          fprintf(stderr, "%s: invalid client count `%s'\n", argv[0], optarg);
+          goto done;
+        }
+        break;
+
+      case 'n':
+        if (sscanf(optarg, "%u", &params.frames) != 1 || params.frames == 0) {
+          fprintf(stderr, "%s: invalid frame count `%s'\n", argv[0], optarg);
+          goto done;
+        }
+        break;
+
+      case 'r':
+        if (sscanf(optarg, "%u", &params.runs) != 1) {
+          fprintf(stderr, "%s: invalid run count `%s'\n", argv[0], optarg);
+          goto done;
+        }
+        break;
+
+      case 'm':
+        params.mix = optarg;
+        break;
+
+      case 'Q':
+        if (sscanf(optarg, "%u", &params.max_queue) != 1) {
+          fprintf(stderr, "%s: invalid queue size `%s'\n", argv[0], optarg);
+          goto done;
+        }
+        break;
+
+      case 'v':
+        params.verbose = true;
+        break;
+
+      case 'h':
+        help(argv[0]);
+        code = EXIT_SUCCESS;
+        goto done;
+
+      default:
+        help(argv[0]);
+        goto done;
+    }
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  for (i = 0; i < IFBENCH_MIX_COUNT; ++i) {
+    if (params.mix != NULL && strcmp(params.mix, g_mixes[i].name) != 0)
+      continue;
+
+    TRY(ifbench_mix(&params, g_mixes + i));
+    ++ran;
+  }
+
+  if (ran == 0) {
+    fprintf(stderr, "%s: unknown mix `%s'\n", argv[0], params.mix);
+    goto done;
+  }
+
+  code = EXIT_SUCCESS;
+
+done:
+  exit(code);
+}
@@ -0,0 +1,571 @@
+/*
+  ifmicro.c: Microbenchmarks for the frame pipeline
+  Copyright (C) 2025 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, version 3.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+/*
+ * Focused benchmarks of the pieces every captured frame goes through:
+ *
+ *   fqueue     one producer pushing, one consumer popping in batches
+ *   frame      frame_new() / frame_dec_ref() churn from several threads
+ *   broadcast  server_broadcast() against 1 to 1000 clients
+ *   flow       frame_parse_flows() over mixed traffic, per hash kernel
+ *
+ * Threads are pinned, every case runs once to warm up and then a number
+ * of times, and the min / median / max of the runs is printed as one
+ * key=value line per case.
+ */
+
+#define _GNU_SOURCE
+
+#include <ifshare.h>
+#include <server.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#define IFMICRO_DEFAULT_RUNS  5
+#define IFMICRO_MAX_RUNS      64
+#define IFMICRO_MAX_THREADS   16
+#define IFMICRO_FRAME_SIZE    1514
+#define IFMICRO_FLOW_BATCH    64
+
+typedef double (*ifmicro_case_t) (unsigned int arg, uint64_t ops);
+
+struct ifmicro_params {
+  const char  *only; /* NULL: every case */
+  unsigned int runs;
+  double       scale;
+};
+
+static unsigned int g_cpus;
+
+static void
+ifmicro_pin(unsigned int cpu)
+{
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu % g_cpus, &set);
+
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set) != 0)
+    Warn("Cannot pin thread to CPU %u\n", cpu % g_cpus);
+}
+
+static int
+ifmicro_compare(const void *a, const void *b)
+{
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+
+  return (x > y) - (x < y);
+}
+
+/* Runs a case and reports ns per operation */
+static void
+ifmicro_run(
+  const struct ifmicro_params *params,
+  const char *name,
+  ifmicro_case_t func,
+  unsigned int arg,
+  uint64_t ops)
+{
+  double ns[IFMICRO_MAX_RUNS];
+  unsigned int i, runs = MIN(params->runs, IFMICRO_MAX_RUNS);
+
+  ops = MAX(1, (uint64_t) (ops * params->scale));
+
+  (void) (func) (arg, ops / 10 + 1); /* Warmup */
+
+  for (i = 0; i < runs; ++i)
+    ns[i] = (func) (arg, ops) / ops;
+
+  qsort(ns, runs, sizeof(double), ifmicro_compare);
+
+  printf(
+    "case=%s arg=%u ops=%llu runs=%u ns_min=%.1f ns_median=%.1f ns_max=%.1f "
+    "mops=%.3f\n",
+    name,
+    arg,
+    (unsigned long long) ops,
+    runs,
+    ns[0],
+    ns[runs / 2],
+    ns[runs - 1],
+    1e3 / ns[runs / 2]);
+  fflush(stdout);
+}
+
+/****************************** fqueue SPSC ********************************/
+struct ifmicro_fqueue {
+  fqueue_t    *queue;
+  uint64_t     ops;
+  unsigned int batch;
+};
+
+static void *
+ifmicro_fqueue_consumer(void *userdata)
+{
+  struct ifmicro_fqueue *ctx = (struct ifmicro_fqueue *) userdata;
+  frame_t *frames[CLIENT_SEND_BATCH];
+  unsigned int i, count;
+
+  ifmicro_pin(1);
+
+  while ((count = fqueue_pop_batch(ctx->queue, frames, ctx->batch)) > 0)
+    for (i = 0; i < count; ++i)
+      frame_dec_ref(frames[i]);
+
+  return NULL;
+}
+
+static double
+ifmicro_fqueue(unsigned int batch, uint64_t ops)
+{
+  struct ifmicro_fqueue ctx;
+  pthread_t consumer;
+  frame_t *frame = NULL;
+  uint64_t i, t0, elapsed = 0;
+
+  ctx.queue = NULL;
+  ctx.ops   = ops;
+  ctx.batch = batch;
+
+  MAKE(ctx.queue, fqueue);
+  MAKE(frame, frame, IFMICRO_FRAME_SIZE);
+  TRYZ(pthread_create(&consumer, NULL, ifmicro_fqueue_consumer, &ctx));
+
+  ifmicro_pin(0);
+
+  t0 = stats_now_ns();
+
+  for (i = 0; i < ops; ++i) {
+    frame_inc_ref(frame);
+    fqueue_push_frame(ctx.queue, frame);
+  }
+
+  fqueue_push_frame(ctx.queue, NULL);
+  pthread_join(consumer, NULL);
+
+  elapsed = stats_now_ns() - t0;
+
+done:
+  if (frame != NULL)
+    frame_dec_ref(frame);
+
+  if (ctx.queue != NULL)
+    DISPOSE(fqueue, ctx.queue);
+
+  return elapsed;
+}
+
+/****************************** frame churn ********************************/
+struct ifmicro_churn {
+  unsigned int cpu;
+  uint64_t     ops;
+};
+
+static void *
+ifmicro_churn_thread(void *userdata)
+{
+  struct ifmicro_churn *ctx = (struct ifmicro_churn *) userdata;
+  frame_t *frame;
+  uint64_t i;
+
+  ifmicro_pin(ctx->cpu);
+
+  for (i = 0; i < ctx->ops; ++i)
+    if ((frame = frame_new(IFMICRO_FRAME_SIZE)) != NULL)
+      frame_dec_ref(frame);
+
+  return NULL;
+}
+
+/* Total ops are split among the threads: the result is wall time per op */
+static double
+ifmicro_churn(unsigned int threads, uint64_t ops)
+{
+  struct ifmicro_churn ctx[IFMICRO_MAX_THREADS];
+  pthread_t thread[IFMICRO_MAX_THREADS];
+  unsigned int i, started = 0;
+  uint64_t t0;
+
+  threads = MIN(threads, IFMICRO_MAX_THREADS);
+
+  t0 = stats_now_ns();
+
+  for (i = 0; i < threads; ++i) {
+    ctx[i].cpu = i;
+    ctx[i].ops = ops / threads;
+
+    if (pthread_create(thread + i, NULL, ifmicro_churn_thread, ctx + i) != 0)
+      break;
+
+    ++started;
+  }
+
+  for (i = 0; i < started; ++i)
+    pthread_join(thread[i], NULL);
+
+  return stats_now_ns() - t0;
+}
+
+/******************************* broadcast *********************************/
+struct ifmicro_drain {
+  int  epfd;
+  int  cancelfd[2];
+};
+
+/* Reads whatever the clients send, so that they never block */
+static void *
+ifmicro_drain_thread(void *userdata)
+{
+  struct ifmicro_drain *ctx = (struct ifmicro_drain *) userdata;
+  struct epoll_event events[64];
+  static uint8_t scratch[1 << 16];
+  int i, count;
+
+  ifmicro_pin(1);
+
+  for (;;) {
+    if ((count = epoll_wait(ctx->epfd, events, 64, -1)) == -1) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    for (i = 0; i < count; ++i) {
+      if (events[i].data.fd == ctx->cancelfd[0])
+        return NULL;
+
+      while (recv(events[i].data.fd, scratch, sizeof(scratch), MSG_DONTWAIT)
+        > 0);
+    }
+  }
+
+  return NULL;
+}
+
+static double
+ifmicro_broadcast(unsigned int clients, uint64_t ops)
+{
+  struct server_params params = server_params_INITIALIZER;
+  struct ifmicro_drain ctx = {-1, {-1, -1}};
+  struct epoll_event ev;
+  server_t *server = NULL;
+  client_t *client = NULL;
+  frame_t *frame = NULL;
+  pthread_t drain;
+  bool drain_started = false;
+  int *peers = NULL;
+  int sv[2];
+  char name[32];
+  uint64_t i, t0, elapsed = 0;
+  char b = 1;
+
+  params.client.max_queue = 0; /* Measure pushes, not drops */
+
+  MAKE(server, server, &params);
+  TRY(peers = malloc(clients * sizeof(int)));
+
+  for (i = 0; i < clients; ++i)
+    peers[i] = -1;
+
+  TRYC(ctx.epfd = epoll_create1(0));
+  TRYC(pipe(ctx.cancelfd));
+
+  ev.events  = EPOLLIN;
+  ev.data.fd = ctx.cancelfd[0];
+  TRYC(epoll_ctl(ctx.epfd, EPOLL_CTL_ADD, ctx.cancelfd[0], &ev));
+
+  for (i = 0; i < clients; ++i) {
+    TRYC(socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    peers[i] = sv[1];
+
+    ev.data.fd = sv[1];
+    TRYC(epoll_ctl(ctx.epfd, EPOLL_CTL_ADD, sv[1], &ev));
+
+    snprintf(name, sizeof(name), "bench-%u", (unsigned int) i);
+    MAKE(client, client, sv[0], name, &params.client);
+
+    TRY(registry_insert(server->clients, client) != REGISTRY_INVALID_HANDLE);
+    client = NULL;
+  }
+
+  TRYZ(pthread_create(&drain, NULL, ifmicro_drain_thread, &ctx));
+  drain_started = true;
+
+  MAKE(frame, frame, IFMICRO_FRAME_SIZE);
+  ((struct ifshare_pdu *) frame->data)->is_magic = IFSHARE_MAGIC;
+  ((struct ifshare_pdu *) frame->data)->is_size  =
+    IFMICRO_FRAME_SIZE - sizeof(struct ifshare_pdu);
+
+  ifmicro_pin(0);
+
+  t0 = stats_now_ns();
+
+  for (i = 0; i < ops; ++i)
+    server_broadcast(server, frame);
+
+  elapsed = stats_now_ns() - t0;
+
+done:
+  if (client != NULL)
+    DISPOSE(client, client);
+
+  /* Clients drop their queues on destruction */
+  if (server != NULL)
+    DISPOSE(server, server);
+
+  if (drain_started) {
+    write(ctx.cancelfd[1], &b, 1);
+    pthread_join(drain, NULL);
+  }
+
+  if (frame != NULL)
+    frame_dec_ref(frame);
+
+  if (peers != NULL) {
+    for (i = 0; i < clients; ++i)
+      if (peers[i] != -1)
+        close(peers[i]);
+    free(peers);
+  }
+
+  if (ctx.epfd != -1)
+    close(ctx.epfd);
+
+  if (ctx.cancelfd[0] != -1) {
+    close(ctx.cancelfd[0]);
+    close(ctx.cancelfd[1]);
+  }
+
+  return elapsed;
+}
+
+/********************************* flow ***********************************/
+static void
+ifmicro_put16(uint8_t *p, uint16_t value)
+{
+  p[0] = value >> 8;
+  p[1] = value;
+}
+
+/* IPv4 and IPv6, TCP and UDP, tagged or not, in both directions */
+static void
+ifmicro_flow_packet(uint8_t *p, unsigned int i)
+{
+  unsigned int off = 12, a = i % 7, b = 7 + i % 5;
+  bool v6 = i & 1;
+  uint8_t *ip;
+
+  memset(p, 0, IFMICRO_FRAME_SIZE);
+
+  if (i & 2) {
+    ifmicro_put16(p + off, 0x8100);
+    ifmicro_put16(p + off + 2, i % 4094 + 1);
+    off += 4;
+  }
+
+  ifmicro_put16(p + off, v6 ? 0x86dd : 0x0800);
+  ip = p + off + 2;
+
+  if (i & 4) {
+    a ^= b;
+    b ^= a;
+    a ^= b;
+  }
+
+  if (v6) {
+    ip[0] = 0x60;
+    ip[6] = i & 8 ? 17 : 6;
+    ip[23] = a;
+    ip[39] = b;
+    ip += 40;
+  } else {
+    ip[0] = 0x45;
+    ip[9] = i & 8 ? 17 : 6;
+    ip[12] = 10;
+    ip[15] = a;
+    ip[16] = 10;
+    ip[19] = b;
+    ip += 20;
+  }
+
+  ifmicro_put16(ip, 1024 + a);
+  ifmicro_put16(ip + 2, 1024 + b);
+}
+
+/* Headers parsed and hashed per frame, with every frame parsed again */
+static double
+ifmicro_flow(unsigned int kernel, uint64_t ops)
+{
+  frame_t *frames[IFMICRO_FLOW_BATCH];
+  uint64_t i, t0, elapsed = 0;
+  unsigned int j, count = 0;
+
+  TRY(flow_set_kernel(kernel));
+
+  for (count = 0; count < IFMICRO_FLOW_BATCH; ++count) {
+    MAKE(frames[count], frame, IFMICRO_FRAME_SIZE);
+    ifmicro_flow_packet(frames[count]->data, count);
+  }
+
+  t0 = stats_now_ns();
+
+  for (i = 0; i < ops; i += IFMICRO_FLOW_BATCH) {
+    for (j = 0; j < IFMICRO_FLOW_BATCH; ++j)
+      frames[j]->flow_valid = false;
+
+    frame_parse_flows(frames, IFMICRO_FLOW_BATCH, 0);
+  }
+
+  elapsed = stats_now_ns() - t0;
+
+  /* Every kernel must agree with the plain one */
+  for (j = 0; j < IFMICRO_FLOW_BATCH; ++j)
+    if (frames[j]->flow.hash != flow_hash(frames[j]->data, frames[j]->size))
+      Warn("Kernel %s: hash mismatch in frame %u\n", flow_kernel_name(), j);
+
+done:
+  for (j = 0; j < count; ++j)
+    frame_dec_ref(frames[j]);
+
+  flow_set_kernel(FLOW_KERNEL_AUTO);
+
+  return elapsed;
+}
+
+static struct option g_options[] = {
+  {"case",  required_argument, NULL, 'c'},
+  {"runs",  required_argument, NULL, 'r'},
+  {"scale", required_argument, NULL, 's'},
+  {"help",  no_argument,       NULL, 'h'},
+  {NULL,    0,                 NULL, 0}
+};
+
+static void
+help(const char *argv0)
+{
+  fprintf(stderr, "Usage:\n");
+  fprintf(stderr, "\t%s [OPTIONS]\n\n", argv0);
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  -c, --case=NAME      Only run fqueue, frame, broadcast or flow\n");
+  fprintf(stderr, "  -r, --runs=N         Timed runs per case (default: %d)\n", IFMICRO_DEFAULT_RUNS);
+  fprintf(stderr, "  -s, --scale=X        Multiply the operation counts by X\n");
+  fprintf(stderr, "  -h, --help           This help\n");
+}
+
+#define IFMICRO_SELECTED(params, name) \
+  ((params)->only == NULL || strcmp((params)->only, name) == 0)
+
+int
+main(int argc, char *argv[])
+{
+  struct ifmicro_params params = {NULL, IFMICRO_DEFAULT_RUNS, 1.};
+  static const unsigned int batches[] = {1, CLIENT_SEND_BATCH};
+  static const unsigned int threads[] = {1, 2, 4};
+  static const unsigned int clients[] = {1, 10, 100, 1000};
+  static const enum flow_kernel kernels[] = {
+    FLOW_KERNEL_SCALAR,
+    FLOW_KERNEL_AVX2
+  };
+  char name[32];
+  struct rlimit rl;
+  unsigned int i;
+  int code = EXIT_FAILURE;
+  int c;
+
+  while ((c = getopt_long(argc, argv, "c:r:s:h", g_options, NULL)) != -1) {
+    switch (c) {
+      case 'c':
+        params.only = optarg;
+        break;
+
+      case 'r':
+        if (sscanf(optarg, "%u", &params.runs) != 1 || params.runs == 0) {
+          fprintf(stderr, "%s: invalid run count `%s'\n", argv[0], optarg);
+          goto done;
+        }
+        break;
+
+      case 's':
+        if (sscanf(optarg, "%lf", &params.scale) != 1 || params.scale <= 0) {
+          fprintf(stderr, "%s: invalid scale `%s'\n", argv[0], optarg);
+          goto done;
+        }
+        break;
+
+      case 'h':
+        help(argv[0]);
+        code = EXIT_SUCCESS;
+        goto done;
+
+      default:
+        help(argv[0]);
+        goto done;
+    }
+  }
+
+  g_cpus = MAX(1, sysconf(_SC_NPROCESSORS_ONLN));
+  signal(SIGPIPE, SIG_IGN);
+
+  /* Two sockets per client */
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  if (IFMICRO_SELECTED(&params, "fqueue"))
+    for (i = 0; i < sizeof(batches) / sizeof(batches[0]); ++i)
+      ifmicro_run(&params, "fqueue", ifmicro_fqueue, batches[i], 2000000);
+
+  if (IFMICRO_SELECTED(&params, "frame"))
+    for (i = 0; i < sizeof(threads) / sizeof(threads[0]); ++i)
+      ifmicro_run(&params, "frame", ifmicro_churn, threads[i], 2000000);
+
+  if (IFMICRO_SELECTED(&params, "broadcast"))
+    for (i = 0; i < sizeof(clients) / sizeof(clients[0]); ++i)
+      ifmicro_run(
+        &params,
+        "broadcast",
+        ifmicro_broadcast,
+        clients[i],
+        200000 / clients[i]);
+
+  if (IFMICRO_SELECTED(&params, "flow"))
+    for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); ++i)
+      if (flow_set_kernel(kernels[i])) {
+        snprintf(name, sizeof(name), "flow-%s", flow_kernel_name());
+        ifmicro_run(&params, name, ifmicro_flow, kernels[i], 20000000);
+      }
+
+  code = EXIT_SUCCESS;
+
+done:
+  exit(code);
+}
@@ -0,0 +1,49 @@
+/*
+  affinity.h: CPU affinity, NUMA placement and scheduling helpers
+  Copyright (C) 2025 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, version 3.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _AFFINITY_H
+#define _AFFINITY_H
+
+/* Users must define _GNU_SOURCE before including any system header */
+#include <sched.h>
+#include <pthread.h>
+
+#include "defs.h"
+
+/* Parses CPU lists such as "0-3,8,10-11" (the format of sysfs) */
+bool affinity_parse_cpus(const char *, cpu_set_t *);
+
+/* All of them act on the calling thread */
+bool affinity_pin(const cpu_set_t *);
+bool affinity_pin_cpu(int cpu);
+bool affinity_set_fifo(int priority);
+bool affinity_prefer_node(int node);
+
+/* -1 if the interface is virtual or the system is not NUMA */
+int affinity_nic_node(const char *ifname);
+
+/*
+ * Best CPU for capturing from a NIC: the hyperthread sibling of the core
+ * that handles its interrupts, so that both share caches without the
+ * capture loop competing with the softirq. Falls back to the first CPU
+ * local to the NIC. -1 if nothing is known about it.
+ */
+int affinity_nic_capture_cpu(const char *ifname);
+
+#endif /* _AFFINITY_H */
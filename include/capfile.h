@@ -0,0 +1,71 @@
+/*
+  capfile.h: Memory-mapped pcap / pcapng reader
+  Copyright (C) 2025 Gonzalo José Carracedo Carballal
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, version 3.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _CAPFILE_H
+#define _CAPFILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "defs.h"
+
+#define CAPFILE_MAX_INTERFACES 64
+
+enum capfile_format {
+  CAPFILE_PCAP,
+  CAPFILE_PCAPNG
+};
+
+struct capfile_packet {
+  const uint8_t *data;
+  size_t         size;
+  uint64_t       ts_ns;
+};
+
+struct capfile {
+  enum capfile_format format;
+  char               *path;
+
+  const uint8_t      *map;
+  size_t              size;
+  size_t              offset;
+  bool                swapped;
+
+  /* pcap */
+  bool                nanosecond;
+
+  /* pcapng: timestamp resolution of each interface of the section */
+  struct {
+    bool     power_of_two;
+    uint8_t  exponent;
+  } ifaces[CAPFILE_MAX_INTERFACES];
+  unsigned int        iface_count;
+  uint64_t            last_ts_ns;
+};
+
+typedef struct capfile capfile_t;
+
+INSTANCER(capfile, const char *path);
+COLLECTOR(capfile);
+
+/* Returns false at the end of the file (or if it is truncated) */
+METHOD(capfile, bool, next, struct capfile_packet *);
+METHOD(capfile, void, rewind);
+
+#endif /* _CAPFILE_H */
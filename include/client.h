@@ -20,32 +20,214 @@
 #ifndef _CLIENT_H
 #define _CLIENT_H
 
-#include <pthread.h>
-
+#include "ifshare.h"
+#include "affinity.h"
 #include "fqueue.h"
+#include "stats.h"
+#include "hist.h"
+#include "group.h"
+
+#define CLIENT_SEND_BATCH         64
+#define CLIENT_DEFAULT_MAX_QUEUE  16384
+#define CLIENT_SLOW_LOG_MS        1000
+#define CLIENT_NOTSENT_LOWAT      (128 << 10)
+#define CLIENT_REVERSE_FRAMES     16 /* Receive buffer, in frames */
+#define CLIENT_REVERSE_BURST_MS   10
+
+/* Where frames sent by the client go (reverse path) */
+struct client_sink {
+  bool (*push)(void *userdata, const uint8_t *data, size_t size);
+  void (*flush)(void *userdata);
+  void  *userdata;
+};
+
+struct client;
+
+/* What a client asked for in its hello (see IFSHARE_MAGIC_HELLO) */
+struct client_hello {
+  char group[GROUP_NAME_MAX]; /* Empty: none */
+
+  enum ifshare_sample sample;
+  unsigned int        sample_rate;
+};
+
+/* Handles hellos on behalf of the client */
+struct client_control {
+  bool (*hello)(void *userdata, struct client *, const struct client_hello *);
+  void  *userdata;
+};
+
+struct client_params {
+  unsigned int max_queue; /* Frames. 0 means unbounded */
+  cpu_set_t    cpus;      /* Empty: not pinned */
+  int          exitfd;    /* eventfd signalled when the thread exits, or -1 */
+
+  /* TCP clients only */
+  unsigned int sndbuf;        /* SO_SNDBUF, bytes. 0: kernel default */
+  unsigned int notsent_lowat; /* TCP_NOTSENT_LOWAT, bytes. 0: off */
+  bool         nodelay;       /* TCP_NODELAY */
+  bool         cork;          /* MSG_MORE while more frames are queued */
+
+  struct client_sink reverse;      /* push == NULL: frames are dropped */
+  uint64_t           reverse_rate; /* Bytes per second. 0: unlimited */
+
+  struct client_control control;   /* hello == NULL: hellos are ignored */
+};
+
+#define client_params_INITIALIZER               \
+{                                               \
+  CLIENT_DEFAULT_MAX_QUEUE, /* max_queue */     \
+  {{0}},                    /* cpus */          \
+  -1,                       /* exitfd */        \
+  0,                        /* sndbuf */        \
+  CLIENT_NOTSENT_LOWAT,     /* notsent_lowat */ \
+  true,                     /* nodelay */       \
+  true,                     /* cork */          \
+  {NULL, NULL, NULL},       /* reverse */       \
+  0,                        /* reverse_rate */  \
+  {NULL, NULL},             /* control */       \
+}
+
+struct client_stats {
+  uint64_t queued_frames;
+  uint64_t dropped_frames;
+  uint64_t queue_hwm;
+
+  uint64_t sent_frames;
+  uint64_t sent_bytes;
+  uint64_t unsampled_frames; /* Never pushed, see client_sample() */
+
+  uint64_t send_calls;
+  uint64_t send_ns;
+  uint64_t send_ns_max;
+  uint64_t corked_sends; /* With MSG_MORE */
+
+  uint64_t reverse_frames;
+  uint64_t reverse_bytes;
+  uint64_t reverse_dropped;      /* Rejected by the sink */
+  uint64_t reverse_throttled_ns; /* Waiting for the rate limit */
+};
 
 struct client {
   int   sfd;
+  bool  tcp;
   int   cancelfd[2];
   char *name;
 
+  struct client_params params;
+  struct client_stats  stats;
+  hist_t               latency; /* Capture to send completion, in ns */
+
+  struct log_ratelimit slow_log;
+
   fqueue_t *queue;
 
   pthread_t client_thread;
   bool      thread_started;
   bool      thread_running;
+
+  /*
+   * Hellos and the reverse path, see client_start_reader(). The token
+   * bucket is only touched by the reader.
+   */
+  pthread_t reader_thread;
+  bool      reader_started;
+  double    tokens;
+  uint64_t  tokens_ts;
+
+  /*
+   * The group is managed by the server, under its group lock. While an
+   * acceptor waits for the client to send something, it is `watched'
+   * and the server does not reap it.
+   */
+  struct group *group;
+  bool          watched;
+
+  /*
+   * Settled by the first hello, which may arrive while frames already
+   * flow: MODE << 32 | N, N being the rate for count sampling and the
+   * threshold out of 2^32 otherwise, so that the capture thread loads
+   * it in one go. The rest is only touched by the capture thread.
+   */
+  uint64_t sampling;
+  bool     sample_settled; /* By the reader */
+  uint32_t sample_count;
+  uint64_t sample_rng;
 };
 
 typedef struct client client_t;
 
-INSTANCER(client, int sfd, char *);
+INSTANCER(client, int sfd, char *, const struct client_params *);
 COLLECTOR(client);
 
+/*
+ * Starts the thread that reads hellos and reverse frames. Legacy
+ * clients never send anything: call it once the socket turns readable,
+ * so that they never cost a thread.
+ */
+METHOD(client, bool, start_reader);
+
 METHOD(client, bool, push_frame, frame_t *);
 
+/*
+ * Queues the end-of-stream marker: the client thread exits once all the
+ * frames before it are sent. Never waits.
+ */
+METHOD(client, bool, end_stream);
+
+METHOD(client, void, dump_stats, FILE *);
+
 METHOD(client, static inline bool, running)
 {
-  return self->thread_running;
+  return __atomic_load_n(&self->thread_running, __ATOMIC_ACQUIRE);
+}
+
+/* xorshift64*, upper half */
+METHOD(client, static inline uint32_t, random)
+{
+  uint64_t x = self->sample_rng;
+
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  self->sample_rng = x;
+
+  return (x * 0x2545f4914f6cdd1dull) >> 32;
+}
+
+/*
+ * Whether the capture thread should push the frame at all: frames the
+ * client does not sample never take a reference or a queue slot. The
+ * packet starts `offset' bytes into the frame.
+ */
+METHOD(client, static inline bool, sample, frame_t *frame, size_t offset)
+{
+  uint64_t sampling = __atomic_load_n(&self->sampling, __ATOMIC_RELAXED);
+  uint32_t n = (uint32_t) sampling;
+  bool keep = true;
+
+  switch ((enum ifshare_sample) (sampling >> 32)) {
+    case IFSHARE_SAMPLE_NONE:
+      return true;
+
+    case IFSHARE_SAMPLE_COUNT:
+      if ((keep = ++self->sample_count >= n))
+        self->sample_count = 0;
+      break;
+
+    case IFSHARE_SAMPLE_RANDOM:
+      keep = client_random(self) < n;
+      break;
+
+    case IFSHARE_SAMPLE_FLOW:
+      keep = frame_flow(frame, offset)->hash < n;
+      break;
+  }
+
+  if (!keep)
+    STATS_INC(self->stats.unsampled_frames);
+
+  return keep;
 }
 
 #endif /* _CLIENT_H */
@@ -0,0 +1,82 @@
+/*
+  dedup.h: Suppression of duplicate frames
+  Copyright (C) 2025 Gonzalo José Carracedo Carballal
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, version 3.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _DEDUP_H
+#define _DEDUP_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "defs.h"
+#include "frame.h"
+
+#define DEDUP_DEFAULT_WINDOW_US 1000
+#define DEDUP_BUCKETS           16384 /* Power of two */
+#define DEDUP_WAYS              4     /* Entries per bucket */
+#define DEDUP_HASH_BYTES        128   /* Of each packet, from L3 */
+
+/*
+ * Mirror ports often deliver every packet twice (ingress and egress
+ * copies), and the copy of a routed packet differs from the original in
+ * its MAC addresses, TTL and IP checksum. So IP packets are keyed by
+ * their first DEDUP_HASH_BYTES bytes from the IP header on (TTL / hop
+ * limit and checksum zeroed) plus their length. Other packets are keyed
+ * by their first bytes, Ethernet header included.
+ *
+ * A frame whose key was seen less than `window' ago is a duplicate. The
+ * table has a fixed size, and each bucket fills one cache line. Entries
+ * are never removed: they expire and are reused, or the oldest entry of
+ * a full bucket is overwritten.
+ */
+struct dedup_entry {
+  uint64_t key;
+  uint64_t ns;  /* When it was seen, 0: never */
+};
+
+struct dedup_bucket {
+  struct dedup_entry way[DEDUP_WAYS];
+} __attribute__((aligned(64)));
+
+struct dedup_stats {
+  uint64_t checked;
+  uint64_t dropped;
+  uint64_t evictions; /* Entries overwritten before they expired */
+};
+
+struct dedup {
+  struct dedup_bucket *buckets;
+  uint64_t             window_ns;
+
+  struct dedup_stats stats;
+};
+
+typedef struct dedup dedup_t;
+
+INSTANCER(dedup, unsigned int window_us);
+COLLECTOR(dedup);
+
+/*
+ * True if the packet `offset' bytes into the frame is a duplicate.
+ * Single threaded: only the capture thread calls it.
+ */
+METHOD(dedup, bool, check, frame_t *, size_t offset);
+
+METHOD(dedup, void, dump_stats, FILE *);
+
+#endif /* _DEDUP_H */
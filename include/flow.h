@@ -0,0 +1,76 @@
+/*
+  flow.h: Flow classification of captured frames
+  Copyright (C) 2025 Gonzalo José Carracedo Carballal
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, version 3.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _FLOW_H
+#define _FLOW_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define FLOW_F_IP       1 /* IPv4 or IPv6, addresses are the IP ones */
+#define FLOW_F_PORTS    2 /* TCP, UDP or SCTP ports found */
+#define FLOW_F_FRAGMENT 4
+#define FLOW_F_VLAN     8
+
+/*
+ * Headers of an Ethernet frame, as far as telling flows apart goes.
+ * Offsets count from the start of the frame; `l4' is 0 when the
+ * transport header is out of reach. Frames that are not IP fall back
+ * to the MAC address pair (`addr_len' 6), with the ethertype as ports.
+ */
+struct flow {
+  uint32_t hash;
+  uint16_t type;        /* Ethertype, past any VLAN tags */
+  uint16_t vlan;        /* Innermost VLAN ID */
+  uint16_t l3;
+  uint16_t l4;
+  uint8_t  proto;       /* IP protocol */
+  uint8_t  flags;       /* FLOW_F_* */
+  uint8_t  addr_len;
+  uint16_t port[2];     /* Source and destination, host order */
+  uint8_t  addr[2][16]; /* Source and destination */
+};
+
+enum flow_kernel {
+  FLOW_KERNEL_AUTO,
+  FLOW_KERNEL_SCALAR,
+  FLOW_KERNEL_AVX2
+};
+
+/* Fills everything but the hash */
+void flow_parse(struct flow *, const uint8_t *data, size_t size);
+
+/*
+ * Symmetric 5-tuple hash of parsed flows: both directions of a flow
+ * hash the same. TCP, UDP and SCTP flows are told apart by ports, other
+ * IP traffic by address pair and protocol, and everything else by MAC
+ * address pair. Fragments ignore ports, so that all of them land
+ * together. Every kernel gives the same hashes, only faster.
+ */
+void flow_hash_batch(struct flow *const *flows, unsigned int count);
+
+/* Parses and hashes a single frame */
+uint32_t flow_hash(const uint8_t *data, size_t size);
+
+/* False if this CPU cannot run it. AUTO picks the fastest one. */
+bool flow_set_kernel(enum flow_kernel);
+const char *flow_kernel_name(void);
+
+#endif /* _FLOW_H */
@@ -22,6 +22,7 @@
 
 #include <pthread.h>
 #include <sys/time.h>
+#include <time.h>
 #include "frame.h"
 
 struct fqueue_frame {
@@ -38,6 +39,8 @@ struct fqueue {
   struct fqueue_frame *first;
   struct fqueue_frame *last;
   struct fqueue_frame *free;
+
+  unsigned int count; /* Updated under mutex, readable without it */
 };
 
 typedef struct fqueue fqueue_t;
@@ -47,5 +50,12 @@ COLLECTOR(fqueue);
 
 METHOD(fqueue, bool, push_frame, frame_t *);
 METHOD(fqueue, frame_t *, pop_frame);
+METHOD(fqueue, unsigned int, pop_batch, frame_t **, unsigned int);
+METHOD(fqueue, unsigned int, pop_batch_timeout, frame_t **, unsigned int, int);
+
+GETTER(fqueue, static inline unsigned int, count)
+{
+  return __atomic_load_n(&self->count, __ATOMIC_RELAXED);
+}
 
 #endif /* _FQUEUE_H */
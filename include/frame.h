@@ -23,10 +23,29 @@
 #include <pthread.h>
 #include <stdint.h>
 #include <defs.h>
+#include <flow.h>
 #include <sys/time.h>
+#include <time.h>
+
+/* Kernel capture timestamps are CLOCK_REALTIME, so we use that too */
+#define FRAME_CLOCK CLOCK_REALTIME
+
+/* How many frames ahead frame_parse_flows() prefetches packet headers */
+#define FRAME_PREFETCH_DISTANCE 4
+
+struct frame;
+
+typedef void (*frame_release_cb_t) (struct frame *, void *);
 
 struct frame {
-  struct timeval  timestamp;
+  struct timespec timestamp; /* Capture time, FRAME_CLOCK */
+
+  /*
+   * NIC (PHC) time, with IFSHARE_TS_HARDWARE only. The PHC need not
+   * follow the system clock: only clients see it, ages and latencies
+   * always come from `timestamp'.
+   */
+  struct timespec hw_timestamp;
   pthread_mutex_t mutex;
   uint32_t        refcnt;
   struct frame   *next;
@@ -35,17 +54,73 @@ struct frame {
   size_t          alloc;
 
   uint8_t        *data; /* Public */
+
+  /* Set for frames wrapping external memory (see frame_wrap) */
+  frame_release_cb_t release;
+  void              *release_data;
+  uint8_t           *own_data;
+  size_t             own_alloc;
+
+  /* Parsed on demand, once per frame (see frame_flow) */
+  struct flow flow;
+  bool        flow_valid;
 };
 
 typedef struct frame frame_t;
 
 INSTANCER(frame, size_t size);
+frame_t *frame_wrap(void *, size_t, size_t, frame_release_cb_t, void *);
 COLLECTOR(frame);
 
 METHOD(frame, bool, resize, size_t);
 GETTER(frame, size_t, size);
 GETTER(frame, size_t, allocation);
 
+static inline uint64_t
+frame_clock_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(FRAME_CLOCK, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Producers stamp frames themselves, preferably with kernel timestamps */
+METHOD(frame, static inline void, stamp)
+{
+  clock_gettime(FRAME_CLOCK, &self->timestamp);
+}
+
+GETTER(frame, static inline uint64_t, timestamp_ns)
+{
+  return (uint64_t) self->timestamp.tv_sec * 1000000000ull
+    + self->timestamp.tv_nsec;
+}
+
+/* FRAME_CLOCK may step backwards, never report negative ages */
+GETTER(frame, static inline uint64_t, age_ns, uint64_t now)
+{
+  uint64_t ts = frame_timestamp_ns(self);
+
+  return now > ts ? now - ts : 0;
+}
+
+GETTER(frame, static inline bool, is_wrapped)
+{
+  return self->release != NULL;
+}
+
+/*
+ * Headers of the packet `offset' bytes into the frame. They are parsed
+ * and hashed the first time they are asked for, so whoever fills the
+ * frame must be done with it by then.
+ */
+METHOD(frame, const struct flow *, flow, size_t offset);
+
+/* The same for a whole batch, which lets the hash kernel go wide */
+void frame_parse_flows(frame_t *const *frames, unsigned int, size_t offset);
+
 METHOD(frame, void, inc_ref);
 METHOD(frame, bool, dec_ref);
 
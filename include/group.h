@@ -0,0 +1,93 @@
+/*
+  group.h: Flow-hash load balancing groups
+  Copyright (C) 2025 Gonzalo José Carracedo Carballal
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, version 3.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _GROUP_H
+#define _GROUP_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "defs.h"
+
+#define GROUP_BUCKETS  1024
+#define GROUP_NAME_MAX 64
+#define GROUP_MAX      1024 /* Groups in use at the same time */
+#define GROUP_CLOSED   ((struct group *) -1)
+
+/*
+ * Members of a group share its traffic: every flow hash falls into one
+ * bucket, and every bucket belongs to one member. When members come and
+ * go, only the buckets needed to even out the load change hands, so most
+ * flows stay where they were.
+ *
+ * Buckets hold member pointers that readers only compare, never follow:
+ * the broadcast loop checks them without taking any lock.
+ */
+struct group {
+  char         *name;
+  void         *buckets[GROUP_BUCKETS];
+  int           owner[GROUP_BUCKETS]; /* Index in members, -1: orphan */
+
+  void        **members;
+  unsigned int *load;   /* Buckets owned by each member */
+  unsigned int  count;
+  unsigned int  alloc;
+
+  struct group *next;
+};
+
+struct groups {
+  pthread_mutex_t mutex;
+  struct group   *list;
+  unsigned int    members; /* In any group */
+};
+
+typedef struct groups groups_t;
+
+INSTANCER(groups);
+COLLECTOR(groups);
+
+/*
+ * Moves `member' from the group in `*slot' to the one called `name'
+ * (created on demand, NULL for none) and updates `*slot'. Fails if the
+ * slot was closed, or if there are GROUP_MAX groups in use already.
+ */
+METHOD(groups, bool, join, void *member, struct group **slot, const char *name);
+
+/* Leaves the current group for good: later joins fail */
+METHOD(groups, void, close, void *member, struct group **slot);
+
+METHOD(groups, void, dump_stats, FILE *);
+
+/* Lock-free: whether flow hashes matter to anyone */
+GETTER(groups, static inline bool, active)
+{
+  return __atomic_load_n(&self->members, __ATOMIC_RELAXED) > 0;
+}
+
+static inline bool
+group_owns(const struct group *group, uint32_t hash, const void *member)
+{
+  return __atomic_load_n(
+    &group->buckets[hash % GROUP_BUCKETS],
+    __ATOMIC_RELAXED) == member;
+}
+
+#endif /* _GROUP_H */
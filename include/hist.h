@@ -0,0 +1,78 @@
+/*
+  hist.h: Log-linear latency histograms
+  Copyright (C) 2025 Gonzalo José Carracedo Carballal
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, version 3.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _HIST_H
+#define _HIST_H
+
+#include <stdint.h>
+
+#include "defs.h"
+
+/*
+ * HDR-style histogram: every power of two is split in 2^HIST_SUB_BITS
+ * linear sub-buckets, which bounds the relative error of any recorded
+ * value to 1 / 2^HIST_SUB_BITS (~3%) over the whole 64-bit range.
+ *
+ * Recording is wait-free (relaxed atomic increments) and meant to be
+ * done by a single thread. Readers may take percentiles at any time.
+ */
+#define HIST_SUB_BITS    5
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS     ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct hist {
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+};
+
+typedef struct hist hist_t;
+
+static inline unsigned int
+hist_index(uint64_t value)
+{
+  unsigned int msb;
+
+  if (value < HIST_SUB_BUCKETS)
+    return value;
+
+  msb = 63 - __builtin_clzll(value);
+
+  return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+    + ((value >> (msb - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+}
+
+METHOD(hist, static inline void, record, uint64_t value)
+{
+  __atomic_fetch_add(&self->counts[hist_index(value)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&self->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&self->sum, value, __ATOMIC_RELAXED);
+
+  if (value > __atomic_load_n(&self->max, __ATOMIC_RELAXED))
+    __atomic_store_n(&self->max, value, __ATOMIC_RELAXED);
+}
+
+METHOD(hist, void, reset);
+METHOD(hist, void, merge, const hist_t *);
+GETTER(hist, uint64_t, percentile, double);
+GETTER(hist, uint64_t, count);
+GETTER(hist, uint64_t, max);
+
+#endif /* _HIST_H */
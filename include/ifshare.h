@@ -20,10 +20,8 @@
 #ifndef _IFSHARE_H
 #define _IFSHARE_H
 
-#include <defs.h>
-#include <util.h>
-#include <log.h>
-#include <stdlib.h>
+/* Wire protocol. Installed: keep it free of the internal headers. */
+#include <stddef.h>
 #include <stdint.h>
 
 struct ifshare_pdu {
@@ -32,8 +30,69 @@ struct ifshare_pdu {
   uint8_t  is_data[0];
 };
 
+/*
+ * Same as ifshare_pdu, with the capture time of the frame. Only sent by
+ * servers with PDU timestamps enabled. The time is CLOCK_REALTIME,
+ * except for IFSHARE_TS_HARDWARE: then it is the NIC's own clock (PHC),
+ * which is only comparable with the system time if it is synced to it.
+ */
+struct ifshare_pdu_ts {
+  uint32_t is_magic;
+  uint32_t is_size;
+  uint64_t is_ts_sec;
+  uint32_t is_ts_nsec;
+  uint32_t is_ts_source;
+  uint8_t  is_data[0];
+};
+
+enum ifshare_ts_source {
+  IFSHARE_TS_USER,
+  IFSHARE_TS_KERNEL,
+  IFSHARE_TS_HARDWARE
+};
+
+enum ifshare_sample {
+  IFSHARE_SAMPLE_NONE,
+  IFSHARE_SAMPLE_COUNT,  /* Every Nth frame */
+  IFSHARE_SAMPLE_RANDOM, /* Each frame with probability 1/N */
+  IFSHARE_SAMPLE_FLOW    /* Every frame of 1 in N flows */
+};
+
 #define IFSHARE_SERVER_PORT 5665
 #define IFSHARE_MAX_MTU     4096
 #define IFSHARE_MAGIC       0x1f5543aa
+#define IFSHARE_MAGIC_TS    0x1f5543ab
+#define IFSHARE_MAGIC_HELLO 0x1f5543ac
+
+/*
+ * Sent by clients right after connecting, framed as an ifshare_pdu. The
+ * data is a list of KEY=VALUE lines:
+ *
+ *   group=NAME     Share the traffic with the other members of NAME:
+ *                  each flow goes to only one of them.
+ *   sample=MODE:N  Take only part of the traffic: every Nth frame
+ *                  (count), each frame with probability 1/N (random)
+ *                  or every frame of 1 in N flows (flow). Flow
+ *                  sampling picks the same flows for every client.
+ *                  Only honored in the first hello.
+ */
+#define IFSHARE_HELLO_MAX   1024
+
+#define IFSHARE_MAX_HEADER  sizeof(struct ifshare_pdu_ts)
+
+static inline size_t
+ifshare_header_size(uint32_t magic)
+{
+  switch (magic) {
+    case IFSHARE_MAGIC:
+    case IFSHARE_MAGIC_HELLO:
+      return sizeof(struct ifshare_pdu);
+
+    case IFSHARE_MAGIC_TS:
+      return sizeof(struct ifshare_pdu_ts);
+  }
+
+  return 0;
+}
 
 #endif /* _IFSHARE_H */
@@ -0,0 +1,79 @@
+/*
+  injector.h: Frame injection through a PACKET_TX_RING
+  Copyright (C) 2025 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, version 3.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _INJECTOR_H
+#define _INJECTOR_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "defs.h"
+
+#define INJECTOR_RING_FRAMES  512
+#define INJECTOR_KICK_BATCH   32
+#define INJECTOR_FULL_RETRIES 10  /* Waits for room in a full ring */
+#define INJECTOR_FULL_WAIT_US 100
+
+struct injector_stats {
+  uint64_t frames;
+  uint64_t bytes;
+  uint64_t dropped; /* Ring full, or rejected by the kernel */
+  uint64_t kicks;
+};
+
+/*
+ * Frames are copied into a memory-mapped TX ring and handed to the
+ * kernel in batches: one send() transmits everything that was queued
+ * since the previous one. The ring bypasses the qdisc, so injected
+ * frames are not seen by the capture socket and never come back to the
+ * clients: an interface that cannot do that cannot be injected into.
+ *
+ * Thread-safe: every client feeding the reverse path shares it.
+ */
+struct injector {
+  int      fd;
+  char    *ifname;
+
+  uint8_t *ring;
+  size_t   ring_size;
+  unsigned int frame_size;
+  unsigned int frame_count;
+
+  pthread_mutex_t mutex;
+  unsigned int    head;    /* Next frame to fill */
+  unsigned int    pending; /* Filled since the last kick */
+
+  struct injector_stats stats;
+};
+
+typedef struct injector injector_t;
+
+INSTANCER(injector, const char *ifname);
+COLLECTOR(injector);
+
+/* Queues a copy of the frame. Transmitted on the next kick. */
+METHOD(injector, bool, push, const uint8_t *, size_t);
+
+/* Transmits whatever is queued */
+METHOD(injector, void, flush);
+
+METHOD(injector, void, dump_stats, FILE *);
+
+#endif /* _INJECTOR_H */
@@ -0,0 +1,157 @@
+/*
+  libifshare.h: Embeddable ifshare client
+  Copyright (C) 2025 Gonzalo José Carracedo Carballal
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, version 3.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _LIBIFSHARE_H
+#define _LIBIFSHARE_H
+
+/*
+ * Installed for applications: plain C, nothing from the internal
+ * headers. Only the functions marked IFSHARE_API are exported.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "ifshare.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#if defined(__GNUC__)
+#  define IFSHARE_API __attribute__((visibility("default")))
+#else
+#  define IFSHARE_API
+#endif /* __GNUC__ */
+
+#define IFSHARE_BATCH_MAX    64
+#define IFSHARE_RECV_BUFFER                                    \
+  (IFSHARE_BATCH_MAX * (IFSHARE_MAX_MTU + IFSHARE_MAX_HEADER))
+#define IFSHARE_SEND_BUFFER                                            \
+  (IFSHARE_BATCH_MAX * (IFSHARE_MAX_MTU + sizeof(struct ifshare_pdu)))
+
+/*
+ * A frame as received from the server. `data' points into the client's
+ * own buffers: it stays valid until the next receive call, so consumers
+ * that only look at the bytes never copy them.
+ */
+struct ifshare_frame {
+  const uint8_t         *data;
+  size_t                 size;
+  struct timespec        timestamp; /* Zero without PDU timestamps */
+  enum ifshare_ts_source ts_source;
+
+  const uint8_t         *pdu;       /* As framed by the server (relays) */
+  size_t                 pdu_size;
+};
+
+struct ifshare_params {
+  const char  *host;     /* TCP server */
+  unsigned int port;
+  const char  *shm_path; /* Or local server (--shm). Receive only. */
+
+  const char  *group;    /* Share flows with other members (TCP only) */
+
+  enum ifshare_sample sample;      /* TCP only */
+  unsigned int        sample_rate; /* Keep 1 in N */
+};
+
+#define ifshare_params_INITIALIZER       \
+{                                        \
+  NULL,                /* host */        \
+  IFSHARE_SERVER_PORT, /* port */        \
+  NULL,                /* shm_path */    \
+  NULL,                /* group */       \
+  IFSHARE_SAMPLE_NONE, /* sample */      \
+  1,                   /* sample_rate */ \
+}
+
+enum ifshare_log_level {
+  IFSHARE_LOG_DEBUG,
+  IFSHARE_LOG_INFO,
+  IFSHARE_LOG_WARNING,
+  IFSHARE_LOG_ERROR
+};
+
+/* One line, newline included */
+typedef void (*ifshare_log_cb_t) (
+  enum ifshare_log_level,
+  const char *message,
+  void *userdata);
+
+/* Returns false to stop receiving */
+typedef bool (*ifshare_batch_cb_t) (
+  const struct ifshare_frame *,
+  unsigned int,
+  void *);
+
+typedef struct ifshare ifshare_t;
+
+/*
+ * The library never writes to stdout / stderr and starts no threads of
+ * its own: diagnostics are dropped unless a handler is set. Set it
+ * before anything else, it is not synchronized.
+ */
+IFSHARE_API void ifshare_set_log_handler(ifshare_log_cb_t, void *userdata);
+
+IFSHARE_API ifshare_t *ifshare_new(const struct ifshare_params *);
+IFSHARE_API void ifshare_destroy(ifshare_t *);
+
+/*
+ * Fills up to `max' frames and returns how many, 0 on timeout (-1 waits
+ * forever) and -1 when the server is gone or sent garbage. Frames
+ * already buffered are returned without touching the socket.
+ */
+IFSHARE_API int ifshare_recv_batch(
+  ifshare_t *,
+  struct ifshare_frame *,
+  unsigned int max,
+  int timeout_ms);
+
+/* Calls `cb' with every batch until it returns false or the server leaves */
+IFSHARE_API bool ifshare_run(ifshare_t *, ifshare_batch_cb_t, void *userdata);
+
+/* Reverse path: frames for the server to inject (TCP only) */
+IFSHARE_API bool ifshare_send_batch(
+  ifshare_t *,
+  const struct ifshare_frame *,
+  unsigned int);
+
+/* Descriptor to poll for input, -1 in shared memory mode */
+IFSHARE_API int ifshare_fd(const ifshare_t *);
+
+/* True once the server closed the connection or the ring */
+IFSHARE_API bool ifshare_eof(const ifshare_t *);
+
+/* Frames the shared ring overwrote before we could read them */
+IFSHARE_API uint64_t ifshare_lost(const ifshare_t *);
+
+/* Sampling as MODE:N, the way hellos carry it (see IFSHARE_MAGIC_HELLO) */
+IFSHARE_API bool ifshare_sample_from_string(
+  const char *,
+  enum ifshare_sample *,
+  unsigned int *rate);
+IFSHARE_API const char *ifshare_sample_to_string(enum ifshare_sample);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* _LIBIFSHARE_H */
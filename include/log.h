@@ -22,6 +22,8 @@
 
 #define LOG_DEFAULT_FP stderr
 #include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
 
 enum loglevel {
   LogDebug,
@@ -30,6 +32,30 @@ enum loglevel {
   LogError
 };
 
+/*
+ * Messages below LOG_MIN_LEVEL are removed at compile time, arguments
+ * included. Above it, the runtime level is checked before anything else.
+ */
+#ifndef LOG_MIN_LEVEL
+#  define LOG_MIN_LEVEL LogDebug
+#endif /* LOG_MIN_LEVEL */
+
+extern unsigned int g_log_level;
+
+static inline bool
+log_enabled(enum loglevel level)
+{
+  return level >= LOG_MIN_LEVEL
+    && level >= __atomic_load_n(&g_log_level, __ATOMIC_RELAXED);
+}
+
+struct log_ratelimit {
+  uint64_t next;       /* CLOCK_MONOTONIC, ns */
+  uint64_t suppressed;
+};
+
+#define log_ratelimit_INITIALIZER {0, 0}
+
 void logprintf(
   enum loglevel,
   const char *function,
@@ -38,10 +64,62 @@ void logprintf(
   const char *fmt,
   ...);
 
-void log_hexdump(enum loglevel, const void *data, size_t size);
+void logdump(enum loglevel, const void *data, size_t size);
+
+void log_set_level(enum loglevel);
+
+/* True at most once per interval. Returns the calls suppressed meanwhile. */
+bool log_ratelimit(struct log_ratelimit *, unsigned int, uint64_t *);
+
+/* Messages lost because a thread logged faster than they could be written */
+uint64_t log_dropped_count(void);
+
+/* Messages for the application's handler, see ifshare_set_log_handler() */
+void ifshare_log(enum loglevel, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+
+#ifdef IFSHARE_LIBRARY
+/* libifshare: no writer thread and nothing on stderr */
+#  define Log(level, fmt, arg...)     \
+  do {                                \
+    if ((level) >= LOG_MIN_LEVEL)     \
+      ifshare_log(level, fmt, ##arg); \
+  } while (0)
+#else
+#  define Log(level, fmt, arg...)                                     \
+  do {                                                                \
+    if (log_enabled(level))                                           \
+      logprintf(level, __FUNCTION__, __FILE__, __LINE__, fmt, ##arg); \
+  } while (0)
+#endif /* IFSHARE_LIBRARY */
+
+#define log_hexdump(level, data, size) \
+  do {                                 \
+    if (log_enabled(level))            \
+      logdump(level, data, size);      \
+  } while (0)
+
+/* Rate limited by the caller's state, e.g. one per client */
+#define LogLimited(rl, interval_ms, level, fmt, arg...)  \
+  do {                                                   \
+    uint64_t _suppressed;                                \
+    if (log_enabled(level)                               \
+      && log_ratelimit(rl, interval_ms, &_suppressed)) { \
+      if (_suppressed > 0)                               \
+        Log(                                             \
+          level,                                         \
+          "(%llu similar messages suppressed)\n",        \
+          (unsigned long long) _suppressed);             \
+      Log(level, fmt, ##arg);                            \
+    }                                                    \
+  } while (0)
 
-#define Log(level, fmt, arg...) \
-  logprintf(level, __FUNCTION__, __FILE__, __LINE__, fmt, ##arg)
+/* Rate limited per call site */
+#define LogEvery(interval_ms, level, fmt, arg...)                \
+  do {                                                           \
+    static struct log_ratelimit _rl = log_ratelimit_INITIALIZER; \
+    LogLimited(&_rl, interval_ms, level, fmt, ##arg);            \
+  } while (0)
 
 #define Err(fmt, arg...)   Log(LogError,   fmt, ##arg)
 #define Warn(fmt, arg...)  Log(LogWarning, fmt, ##arg)
@@ -0,0 +1,92 @@
+/*
+  recorder.h: pcapng recording sink
+  Copyright (C) 2025 Gonzalo José Carracedo Carballal
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, version 3.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _RECORDER_H
+#define _RECORDER_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include "fqueue.h"
+#include "stats.h"
+
+#define RECORDER_BUFFER_SIZE   (4 << 20)
+#define RECORDER_ALIGNMENT     4096
+#define RECORDER_FLUSH_MS      1000
+#define RECORDER_BATCH         256
+#define RECORDER_RETRY_S       1 /* Between new files after a failure */
+
+struct recorder_params {
+  const char  *prefix;    /* NULL disables recording */
+  uint64_t     max_size;  /* Bytes per file. 0 means no limit */
+  unsigned int max_time;  /* Seconds per file. 0 means no limit */
+  bool         direct;    /* Write with O_DIRECT */
+  unsigned int max_queue; /* Frames */
+};
+
+#define recorder_params_INITIALIZER       \
+{                                         \
+  NULL,                /* prefix */       \
+  1024ull << 20,       /* max_size */     \
+  0,                   /* max_time */     \
+  false,               /* direct */       \
+  65536,               /* max_queue */    \
+}
+
+struct recorder_stats {
+  uint64_t recorded_frames;
+  uint64_t recorded_bytes;
+  uint64_t dropped_frames;
+  uint64_t files;
+};
+
+/*
+ * The recorder sits on the broadcast path like a client. Frames are
+ * queued (never waiting on the disk) and written by its own thread into
+ * a large aligned buffer, which is flushed in big sequential writes.
+ */
+struct recorder {
+  struct recorder_params params;
+  struct recorder_stats  stats;
+
+  fqueue_t *queue;
+
+  int       fd;
+  unsigned  file_index;
+  uint64_t  file_size;
+  time_t    file_opened;
+  bool      failed;
+
+  uint8_t  *buffer;
+  size_t    used;
+
+  pthread_t thread;
+  bool      thread_started;
+  bool      running;
+};
+
+typedef struct recorder recorder_t;
+
+INSTANCER(recorder, const struct recorder_params *);
+COLLECTOR(recorder);
+
+METHOD(recorder, void, push_frame, frame_t *);
+METHOD(recorder, void, dump_stats, FILE *);
+
+#endif /* _RECORDER_H */
@@ -0,0 +1,114 @@
+/*
+  registry.h: Generation-indexed registry with lock-free snapshots
+  Copyright (C) 2025 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, version 3.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _REGISTRY_H
+#define _REGISTRY_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "defs.h"
+
+/*
+ * A slot map: items are referred to by handles made of a slot index and
+ * the generation of the slot, so that handles of removed items never
+ * resolve to whatever took their slot later. Live items are also kept in
+ * a dense array, so iterating them never scans holes.
+ *
+ * Readers do not lock. They get an immutable snapshot of the live items,
+ * which writers replace on every change (RCU-style): the old snapshot
+ * is reused once every reader that might have seen it is gone. Readers
+ * are tracked with two counters and an epoch whose parity tells which
+ * one new readers use; a writer flips the epoch and waits for the
+ * counter of the previous one to drop to zero.
+ *
+ * Once remove() returns, no reader can see the item anymore, and it can
+ * be safely destroyed.
+ */
+typedef uint64_t registry_handle_t;
+
+#define REGISTRY_INVALID_HANDLE ((registry_handle_t) -1)
+
+struct registry_entry {
+  void             *item;
+  registry_handle_t handle;
+};
+
+struct registry_snapshot {
+  unsigned int          count;
+  unsigned int          capacity;
+  struct registry_entry entries[];
+};
+
+struct registry_slot {
+  void    *item;       /* NULL if free */
+  uint32_t generation;
+  uint32_t dense;      /* Index in the live array, or next free slot */
+};
+
+struct registry {
+  pthread_mutex_t mutex; /* Serializes writers */
+
+  struct registry_slot  *slots;
+  unsigned int           slot_count;
+  unsigned int           slot_alloc;
+  uint32_t               free_head;
+
+  struct registry_entry *live;
+  unsigned int           live_count;
+
+  struct registry_snapshot *snapshot; /* Published to readers */
+  struct registry_snapshot *spare;    /* The previous one, free to reuse */
+  unsigned int              epoch;
+  unsigned int              readers[2];
+};
+
+typedef struct registry registry_t;
+
+INSTANCER(registry);
+COLLECTOR(registry);
+
+METHOD(registry, registry_handle_t, insert, void *);
+METHOD(registry, void *, remove, registry_handle_t);
+
+/*
+ * Removes every item for which pred(item, userdata) holds, waiting for
+ * readers only once. removed(item, userdata) is then called on each of
+ * them, when it is already safe to destroy them. Returns how many.
+ */
+METHOD(
+  registry,
+  unsigned int,
+  remove_if,
+  bool (*pred)(void *, void *),
+  void (*removed)(void *, void *),
+  void *userdata);
+
+/* Never blocks. Every read_lock() must be paired with a read_unlock(). */
+METHOD(registry, const struct registry_snapshot *, read_lock, unsigned int *);
+METHOD(registry, void, read_unlock, unsigned int);
+
+#define REGISTRY_FOR_EACH(this, snapshot)                                \
+  unsigned int JOIN(_idx_, __LINE__);                                    \
+  for (JOIN(_idx_, __LINE__) = 0;                                        \
+       JOIN(_idx_, __LINE__) < (snapshot)->count                         \
+       && ((this = (snapshot)->entries[JOIN(_idx_, __LINE__)].item), 1); \
+       JOIN(_idx_, __LINE__)++)
+
+#endif /* _REGISTRY_H */
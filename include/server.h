@@ -21,26 +21,185 @@
 #ifndef _SERVER_H
 #define _SERVER_H
 
+#include <ifshare.h>
 #include <util.h>
 #include <client.h>
+#include <xsk.h>
+#include <stats.h>
+#include <recorder.h>
+#include <registry.h>
+#include <injector.h>
+#include <shm.h>
+#include <group.h>
+#include <dedup.h>
 #include <pthread.h>
 
+#define SERVER_CAPTURE_BATCH    64
+#define SERVER_DRAIN_TIMEOUT_MS 5000
+#define SERVER_DRAIN_POLL_MS    10
+#define SERVER_CPU_NONE         -1
+#define SERVER_CPU_AUTO         -2 /* Next to the NIC's interrupts */
+#define SERVER_FIFO_PRIORITY    50
+#define SERVER_SPIN_MIN_NS      1000
+#define SERVER_BACKLOG          1024
+#define SERVER_MAX_LISTENERS    64
+#define SERVER_RELAY_RETRY_MS   1000
+#define SERVER_ACCEPTOR_FDS     3  /* Cancellation, listener, reaper */
+#define SERVER_QUIET_ALLOC      16 /* First quiet client slots */
+
+enum server_capture {
+  SERVER_CAPTURE_PACKET,
+  SERVER_CAPTURE_XDP,
+  SERVER_CAPTURE_REPLAY,
+  SERVER_CAPTURE_RELAY    /* From an upstream ifshare server */
+};
+
+struct server_params {
+  enum server_capture capture;
+
+  enum xsk_mode       xdp_mode;
+  unsigned int        xdp_queue;
+
+  double              replay_speed; /* 0: as fast as possible */
+  unsigned int        replay_loops; /* 0: forever */
+  unsigned int        replay_clients; /* Wait for them before replaying */
+
+  const char         *bind_addr;     /* NULL: any, IPv6 and IPv4 */
+  unsigned int        port;
+  unsigned int        backlog;
+  unsigned int        listeners;     /* SO_REUSEPORT shards */
+
+  const char         *stats_path;
+  const char         *shm_path;      /* Shared-memory ring for local readers */
+  size_t              shm_size;
+
+  unsigned int        dedup_window_us; /* Drop repeated frames. 0: off */
+
+  int                 capture_cpu;
+  bool                numa;          /* Frames on the NIC's NUMA node */
+  int                 fifo_priority; /* 0: regular scheduling */
+
+  unsigned int        busy_poll_us;  /* SO_BUSY_POLL. 0: off */
+  unsigned int        spin_us;       /* Max spin before sleeping. 0: off */
+
+  enum ifshare_ts_source timestamps;
+  bool                   pdu_timestamps;
+
+  bool                   inject; /* Frames from clients go out the NIC */
+
+  struct client_params   client;
+  struct recorder_params recorder;
+};
+
+#define server_params_INITIALIZER              \
+{                                              \
+  SERVER_CAPTURE_PACKET, /* capture */         \
+  XSK_MODE_AUTO,         /* xdp_mode */        \
+  0,                     /* xdp_queue */       \
+  1.,                    /* replay_speed */    \
+  1,                     /* replay_loops */    \
+  0,                     /* replay_clients */  \
+  NULL,                  /* bind_addr */       \
+  IFSHARE_SERVER_PORT,   /* port */            \
+  SERVER_BACKLOG,        /* backlog */         \
+  1,                     /* listeners */       \
+  NULL,                  /* stats_path */      \
+  NULL,                  /* shm_path */        \
+  SHMRING_DEFAULT_SIZE,  /* shm_size */        \
+  0,                     /* dedup_window_us */ \
+  SERVER_CPU_NONE,       /* capture_cpu */     \
+  false,                 /* numa */            \
+  0,                     /* fifo_priority */   \
+  0,                     /* busy_poll_us */    \
+  0,                     /* spin_us */         \
+  IFSHARE_TS_KERNEL,     /* timestamps */      \
+  false,                 /* pdu_timestamps */  \
+  false,                 /* inject */          \
+  client_params_INITIALIZER,                   \
+  recorder_params_INITIALIZER,                 \
+}
+
+struct server_stats {
+  uint64_t captured_frames;
+  uint64_t captured_bytes;
+  uint64_t kernel_drops;
+  uint64_t clients_accepted;
+
+  uint64_t spin_hits;   /* Input arrived while spinning */
+  uint64_t spin_misses; /* Spun for nothing, then slept */
+
+  uint64_t upstream_connects;
+};
+
+struct server;
+
+/*
+ * A listening socket and the thread that accepts from it. With several
+ * of them (SO_REUSEPORT), the kernel spreads incoming connections.
+ */
+struct server_listener {
+  struct server *server;
+  unsigned int   index;
+  int            fd;
+  cpu_set_t      cpus; /* Of the acceptor and the clients it creates */
+
+  pthread_t      thread;
+  bool           thread_started;
+
+  /*
+   * Clients accepted here that never sent anything: their sockets are
+   * polled after the acceptor's own descriptors, and their reader only
+   * started once they turn readable. Legacy clients stay here for good.
+   * Only the acceptor touches these.
+   */
+  struct pollfd  *fds;
+  client_t      **quiet_list;
+  unsigned int    quiet_count;
+  unsigned int    quiet_alloc;
+};
+
 struct server {
-  int listenfd;
+  struct server_params params;
+
+  struct server_stats stats;
+  stats_t *stats_endpoint;
+  shm_t   *shm;
+  dedup_t *dedup;
+
+  int    rawfd;
+  xsk_t *xsk;
+
+  recorder_t *recorder;
+  injector_t *injector; /* Set once the loop starts */
+
+  struct server_listener *listener_list;
+  unsigned int            listener_count;
+
   int cancelfd[2];
-  PTR_LIST(client_t, client);
-  pthread_mutex_t client_mutex;
+  int reapfd;      /* eventfd, signalled by client threads on exit */
+  registry_t *clients;
+  groups_t   *groups;
+
+  bool      stopping;
 
-  pthread_t acceptor_thread;
-  bool      thread_started;
-  bool      thread_running;
+  uint64_t  spin_ns; /* Current spin budget, adapted to the traffic */
 };
 
 typedef struct server server_t;
 
-INSTANCER(server);
+INSTANCER(server, const struct server_params *);
 COLLECTOR(server);
 
+/* The argument is the interface, or the capture file when replaying */
 METHOD(server, bool, loop, const char *);
+METHOD(server, void, stop);
+
+/* Hands a frame to the recorder and every client. Used by the loops. */
+METHOD(server, bool, broadcast, frame_t *);
+
+METHOD(server, static inline bool, stopping)
+{
+  return __atomic_load_n(&self->stopping, __ATOMIC_RELAXED);
+}
 
 #endif /* _SERVER_H */
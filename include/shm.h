@@ -0,0 +1,61 @@
+/*
+  shm.h: Shared-memory endpoint for local consumers
+  Copyright (C) 2025 Gonzalo José Carracedo Carballal
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, version 3.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _SHM_H
+#define _SHM_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "defs.h"
+#include "frame.h"
+#include "shmring.h"
+
+/*
+ * Local consumers connect to a Unix stream socket and receive the ring's
+ * memfd (SCM_RIGHTS) in a single message. The connection is closed right
+ * after: from then on, frames reach them through the mapping only.
+ */
+struct shm {
+  char *path;
+  int   listenfd;
+  int   cancelfd[2];
+
+  shmring_t *ring;
+  uint64_t   readers; /* Descriptors handed out */
+
+  pthread_t thread;
+  bool      thread_started;
+};
+
+typedef struct shm shm_t;
+
+INSTANCER(shm, const char *path, size_t size);
+COLLECTOR(shm);
+
+/* Single producer: only the capture thread calls it */
+METHOD(shm, void, push_frame, const frame_t *);
+
+METHOD(shm, void, dump_stats, FILE *);
+
+/* Client side: connects to the endpoint and returns the ring's memfd */
+int shm_connect(const char *path);
+
+#endif /* _SHM_H */
@@ -0,0 +1,121 @@
+/*
+  shmring.h: Shared-memory frame ring for local consumers
+  Copyright (C) 2025 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, version 3.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _SHMRING_H
+#define _SHMRING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "defs.h"
+
+#define SHMRING_MAGIC        0x1f5543b0
+#define SHMRING_VERSION      1
+#define SHMRING_HEADER_SIZE  4096
+#define SHMRING_DEFAULT_SIZE (16 << 20)
+#define SHMRING_PAD          0xffffffff
+#define SHMRING_ALIGN(x)     (((x) + 7) & ~(uint64_t) 7)
+
+/*
+ * One writer, any number of readers, in a memfd. Records are appended
+ * and never split: when one does not fit before the end of the ring, a
+ * pad record fills the gap. Positions are byte counts that never wrap.
+ *
+ * The writer never waits for readers. Before overwriting anything, it
+ * moves `tail' past the records it is about to destroy. Readers copy a
+ * record out and check `tail' again afterwards: if it moved past the
+ * record, the copy may be torn and is discarded (a seqlock, in short).
+ *
+ * Readers that run out of records sleep on `futex' after announcing it
+ * in `waiters'. The writer only enters the kernel to wake them when
+ * someone is actually sleeping.
+ *
+ * Records hold PDUs, exactly as they would be sent over TCP.
+ */
+struct shmring_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t size;        /* Of the data area, a power of two */
+  uint64_t data_offset;
+  int32_t  pid;         /* Of the writer, to notice it died */
+  uint32_t closed;
+
+  uint64_t head __attribute__((aligned(64))); /* Written up to here */
+  uint64_t tail __attribute__((aligned(64))); /* Oldest valid record */
+
+  uint32_t futex   __attribute__((aligned(64)));
+  uint32_t waiters;
+};
+
+struct shmring_record {
+  uint32_t size; /* Of the data, or SHMRING_PAD */
+  uint32_t reserved;
+  uint8_t  data[];
+};
+
+struct shmring_stats {
+  uint64_t frames;
+  uint64_t bytes;
+  uint64_t wakeups; /* futex() calls by the writer */
+};
+
+struct shmring {
+  int      fd;
+  uint8_t *map;
+  size_t   map_size;
+
+  struct shmring_header *header;
+  uint8_t               *data;
+
+  struct shmring_stats stats;
+};
+
+typedef struct shmring shmring_t;
+
+/* Writer side */
+INSTANCER(shmring, size_t size);
+COLLECTOR(shmring);
+
+METHOD(shmring, bool, push, const void *, size_t);
+METHOD(shmring, void, close);
+
+struct shmring_reader {
+  uint8_t *map;
+  size_t   map_size;
+
+  struct shmring_header *header;
+  const uint8_t         *data;
+
+  uint64_t pos;
+  uint64_t lost; /* Records overwritten before we could read them */
+};
+
+typedef struct shmring_reader shmring_reader_t;
+
+/* Reader side. The descriptor is the memfd received from the writer. */
+INSTANCER(shmring_reader, int fd);
+COLLECTOR(shmring_reader);
+
+/* Size of the record copied, 0 if there is nothing to read, -1 if closed */
+METHOD(shmring_reader, ssize_t, read, void *, size_t);
+
+/* Sleeps until there is something to read. False on timeout. */
+METHOD(shmring_reader, bool, wait, int timeout_ms);
+
+#endif /* _SHMRING_H */
@@ -0,0 +1,96 @@
+/*
+  stats.h: Statistics counters and endpoint
+  Copyright (C) 2025 Gonzalo José Carracedo Carballal
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, version 3.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "defs.h"
+
+/*
+ * Counters are plain 64-bit integers updated with relaxed atomics: each
+ * one is written by a single thread in the common case and only read
+ * (without any locking) by the stats endpoint.
+ */
+#define STATS_ADD(counter, n) \
+  __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+
+#define STATS_INC(counter) STATS_ADD(counter, 1)
+
+#define STATS_GET(counter) \
+  __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+#define STATS_SET(counter, value) \
+  __atomic_store_n(&(counter), (value), __ATOMIC_RELAXED)
+
+static inline void
+stats_max(uint64_t *counter, uint64_t value)
+{
+  uint64_t prev = __atomic_load_n(counter, __ATOMIC_RELAXED);
+
+  while (value > prev
+    && !__atomic_compare_exchange_n(
+      counter,
+      &prev,
+      value,
+      true,
+      __ATOMIC_RELAXED,
+      __ATOMIC_RELAXED));
+}
+
+static inline uint64_t
+stats_now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * The endpoint is a Unix stream socket. Every connection receives a
+ * snapshot of all counters in Prometheus text format and is closed.
+ */
+#define STATS_SEND_TIMEOUT_MS 1000
+
+typedef void (*stats_dump_cb_t) (FILE *, void *);
+
+struct stats {
+  char *path;
+  int   listenfd;
+  int   cancelfd[2];
+
+  stats_dump_cb_t dump;
+  void           *userdata;
+
+  pthread_t thread;
+  bool      thread_started;
+};
+
+typedef struct stats stats_t;
+
+INSTANCER(stats, const char *path, stats_dump_cb_t, void *);
+COLLECTOR(stats);
+
+#endif /* _STATS_H */
@@ -73,9 +73,14 @@
     if ((this = where->name##_list[JOIN(_idx_, __LINE__)]) != NULL)
 
 
+struct sockaddr;
+
 char *vstrbuild(const char *fmt, va_list ap);
 char *strbuild(const char *fmt, ...);
 
+/* "1.2.3.4:port" or "[::1]:port". IPv4-mapped addresses look like IPv4. */
+char *sockaddr_to_string(const struct sockaddr *);
+
 void ptr_list_append(void ***, unsigned int *, void *);
 int  ptr_list_append_check(void ***, unsigned int *, void *);
 int  ptr_list_remove_first(void ***, unsigned int *, void *);
@@ -0,0 +1,107 @@
+/*
+  xsk.h: AF_XDP capture socket
+  Copyright (C) 2025 Gonzalo José Carracedo Carballal
+  
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, version 3.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _XSK_H
+#define _XSK_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <linux/if_xdp.h>
+
+#include "frame.h"
+
+#define XSK_NUM_CHUNKS 4096
+#define XSK_CHUNK_SIZE 4096
+#define XSK_RING_SIZE  2048
+
+/*
+ * When more than this many chunks are held by frames that are still
+ * queued somewhere, new packets are copied out of the UMEM and their
+ * chunks returned to the kernel immediately. This keeps slow clients
+ * from starving the fill ring.
+ */
+#define XSK_LENT_HIGH_WATERMARK (XSK_NUM_CHUNKS / 2)
+
+enum xsk_mode {
+  XSK_MODE_AUTO,
+  XSK_MODE_SKB,
+  XSK_MODE_NATIVE,
+  XSK_MODE_ZEROCOPY
+};
+
+struct xsk_ring {
+  uint32_t *producer;
+  uint32_t *consumer;
+  uint32_t *flags;
+  void     *ring;
+  uint32_t  size;
+  uint32_t  cached;
+
+  void     *map;
+  size_t    map_size;
+};
+
+struct xsk {
+  int           fd;
+  int           ifindex;
+  unsigned int  queue;
+  enum xsk_mode mode;
+  size_t        headroom;
+  bool          promisc_set;
+  char         *ifname;
+
+  int           prog_fd;
+  int           map_fd;
+  int           link_fd;
+
+  uint8_t      *umem;
+  size_t        umem_size;
+
+  struct xsk_ring rx;
+  struct xsk_ring fill;
+  struct xsk_ring comp;
+
+  /* Chunks released by other threads, waiting to go back to the fill ring */
+  pthread_mutex_t recycle_mutex;
+  uint64_t       *recycle;
+  unsigned int    recycle_count;
+
+  uint32_t        lent; /* Chunks currently wrapped by frames */
+};
+
+typedef struct xsk xsk_t;
+
+INSTANCER(xsk, const char *, unsigned int queue, enum xsk_mode, size_t headroom);
+COLLECTOR(xsk);
+
+METHOD(xsk, unsigned int, recv_batch, frame_t **, unsigned int);
+METHOD(xsk, bool, wait, int timeout);
+
+/* Whether the RX ring has descriptors. Does not enter the kernel. */
+GETTER(xsk, static inline bool, pending)
+{
+  return __atomic_load_n(self->rx.producer, __ATOMIC_ACQUIRE)
+    != *self->rx.consumer;
+}
+METHOD(xsk, bool, get_stats, struct xdp_statistics *);
+
+bool xsk_mode_from_string(const char *, enum xsk_mode *);
+const char *xsk_mode_to_string(enum xsk_mode);
+
+#endif /* _XSK_H */
@@ -0,0 +1,269 @@
+/*
+  affinity.c: CPU affinity, NUMA placement and scheduling helpers
+  Copyright (C) 2025 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, version 3.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#define _GNU_SOURCE
+
+#include <affinity.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#define AFFINITY_PATH_MAX 256
+#define AFFINITY_LINE_MAX 1024
+
+static bool
+affinity_read_line(const char *path, char *buf, size_t size)
+{
+  FILE *fp;
+  bool ok = false;
+
+  if ((fp = fopen(path, "r")) == NULL)
+    return false;
+
+  if (fgets(buf, size, fp) != NULL) {
+    buf[strcspn(buf, "\n")] = '\0';
+    ok = true;
+  }
+
+  fclose(fp);
+
+  return ok;
+}
+
+bool
+affinity_parse_cpus(const char *list, cpu_set_t *set)
+{
+  const char *p = list;
+  char *end;
+  long first, last;
+
+  CPU_ZERO(set);
+
+  while (*p != '\0') {
+    first = strtol(p, &end, 10);
+    if (end == p || first < 0)
+      return false;
+
+    last = first;
+    p    = end;
+
+    if (*p == '-') {
+      last = strtol(++p, &end, 10);
+      if (end == p || last < first)
+        return false;
+      p = end;
+    }
+
+    if (last >= CPU_SETSIZE)
+      return false;
+
+    for (; first <= last; ++first)
+      CPU_SET(first, set);
+
+    if (*p == ',')
+      ++p;
+    else if (*p != '\0')
+      return false;
+  }
+
+  return CPU_COUNT(set) > 0;
+}
+
+static int
+affinity_first_cpu(const cpu_set_t *set, int except)
+{
+  int i;
+
+  for (i = 0; i < CPU_SETSIZE; ++i)
+    if (i != except && CPU_ISSET(i, set))
+      return i;
+
+  return -1;
+}
+
+bool
+affinity_pin(const cpu_set_t *set)
+{
+  int error;
+
+  if ((error = pthread_setaffinity_np(
+    pthread_self(),
+    sizeof(cpu_set_t),
+    set)) != 0) {
+    Err("Cannot set thread affinity: %s\n", strerror(error));
+    return false;
+  }
+
+  return true;
+}
+
+bool
+affinity_pin_cpu(int cpu)
+{
+  cpu_set_t set;
+
+  if (cpu < 0 || cpu >= CPU_SETSIZE)
+    return false;
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+
+  return affinity_pin(&set);
+}
+
+bool
+affinity_set_fifo(int priority)
+{
+  struct sched_param param;
+  int error;
+
+  memset(&param, 0, sizeof(struct sched_param));
+  param.sched_priority = priority;
+
+  if ((error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param))
+    != 0) {
+    Err("Cannot switch to SCHED_FIFO: %s\n", strerror(error));
+    return false;
+  }
+
+  return true;
+}
+
+/*
+ * Memory the calling thread touches first (frames, the UMEM) will come
+ * from this node when possible. Done with the raw syscall, so that we
+ * do not depend on libnuma.
+ */
+bool
+affinity_prefer_node(int node)
+{
+  unsigned long mask[16];
+
+  if (node < 0 || node >= (int) (sizeof(mask) * 8))
+    return false;
+
+  memset(mask, 0, sizeof(mask));
+  mask[node / (8 * sizeof(unsigned long))] |=
+    1ul << (node % (8 * sizeof(unsigned long)));
+
+  if (syscall(
+    SYS_set_mempolicy,
+    MPOL_PREFERRED,
+    mask,
+    sizeof(mask) * 8) == -1) {
+    Err("set_mempolicy(node %d): %s\n", node, strerror(errno));
+    return false;
+  }
+
+  return true;
+}
+
+int
+affinity_nic_node(const char *ifname)
+{
+  char path[AFFINITY_PATH_MAX];
+  char line[AFFINITY_LINE_MAX];
+
+  snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", ifname);
+
+  if (!affinity_read_line(path, line, sizeof(line)))
+    return -1;
+
+  return atoi(line);
+}
+
+/* CPU that services the first interrupt of the NIC, or -1 */
+static int
+affinity_nic_irq_cpu(const char *ifname)
+{
+  char path[AFFINITY_PATH_MAX];
+  char line[AFFINITY_LINE_MAX];
+  struct dirent *ent;
+  cpu_set_t set;
+  DIR *dir;
+  long irq = -1;
+
+  snprintf(path, sizeof(path), "/sys/class/net/%s/device/msi_irqs", ifname);
+
+  if ((dir = opendir(path)) != NULL) {
+    while ((ent = readdir(dir)) != NULL)
+      if (ent->d_name[0] != '.') {
+        irq = atol(ent->d_name);
+        break;
+      }
+
+    closedir(dir);
+  }
+
+  if (irq == -1) {
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/irq", ifname);
+    if (!affinity_read_line(path, line, sizeof(line)) || (irq = atol(line)) <= 0)
+      return -1;
+  }
+
+  snprintf(path, sizeof(path), "/proc/irq/%ld/effective_affinity_list", irq);
+  if (!affinity_read_line(path, line, sizeof(line))) {
+    snprintf(path, sizeof(path), "/proc/irq/%ld/smp_affinity_list", irq);
+    if (!affinity_read_line(path, line, sizeof(line)))
+      return -1;
+  }
+
+  if (!affinity_parse_cpus(line, &set))
+    return -1;
+
+  return affinity_first_cpu(&set, -1);
+}
+
+int
+affinity_nic_capture_cpu(const char *ifname)
+{
+  char path[AFFINITY_PATH_MAX];
+  char line[AFFINITY_LINE_MAX];
+  cpu_set_t set;
+  int cpu, sibling;
+
+  if ((cpu = affinity_nic_irq_cpu(ifname)) != -1) {
+    snprintf(
+      path,
+      sizeof(path),
+      "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list",
+      cpu);
+
+    if (affinity_read_line(path, line, sizeof(line))
+      && affinity_parse_cpus(line, &set)
+      && (sibling = affinity_first_cpu(&set, cpu)) != -1)
+      return sibling;
+
+    return cpu;
+  }
+
+  snprintf(path, sizeof(path), "/sys/class/net/%s/device/local_cpulist", ifname);
+
+  if (affinity_read_line(path, line, sizeof(line))
+    && affinity_parse_cpus(line, &set))
+    return affinity_first_cpu(&set, -1);
+
+  return -1;
+}
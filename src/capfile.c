@@ -0,0 +1,342 @@
+/*
+  capfile.c: Memory-mapped pcap / pcapng reader
+  Copyright (C) 2025 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, version 3.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <capfile.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <byteswap.h>
+
+#define PCAP_MAGIC_US         0xa1b2c3d4
+#define PCAP_MAGIC_NS         0xa1b23c4d
+#define PCAP_HEADER_SIZE      24
+#define PCAP_RECORD_SIZE      16
+
+#define PCAPNG_SHB_TYPE       0x0a0d0d0a
+#define PCAPNG_IDB_TYPE       0x00000001
+#define PCAPNG_SPB_TYPE       0x00000003
+#define PCAPNG_EPB_TYPE       0x00000006
+#define PCAPNG_BYTE_ORDER     0x1a2b3c4d
+#define PCAPNG_OPT_TSRESOL    9
+
+#define LINKTYPE_ETHERNET     1
+
+METHOD_CONST(capfile, static uint32_t, u32, size_t offset)
+{
+  uint32_t value;
+
+  memcpy(&value, self->map + offset, sizeof(uint32_t));
+
+  return self->swapped ? bswap_32(value) : value;
+}
+
+METHOD_CONST(capfile, static uint16_t, u16, size_t offset)
+{
+  uint16_t value;
+
+  memcpy(&value, self->map + offset, sizeof(uint16_t));
+
+  return self->swapped ? bswap_16(value) : value;
+}
+
+METHOD(capfile, static bool, open_pcap)
+{
+  uint32_t magic;
+
+  if (self->size < PCAP_HEADER_SIZE)
+    return false;
+
+  memcpy(&magic, self->map, sizeof(uint32_t));
+
+  if (magic == PCAP_MAGIC_US || magic == PCAP_MAGIC_NS) {
+    self->swapped = false;
+  } else if (bswap_32(magic) == PCAP_MAGIC_US
+    || bswap_32(magic) == PCAP_MAGIC_NS) {
+    self->swapped = true;
+    magic         = bswap_32(magic);
+  } else {
+    return false;
+  }
+
+  self->format     = CAPFILE_PCAP;
+  self->nanosecond = magic == PCAP_MAGIC_NS;
+
+  if (capfile_u32(self, 20) != LINKTYPE_ETHERNET)
+    Warn(
+      "%s: link type %d is not Ethernet, replaying anyway\n",
+      self->path,
+      capfile_u32(self, 20));
+
+  return true;
+}
+
+METHOD(capfile, static bool, open_pcapng)
+{
+  uint32_t type;
+
+  if (self->size < 12)
+    return false;
+
+  memcpy(&type, self->map, sizeof(uint32_t));
+
+  if (type != PCAPNG_SHB_TYPE)
+    return false;
+
+  self->format = CAPFILE_PCAPNG;
+
+  return true;
+}
+
+INSTANCER(capfile, const char *path)
+{
+  capfile_t *new = NULL;
+  struct stat sbuf;
+  int fd = -1;
+  void *map;
+
+  ALLOCATE_FAIL(new, capfile_t);
+  TRY_FAIL(new->path = strdup(path));
+
+  if ((fd = open(path, O_RDONLY)) == -1) {
+    Err("Cannot open %s: %s\n", path, strerror(errno));
+    goto fail;
+  }
+
+  TRYC_FAIL(fstat(fd, &sbuf));
+
+  if (sbuf.st_size == 0) {
+    Err("%s is empty\n", path);
+    goto fail;
+  }
+
+  new->size = sbuf.st_size;
+  map = mmap(NULL, new->size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+
+  if (map == MAP_FAILED) {
+    Err("Cannot map %s: %s\n", path, strerror(errno));
+    goto fail;
+  }
+
+  new->map = map;
+  madvise(map, new->size, MADV_SEQUENTIAL | MADV_WILLNEED);
+
+  close(fd);
+  fd = -1;
+
+  if (!capfile_open_pcap(new) && !capfile_open_pcapng(new)) {
+    Err("%s: not a pcap or pcapng file\n", path);
+    goto fail;
+  }
+
+  capfile_rewind(new);
+
+  return new;
+
+fail:
+  if (fd != -1)
+    close(fd);
+
+  if (new != NULL)
+    DISPOSE(capfile, new);
+
+  return NULL;
+}
+
+COLLECTOR(capfile)
+{
+  if (self->map != NULL)
+    munmap((void *) self->map, self->size);
+
+  if (self->path != NULL)
+    free(self->path);
+
+  free(self);
+}
+
+METHOD(capfile, void, rewind)
+{
+  self->offset      = self->format == CAPFILE_PCAP ? PCAP_HEADER_SIZE : 0;
+  self->iface_count = 0;
+  self->last_ts_ns  = 0;
+}
+
+METHOD(capfile, static bool, next_pcap, struct capfile_packet *packet)
+{
+  uint32_t sec, frac, caplen;
+
+  if (self->offset + PCAP_RECORD_SIZE > self->size)
+    return false;
+
+  sec    = capfile_u32(self, self->offset);
+  frac   = capfile_u32(self, self->offset + 4);
+  caplen = capfile_u32(self, self->offset + 8);
+
+  if (self->offset + PCAP_RECORD_SIZE + caplen > self->size)
+    return false;
+
+  packet->data  = self->map + self->offset + PCAP_RECORD_SIZE;
+  packet->size  = caplen;
+  packet->ts_ns = (uint64_t) sec * 1000000000ull
+    + (self->nanosecond ? frac : frac * 1000ull);
+
+  self->offset += PCAP_RECORD_SIZE + caplen;
+
+  return true;
+}
+
+/* Scans the IDB options for if_tsresol */
+METHOD(capfile, static void, parse_idb, size_t offset, uint32_t length)
+{
+  size_t p   = offset + 16;
+  size_t end = offset + length - 4;
+  uint16_t code, optlen;
+  uint8_t resol = 6;
+
+  while (p + 4 <= end) {
+    code   = capfile_u16(self, p);
+    optlen = capfile_u16(self, p + 2);
+
+    if (code == 0 || p + 4 + optlen > end)
+      break;
+
+    if (code == PCAPNG_OPT_TSRESOL && optlen >= 1)
+      resol = self->map[p + 4];
+
+    p += 4 + ((optlen + 3) & ~3);
+  }
+
+  if (self->iface_count < CAPFILE_MAX_INTERFACES) {
+    self->ifaces[self->iface_count].power_of_two = (resol & 0x80) != 0;
+    self->ifaces[self->iface_count].exponent     = resol & 0x7f;
+    ++self->iface_count;
+  }
+}
+
+METHOD_CONST(capfile, static uint64_t, ts_to_ns, uint32_t iface, uint64_t ts)
+{
+  uint8_t exp;
+  uint64_t div;
+
+  if (iface >= self->iface_count)
+    return ts * 1000; /* Default: microseconds */
+
+  exp = self->ifaces[iface].exponent;
+
+  if (self->ifaces[iface].power_of_two)
+    return (uint64_t) (((unsigned __int128) ts * 1000000000ull) >> exp);
+
+  if (exp <= 9) {
+    for (div = 1; exp < 9; ++exp)
+      div *= 10;
+    return ts * div;
+  }
+
+  for (div = 1; exp > 9; --exp)
+    div *= 10;
+
+  return ts / div;
+}
+
+METHOD(capfile, static bool, next_pcapng, struct capfile_packet *packet)
+{
+  uint32_t type, length, bom, iface, caplen;
+  uint64_t ts;
+
+  for (;;) {
+    if (self->offset + 12 > self->size)
+      return false;
+
+    memcpy(&type, self->map + self->offset, sizeof(uint32_t));
+
+    /* The byte order may change at every section */
+    if (type == PCAPNG_SHB_TYPE) {
+      memcpy(&bom, self->map + self->offset + 8, sizeof(uint32_t));
+
+      if (bom == PCAPNG_BYTE_ORDER)
+        self->swapped = false;
+      else if (bswap_32(bom) == PCAPNG_BYTE_ORDER)
+        self->swapped = true;
+      else
+        return false;
+
+      self->iface_count = 0;
+    }
+
+    type   = capfile_u32(self, self->offset);
+    length = capfile_u32(self, self->offset + 4);
+
+    if (length < 12 || (length & 3) || self->offset + length > self->size)
+      return false;
+
+    switch (type) {
+      case PCAPNG_IDB_TYPE:
+        capfile_parse_idb(self, self->offset, length);
+        break;
+
+      case PCAPNG_EPB_TYPE:
+        if (length < 32)
+          return false;
+
+        iface  = capfile_u32(self, self->offset + 8);
+        ts     = ((uint64_t) capfile_u32(self, self->offset + 12) << 32)
+          | capfile_u32(self, self->offset + 16);
+        caplen = capfile_u32(self, self->offset + 20);
+
+        if (28 + (size_t) caplen > length)
+          return false;
+
+        packet->data     = self->map + self->offset + 28;
+        packet->size     = caplen;
+        packet->ts_ns    = capfile_ts_to_ns(self, iface, ts);
+        self->last_ts_ns = packet->ts_ns;
+        self->offset    += length;
+        return true;
+
+      case PCAPNG_SPB_TYPE:
+        if (length < 16)
+          return false;
+
+        /* No timestamp in simple packet blocks */
+        packet->data  = self->map + self->offset + 12;
+        packet->size  = MIN(capfile_u32(self, self->offset + 8), length - 16);
+        packet->ts_ns = self->last_ts_ns;
+        self->offset += length;
+        return true;
+    }
+
+    self->offset += length;
+  }
+}
+
+METHOD(capfile, bool, next, struct capfile_packet *packet)
+{
+  switch (self->format) {
+    case CAPFILE_PCAP:
+      return capfile_next_pcap(self, packet);
+
+    case CAPFILE_PCAPNG:
+      return capfile_next_pcapng(self, packet);
+  }
+
+  return false;
+}
@@ -17,25 +17,36 @@
 
 */
 
-#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
 
+#include <ifshare.h>
 #include <client.h>
+#include <libifshare.h>
 #include <sys/poll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
 #include <string.h>
 #include <util.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <time.h>
+#include <ctype.h>
 
 static void *
 client_thread(void *userdata)
 {
   client_t *self = (client_t *) userdata;
-  frame_t *frame = NULL;
+  frame_t *frames[CLIENT_SEND_BATCH];
+  struct iovec iov[CLIENT_SEND_BATCH];
+  struct msghdr msg;
+  unsigned int i, count, first;
   char ack;
   struct pollfd fds[2];
   bool running = true;
+  int flags;
 
   fds[0].fd = self->cancelfd[0];
   fds[0].events = POLLIN;
@@ -43,14 +54,25 @@ client_thread(void *userdata)
   fds[1].fd = self->sfd;
   fds[1].events = POLLOUT;
 
-  while (running && (frame = fqueue_pop_frame(self->queue)) != NULL) {
-    ssize_t got,      p = 0;
-    ssize_t size        = frame->size;
-    const uint8_t *data = frame->data;
-
-    struct timeval otv, tv, diff;
+  if (CPU_COUNT(&self->params.cpus) > 0)
+    affinity_pin(&self->params.cpus);
+
+  /*
+   * Frames are sent in batches: everything that piled up in the queue
+   * since the last send is gathered into a single sendmsg(), so that
+   * the number of syscalls per frame goes down as the load goes up.
+   */
+  while (running
+    && (count = fqueue_pop_batch(self->queue, frames, CLIENT_SEND_BATCH)) > 0) {
+    ssize_t got;
+    uint64_t now, age;
+
+    for (i = 0; i < count; ++i) {
+      iov[i].iov_base = frames[i]->data;
+      iov[i].iov_len  = frames[i]->size;
+    }
 
-    otv = frame->timestamp;
+    first = 0;
 
     do {
       poll(fds, 2, 1000);
@@ -60,40 +82,366 @@ client_thread(void *userdata)
         Info("[%16s] Cancel request\n", self->name);
         running = false;
       } else if (fds[1].revents & POLLOUT) {
-        got = send(self->sfd, data + p, size - p, MSG_NOSIGNAL);
+        uint64_t t0, elapsed;
+
+        memset(&msg, 0, sizeof(struct msghdr));
+        msg.msg_iov    = iov + first;
+        msg.msg_iovlen = count - first;
+
+        /*
+         * More frames behind this batch: let the kernel hold a partial
+         * segment for them. The last send of a burst goes without
+         * MSG_MORE and, with TCP_NODELAY, leaves right away.
+         */
+        flags = MSG_NOSIGNAL;
+        if (self->tcp && self->params.cork && fqueue_count(self->queue) > 0) {
+          flags |= MSG_MORE;
+          STATS_INC(self->stats.corked_sends);
+        }
+
+        t0      = stats_now_ns();
+        got     = sendmsg(self->sfd, &msg, flags);
+        elapsed = stats_now_ns() - t0;
+
+        STATS_INC(self->stats.send_calls);
+        STATS_ADD(self->stats.send_ns, elapsed);
+        stats_max(&self->stats.send_ns_max, elapsed);
+
         if (got <= 0) {
           Warn("[%16s] Client vanished\n", self->name);
           running = false;
         } else {
-          p += got;
+          STATS_ADD(self->stats.sent_bytes, got);
+
+          /* Skip whatever was sent completely, trim the rest */
+          while (first < count && (size_t) got >= iov[first].iov_len)
+            got -= iov[first++].iov_len;
+
+          if (first < count) {
+            iov[first].iov_base  = (uint8_t *) iov[first].iov_base + got;
+            iov[first].iov_len  -= got;
+          }
         }
       } else {
-        gettimeofday(&tv, NULL);
-        timersub(&tv, &otv, &diff);
-
-        if (diff.tv_sec > 0)
-          Info(
-            "[%16s] Client slow (next frame is %ld.%06d s old)\n",
+        age = frame_age_ns(frames[first], frame_clock_ns());
+
+        if (age >= 1000000000ull)
+          LogLimited(
+            &self->slow_log,
+            CLIENT_SLOW_LOG_MS,
+            LogInfo,
+            "[%16s] Client slow (next frame is %llu.%06llu s old)\n",
             self->name,
-            diff.tv_sec,
-            diff.tv_usec);
+            (unsigned long long) (age / 1000000000ull),
+            (unsigned long long) (age % 1000000000ull) / 1000);
+      }
+    } while (running && first < count);
+
+    STATS_ADD(self->stats.sent_frames, first);
+
+    now = frame_clock_ns();
+    for (i = 0; i < first; ++i)
+      hist_record(&self->latency, frame_age_ns(frames[i], now));
+
+    for (i = 0; i < count; ++i)
+      frame_dec_ref(frames[i]);
+  }
+
+done:
+  __atomic_store_n(&self->thread_running, false, __ATOMIC_RELEASE);
+
+  /* Let the server reap us right away */
+  if (self->params.exitfd != -1) {
+    uint64_t one = 1;
+    write(self->params.exitfd, &one, sizeof(uint64_t));
+  }
+
+  return NULL;
+}
+
+/*
+ * Token bucket of the reverse path. Rather than dropping, the reader
+ * waits for the tokens: TCP then pushes back on the client.
+ */
+METHOD(client, static void, throttle, size_t size)
+{
+  uint64_t rate = self->params.reverse_rate;
+  double burst, wait;
+  uint64_t now;
+  struct timespec ts;
+
+  if (rate == 0)
+    return;
+
+  burst = (double) rate * CLIENT_REVERSE_BURST_MS / 1000;
+  if (burst < IFSHARE_MAX_MTU)
+    burst = IFSHARE_MAX_MTU;
+
+  for (;;) {
+    now = stats_now_ns();
+
+    self->tokens   += (double) (now - self->tokens_ts) * rate / 1e9;
+    self->tokens_ts = now;
+
+    if (self->tokens > burst)
+      self->tokens = burst;
+
+    if (self->tokens >= size) {
+      self->tokens -= size;
+      return;
+    }
+
+    /* Out of budget: let out what we queued, then wait */
+    if (self->params.reverse.flush != NULL)
+      (self->params.reverse.flush) (self->params.reverse.userdata);
+
+    wait = (size - self->tokens) * 1e9 / rate;
+    STATS_ADD(self->stats.reverse_throttled_ns, (uint64_t) wait);
+
+    ts.tv_sec  = (time_t) (wait / 1e9);
+    ts.tv_nsec = (long) (wait - ts.tv_sec * 1e9);
+    nanosleep(&ts, NULL);
+  }
+}
+
+static bool
+client_valid_name(const char *name)
+{
+  size_t len = strlen(name);
+
+  if (len == 0 || len >= GROUP_NAME_MAX)
+    return false;
+
+  for (; *name != '\0'; ++name)
+    if (!isalnum((unsigned char) *name) && strchr("-_.", *name) == NULL)
+      return false;
+
+  return true;
+}
+
+METHOD(client, static void, set_sampling, const struct client_hello *hello)
+{
+  uint32_t n;
+
+  if (self->sample_settled) {
+    if (hello->sample != IFSHARE_SAMPLE_NONE)
+      Warn("[%16s] Sampling can only be set when connecting\n", self->name);
+    return;
+  }
+
+  self->sample_settled = true;
+
+  if (hello->sample == IFSHARE_SAMPLE_NONE || hello->sample_rate <= 1)
+    return;
+
+  if (hello->sample == IFSHARE_SAMPLE_COUNT)
+    n = hello->sample_rate;
+  else
+    n = (1ull << 32) / hello->sample_rate;
+
+  /* The capture thread may be at it already: one store, no locking */
+  __atomic_store_n(
+    &self->sampling,
+    (uint64_t) hello->sample << 32 | n,
+    __ATOMIC_RELAXED);
+
+  Info(
+    "[%16s] Sampling 1 in %u (%s)\n",
+    self->name,
+    hello->sample_rate,
+    ifshare_sample_to_string(hello->sample));
+}
+
+/* KEY=VALUE lines. Unknown keys are ignored, for newer clients. */
+METHOD(client, static void, hello, const uint8_t *data, size_t size)
+{
+  struct client_hello hello;
+  char text[IFSHARE_HELLO_MAX + 1];
+  char *line, *value, *save = NULL;
+
+  if (self->params.control.hello == NULL)
+    return;
+
+  if (size > IFSHARE_HELLO_MAX) {
+    Warn("[%16s] Hello too long, ignored\n", self->name);
+    return;
+  }
+
+  memcpy(text, data, size);
+  text[size] = '\0';
+
+  memset(&hello, 0, sizeof(struct client_hello));
+
+  for (line = strtok_r(text, "\n", &save);
+    line != NULL;
+    line = strtok_r(NULL, "\n", &save)) {
+    if ((value = strchr(line, '=')) == NULL) {
+      Warn("[%16s] Malformed hello line `%s'\n", self->name, line);
+      continue;
+    }
+
+    *value++ = '\0';
+
+    if (strcmp(line, "group") == 0) {
+      if (client_valid_name(value))
+        strcpy(hello.group, value);
+      else
+        Warn("[%16s] Invalid group name `%s'\n", self->name, value);
+    } else if (strcmp(line, "sample") == 0) {
+      if (!ifshare_sample_from_string(
+        value,
+        &hello.sample,
+        &hello.sample_rate))
+        Warn("[%16s] Invalid sampling `%s'\n", self->name, value);
+    } else {
+      Warn("[%16s] Unknown hello setting `%s'\n", self->name, line);
+    }
+  }
+
+  client_set_sampling(self, &hello);
+
+  if (!(self->params.control.hello) (
+    self->params.control.userdata,
+    self,
+    &hello))
+    Warn("[%16s] Hello rejected\n", self->name);
+}
+
+/*
+ * Frames sent by the client, with the same framing as ours: a hello, or
+ * frames for the reverse path, which go to the sink. Only started once
+ * the client sent something.
+ */
+static void *
+client_reader_thread(void *userdata)
+{
+  client_t *self = (client_t *) userdata;
+  const struct client_sink *sink = &self->params.reverse;
+  size_t size = CLIENT_REVERSE_FRAMES * (IFSHARE_MAX_MTU + IFSHARE_MAX_HEADER);
+  struct ifshare_pdu header;
+  size_t avail = 0, p, hdrsize;
+  uint8_t *buffer = NULL;
+  ssize_t got;
+
+  if (CPU_COUNT(&self->params.cpus) > 0)
+    affinity_pin(&self->params.cpus);
+
+  TRY(buffer = malloc(size));
+
+  self->tokens_ts = stats_now_ns();
+
+  while ((got = recv(self->sfd, buffer + avail, size - avail, 0)) > 0) {
+    avail += got;
+    p      = 0;
+
+    while (avail - p >= sizeof(struct ifshare_pdu)) {
+      memcpy(&header, buffer + p, sizeof(struct ifshare_pdu));
+
+      if ((hdrsize = ifshare_header_size(header.is_magic)) == 0
+        || header.is_size > IFSHARE_MAX_MTU) {
+        Warn("[%16s] Invalid PDU from client, closing\n", self->name);
+        shutdown(self->sfd, SHUT_RDWR);
+        goto done;
+      }
+
+      if (avail - p < hdrsize + header.is_size)
+        break;
+
+      if (header.is_magic == IFSHARE_MAGIC_HELLO) {
+        client_hello(self, buffer + p + hdrsize, header.is_size);
+      } else if (sink->push == NULL) {
+        STATS_INC(self->stats.reverse_dropped);
+      } else {
+        client_throttle(self, header.is_size);
+
+        if ((sink->push) (
+          sink->userdata,
+          buffer + p + hdrsize,
+          header.is_size)) {
+          STATS_INC(self->stats.reverse_frames);
+          STATS_ADD(self->stats.reverse_bytes, header.is_size);
+        } else {
+          STATS_INC(self->stats.reverse_dropped);
+        }
       }
-    } while (running && p < size);
 
-    frame_dec_ref(frame);
+      p += hdrsize + header.is_size;
+    }
+
+    if (p > 0) {
+      memmove(buffer, buffer + p, avail - p);
+      avail -= p;
+    }
+
+    /* One kick for everything this recv() brought in */
+    if (sink->flush != NULL)
+      (sink->flush) (sink->userdata);
   }
 
 done:
-  self->thread_running = false;
+  if (buffer != NULL)
+    free(buffer);
+
   return NULL;
 }
 
-INSTANCER(client, int sfd, char *name)
+/*
+ * Keeps the backlog in our queue, where the drop policy and the stats
+ * see it, rather than in the kernel's send buffer: with a low
+ * TCP_NOTSENT_LOWAT, POLLOUT is only reported once most of what was
+ * written has gone out. Failures are not fatal.
+ */
+METHOD(client, static void, tune_socket)
+{
+  int protocol, value;
+  socklen_t len = sizeof(int);
+
+  if (getsockopt(self->sfd, SOL_SOCKET, SO_PROTOCOL, &protocol, &len) == -1
+    || protocol != IPPROTO_TCP)
+    return;
+
+  self->tcp = true;
+
+  if (self->params.sndbuf > 0) {
+    value = self->params.sndbuf;
+    if (setsockopt(self->sfd, SOL_SOCKET, SO_SNDBUF, &value, sizeof(int))
+      == -1)
+      Warn("[%16s] Cannot set SO_SNDBUF: %s\n", self->name, strerror(errno));
+  }
+
+  if (self->params.notsent_lowat > 0) {
+    value = self->params.notsent_lowat;
+    if (setsockopt(
+      self->sfd,
+      IPPROTO_TCP,
+      TCP_NOTSENT_LOWAT,
+      &value,
+      sizeof(int)) == -1)
+      Warn(
+        "[%16s] Cannot set TCP_NOTSENT_LOWAT: %s\n",
+        self->name,
+        strerror(errno));
+  }
+
+  value = self->params.nodelay;
+  if (setsockopt(self->sfd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(int))
+    == -1)
+    Warn("[%16s] Cannot set TCP_NODELAY: %s\n", self->name, strerror(errno));
+}
+
+INSTANCER(
+  client,
+  int sfd,
+  char *name,
+  const struct client_params *params)
 {
   client_t *new = NULL;
+  struct client_params defaults = client_params_INITIALIZER;
 
   ALLOCATE_FAIL(new, client_t);
 
+  new->params = params != NULL ? *params : defaults;
+
   new->sfd         = sfd;
   new->cancelfd[0] = -1;
   new->cancelfd[1] = -1;
@@ -103,23 +451,30 @@ INSTANCER(client, int sfd, char *name)
   if (name != NULL) {
     TRY_FAIL(new->name = strdup(name));
   } else {
-    struct sockaddr_in addr;
-    socklen_t socklen;
+    struct sockaddr_storage addr;
+    socklen_t socklen = sizeof(struct sockaddr_storage);
 
-    TRYC_FAIL(getsockname(sfd, (struct sockaddr *) &addr, &socklen));
-    TRY_FAIL(
-      new->name = strbuild(
-        "%s:%d",
-        inet_ntoa(addr.sin_addr),
-        ntohs(addr.sin_port)));
+    TRYC_FAIL(getpeername(sfd, (struct sockaddr *) &addr, &socklen));
+    TRY_FAIL(new->name = sockaddr_to_string((struct sockaddr *) &addr));
   }
 
+  client_tune_socket(new);
+
   TRYC_FAIL(pipe(new->cancelfd));
-  TRYZ_FAIL(pthread_create(&new->client_thread, NULL, client_thread, new));
-  
+
+  /* Before the thread starts: it may be gone before we get back here */
   new->thread_running = true;
+  if (pthread_create(&new->client_thread, NULL, client_thread, new) != 0) {
+    new->thread_running = false;
+    Err("[%16s] Cannot create client thread\n", new->name);
+    goto fail;
+  }
+
   new->thread_started = true;
-  
+
+  /* Any nonzero seed will do, as long as clients do not share it */
+  new->sample_rng = (frame_clock_ns() ^ (uintptr_t) new) | 1;
+
   Info("[%16s] New client\n", new->name);
 
   return new;
@@ -131,23 +486,52 @@ fail:
   return NULL;
 }
 
+METHOD(client, bool, start_reader)
+{
+  /* Nobody to hand what it sends to: leave it in the socket */
+  if (self->reader_started
+    || (self->params.reverse.push == NULL
+      && self->params.control.hello == NULL))
+    return true;
+
+  if (pthread_create(
+    &self->reader_thread,
+    NULL,
+    client_reader_thread,
+    self) != 0) {
+    Err("[%16s] Cannot create reader thread\n", self->name);
+    return false;
+  }
+
+  self->reader_started = true;
+
+  return true;
+}
+
 COLLECTOR(client)
 {
   if (self->thread_started) {
     if (self->thread_running) {
       char b = 1;
       write(self->cancelfd[1], &b, 1); /* Force cancellation */
+      fqueue_push_frame(self->queue, NULL); /* Wake up if idle */
     }
 
     pthread_join(self->client_thread, NULL);
   }
 
+  if (self->reader_started) {
+    shutdown(self->sfd, SHUT_RD); /* recv() returns 0 */
+    pthread_join(self->reader_thread, NULL);
+  }
+
   if (self->name != NULL)
     free(self->name);
 
   if (self->cancelfd[0] != -1)
     close(self->cancelfd[0]);
-  else if (self->cancelfd[1] != -1)
+
+  if (self->cancelfd[1] != -1)
     close(self->cancelfd[1]);
 
   if (self->queue != NULL)
@@ -160,8 +544,88 @@ COLLECTOR(client)
 
 METHOD(client, bool, push_frame, frame_t *frame)
 {
+  unsigned int depth = fqueue_count(self->queue);
+
+  if (self->params.max_queue > 0 && depth >= self->params.max_queue) {
+    STATS_INC(self->stats.dropped_frames);
+    return true;
+  }
+
   if (frame != NULL)
     frame_inc_ref(frame);
 
-  return fqueue_push_frame(self->queue, frame);
+  if (!fqueue_push_frame(self->queue, frame)) {
+    STATS_INC(self->stats.dropped_frames);
+    return false;
+  }
+
+  STATS_INC(self->stats.queued_frames);
+  stats_max(&self->stats.queue_hwm, depth + 1);
+
+  return true;
+}
+
+/*
+ * Ends the stream: the client thread exits after sending everything that
+ * was queued before. Returns false if it did not finish in time, in which
+ * case the collector will cancel it.
+ */
+METHOD(client, bool, end_stream)
+{
+  if (!self->thread_started)
+    return true;
+
+  return fqueue_push_frame(self->queue, NULL);
+}
+
+#define CLIENT_STAT(fp, self, metric, value)          \
+  fprintf(                                            \
+    fp,                                               \
+    "ifshare_client_" metric "{client=\"%s\"} %llu\n", \
+    self->name,                                       \
+    (unsigned long long) (value))
+
+#define CLIENT_QUANTILE(fp, self, q, value)                       \
+  fprintf(                                                        \
+    fp,                                                           \
+    "ifshare_client_latency_ns{client=\"%s\",quantile=\"" q "\"} %llu\n", \
+    self->name,                                                   \
+    (unsigned long long) (value))
+
+METHOD(client, void, dump_stats, FILE *fp)
+{
+  CLIENT_STAT(fp, self, "running", client_running(self));
+  CLIENT_STAT(fp, self, "queue_depth", fqueue_count(self->queue));
+  CLIENT_STAT(fp, self, "queue_hwm", STATS_GET(self->stats.queue_hwm));
+  CLIENT_STAT(fp, self, "queued_frames", STATS_GET(self->stats.queued_frames));
+  CLIENT_STAT(fp, self, "dropped_frames", STATS_GET(self->stats.dropped_frames));
+  CLIENT_STAT(fp, self, "sent_frames", STATS_GET(self->stats.sent_frames));
+  CLIENT_STAT(fp, self, "sent_bytes", STATS_GET(self->stats.sent_bytes));
+  CLIENT_STAT(
+    fp,
+    self,
+    "unsampled_frames",
+    STATS_GET(self->stats.unsampled_frames));
+  CLIENT_STAT(fp, self, "send_calls", STATS_GET(self->stats.send_calls));
+  CLIENT_STAT(fp, self, "send_ns_total", STATS_GET(self->stats.send_ns));
+  CLIENT_STAT(fp, self, "send_ns_max", STATS_GET(self->stats.send_ns_max));
+  CLIENT_STAT(fp, self, "corked_sends", STATS_GET(self->stats.corked_sends));
+
+  if (self->params.reverse.push != NULL) {
+    CLIENT_STAT(fp, self, "reverse_frames", STATS_GET(self->stats.reverse_frames));
+    CLIENT_STAT(fp, self, "reverse_bytes", STATS_GET(self->stats.reverse_bytes));
+    CLIENT_STAT(fp, self, "reverse_dropped", STATS_GET(self->stats.reverse_dropped));
+    CLIENT_STAT(
+      fp,
+      self,
+      "reverse_throttled_ns",
+      STATS_GET(self->stats.reverse_throttled_ns));
+  }
+
+  CLIENT_QUANTILE(fp, self, "0.5", hist_percentile(&self->latency, .5));
+  CLIENT_QUANTILE(fp, self, "0.99", hist_percentile(&self->latency, .99));
+  CLIENT_QUANTILE(fp, self, "0.999", hist_percentile(&self->latency, .999));
+  CLIENT_QUANTILE(fp, self, "1", hist_max(&self->latency));
+  CLIENT_STAT(fp, self, "latency_ns_count", hist_count(&self->latency));
+  CLIENT_STAT(fp, self, "latency_ns_sum", STATS_GET(self->latency.sum));
 }
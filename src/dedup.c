@@ -0,0 +1,147 @@
+/*
+  dedup.c: Suppression of duplicate frames
+  Copyright (C) 2025 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, version 3.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <dedup.h>
+#include <stats.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+static uint64_t
+dedup_key(const struct flow *flow, const uint8_t *data, size_t size)
+{
+  uint8_t buf[DEDUP_HASH_BYTES + 8];
+  size_t start = (flow->flags & FLOW_F_IP) ? flow->l3 : 0;
+  size_t len   = MIN(size - start, DEDUP_HASH_BYTES);
+  uint64_t h   = (size - start) * 0x9e3779b97f4a7c15ull;
+  uint64_t word;
+  size_t i;
+
+  memcpy(buf, data + start, len);
+  memset(buf + len, 0, 8);
+
+  /* Whatever a router changes on the way (parsing checked the length) */
+  if (flow->flags & FLOW_F_IP) {
+    if (flow->addr_len == 4) {
+      buf[8]  = 0;
+      buf[10] = buf[11] = 0;
+    } else {
+      buf[7] = 0;
+    }
+  }
+
+  for (i = 0; i < len; i += 8) {
+    memcpy(&word, buf + i, 8);
+    h  = (h ^ word) * 0x9e3779b97f4a7c15ull;
+    h ^= h >> 32;
+  }
+
+  h ^= h >> 29;
+  h *= 0xbf58476d1ce4e5b9ull;
+  h ^= h >> 32;
+
+  return h;
+}
+
+INSTANCER(dedup, unsigned int window_us)
+{
+  dedup_t *new = NULL;
+
+  ALLOCATE_FAIL(new, dedup_t);
+
+  TRYZ_FAIL(posix_memalign(
+    (void **) &new->buckets,
+    sizeof(struct dedup_bucket),
+    DEDUP_BUCKETS * sizeof(struct dedup_bucket)));
+
+  memset(new->buckets, 0, DEDUP_BUCKETS * sizeof(struct dedup_bucket));
+
+  new->window_ns = window_us * 1000ull;
+
+  return new;
+
+fail:
+  if (new != NULL)
+    DISPOSE(dedup, new);
+
+  return NULL;
+}
+
+COLLECTOR(dedup)
+{
+  if (self->buckets != NULL)
+    free(self->buckets);
+
+  free(self);
+}
+
+METHOD(dedup, bool, check, frame_t *frame, size_t offset)
+{
+  const struct flow *flow = frame_flow(frame, offset);
+  uint64_t now = frame_timestamp_ns(frame);
+  uint64_t key, age, victim_age = 0;
+  struct dedup_bucket *bucket;
+  struct dedup_entry *entry, *victim = NULL;
+  unsigned int i;
+
+  key = dedup_key(
+    flow,
+    frame->data + offset,
+    frame->size > offset ? frame->size - offset : 0);
+
+  bucket = self->buckets + (key & (DEDUP_BUCKETS - 1));
+
+  STATS_INC(self->stats.checked);
+
+  for (i = 0; i < DEDUP_WAYS; ++i) {
+    entry = bucket->way + i;
+    age   = entry->ns == 0 ? UINT64_MAX : now - MIN(now, entry->ns);
+
+    if (entry->key == key && age <= self->window_ns) {
+      STATS_INC(self->stats.dropped);
+      return true;
+    }
+
+    if (victim == NULL || age > victim_age) {
+      victim     = entry;
+      victim_age = age;
+    }
+  }
+
+  if (victim_age <= self->window_ns)
+    STATS_INC(self->stats.evictions);
+
+  victim->key = key;
+  victim->ns  = now;
+
+  return false;
+}
+
+#define DEDUP_STAT(fp, metric, value)  \
+  fprintf(                             \
+    fp,                                \
+    "ifshare_dedup_" metric " %llu\n", \
+    (unsigned long long) (value))
+
+METHOD(dedup, void, dump_stats, FILE *fp)
+{
+  DEDUP_STAT(fp, "checked_frames", STATS_GET(self->stats.checked));
+  DEDUP_STAT(fp, "dropped_frames", STATS_GET(self->stats.dropped));
+  DEDUP_STAT(fp, "evictions", STATS_GET(self->stats.evictions));
+}
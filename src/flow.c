@@ -0,0 +1,420 @@
+/*
+  flow.c: Flow classification of captured frames
+  Copyright (C) 2025 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, version 3.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <flow.h>
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  include <immintrin.h>
+#  define FLOW_HAVE_AVX2
+#  define FLOW_AVX2 __attribute__((target("avx2")))
+#endif
+
+#define FLOW_ETH_HLEN    14
+#define FLOW_ETH_IPV4    0x0800
+#define FLOW_ETH_IPV6    0x86dd
+#define FLOW_ETH_VLAN    0x8100
+#define FLOW_ETH_QINQ    0x88a8
+
+#define FLOW_PROTO_TCP   6
+#define FLOW_PROTO_UDP   17
+#define FLOW_PROTO_SCTP  132
+
+#define FLOW_IPV6_HOPOPTS  0
+#define FLOW_IPV6_ROUTING  43
+#define FLOW_IPV6_FRAGMENT 44
+#define FLOW_IPV6_DSTOPTS  60
+
+/* Both addresses, the ports and the protocol */
+#define FLOW_KEY_WORDS   10
+#define FLOW_AVX2_LANES  8
+
+typedef void (*flow_kernel_t) (struct flow *const *, unsigned int);
+
+static inline uint16_t
+flow_be16(const uint8_t *p)
+{
+  return (p[0] << 8) | p[1];
+}
+
+/******************************** Header parsing ******************************/
+static inline bool
+flow_has_ports(uint8_t proto)
+{
+  return proto == FLOW_PROTO_TCP
+    || proto == FLOW_PROTO_UDP
+    || proto == FLOW_PROTO_SCTP;
+}
+
+static bool
+flow_parse_ipv4(struct flow *flow, const uint8_t *data, size_t size)
+{
+  const uint8_t *ip = data + flow->l3;
+  size_t avail = size - flow->l3;
+  size_t hlen;
+
+  if (avail < 20 || (ip[0] >> 4) != 4 || (hlen = (ip[0] & 0xf) * 4) < 20)
+    return false;
+
+  flow->flags   |= FLOW_F_IP;
+  flow->addr_len = 4;
+  flow->proto    = ip[9];
+  memcpy(flow->addr[0], ip + 12, 4);
+  memcpy(flow->addr[1], ip + 16, 4);
+
+  /* More fragments, or not the first one */
+  if (flow_be16(ip + 6) & 0x3fff) {
+    flow->flags |= FLOW_F_FRAGMENT;
+    return true;
+  }
+
+  if (avail >= hlen)
+    flow->l4 = flow->l3 + hlen;
+
+  if (flow_has_ports(flow->proto) && avail >= hlen + 4) {
+    flow->flags  |= FLOW_F_PORTS;
+    flow->port[0] = flow_be16(ip + hlen);
+    flow->port[1] = flow_be16(ip + hlen + 2);
+  }
+
+  return true;
+}
+
+static bool
+flow_parse_ipv6(struct flow *flow, const uint8_t *data, size_t size)
+{
+  const uint8_t *ip = data + flow->l3;
+  size_t avail = size - flow->l3;
+  size_t off = 40;
+  uint8_t next;
+
+  if (avail < 40 || (ip[0] >> 4) != 6)
+    return false;
+
+  flow->flags   |= FLOW_F_IP;
+  flow->addr_len = 16;
+  memcpy(flow->addr[0], ip + 8, 16);
+  memcpy(flow->addr[1], ip + 24, 16);
+
+  next = ip[6];
+
+  while ((next == FLOW_IPV6_HOPOPTS
+    || next == FLOW_IPV6_ROUTING
+    || next == FLOW_IPV6_DSTOPTS)
+    && avail >= off + 8) {
+    next = ip[off];
+    off += (ip[off + 1] + 1) * 8;
+  }
+
+  flow->proto = next;
+
+  if (next == FLOW_IPV6_FRAGMENT) {
+    flow->flags |= FLOW_F_FRAGMENT;
+    return true;
+  }
+
+  if (avail >= off)
+    flow->l4 = flow->l3 + off;
+
+  if (flow_has_ports(next) && avail >= off + 4) {
+    flow->flags  |= FLOW_F_PORTS;
+    flow->port[0] = flow_be16(ip + off);
+    flow->port[1] = flow_be16(ip + off + 2);
+  }
+
+  return true;
+}
+
+void
+flow_parse(struct flow *flow, const uint8_t *data, size_t size)
+{
+  size_t off = 12;
+  bool ip = false;
+
+  memset(flow, 0, sizeof(struct flow));
+
+  flow->addr_len = 6;
+
+  if (size < FLOW_ETH_HLEN) {
+    memcpy(flow->addr[0], data, size < 6 ? size : 6);
+    if (size > 6)
+      memcpy(flow->addr[1], data + 6, size - 6);
+    return;
+  }
+
+  flow->type = flow_be16(data + off);
+
+  while ((flow->type == FLOW_ETH_VLAN || flow->type == FLOW_ETH_QINQ)
+    && size >= off + 6) {
+    flow->flags |= FLOW_F_VLAN;
+    flow->vlan   = flow_be16(data + off + 2) & 0xfff;
+    off         += 4;
+    flow->type   = flow_be16(data + off);
+  }
+
+  flow->l3 = off + 2;
+
+  if (flow->type == FLOW_ETH_IPV4)
+    ip = flow_parse_ipv4(flow, data, size);
+  else if (flow->type == FLOW_ETH_IPV6)
+    ip = flow_parse_ipv6(flow, data, size);
+
+  if (!ip) {
+    memcpy(flow->addr[0], data, 6);
+    memcpy(flow->addr[1], data + 6, 6);
+    flow->port[0] = flow->port[1] = flow->type;
+  }
+}
+
+/*********************************** Hashing **********************************/
+/*
+ * Lays out the key of a flow as 32-bit words, `stride' words apart:
+ * lower endpoint first, so that both directions give the same words.
+ */
+static inline unsigned int
+flow_key_words(const struct flow *flow, uint32_t *words, size_t stride)
+{
+  unsigned int len = (flow->addr_len + 3) / 4;
+  unsigned int i, n = 0, lo, hi;
+  uint64_t addr[2][2];
+  uint32_t word[2][4];
+
+  /* Addresses are zero-padded: any fixed order of the words will do */
+  memcpy(addr, flow->addr, sizeof(addr));
+  memcpy(word, flow->addr, sizeof(word));
+
+  if (addr[0][0] != addr[1][0])
+    lo = addr[0][0] > addr[1][0];
+  else if (addr[0][1] != addr[1][1])
+    lo = addr[0][1] > addr[1][1];
+  else
+    lo = flow->port[0] > flow->port[1];
+
+  hi = !lo;
+
+  for (i = 0; i < len; ++i)
+    words[n++ * stride] = word[lo][i];
+
+  for (i = 0; i < len; ++i)
+    words[n++ * stride] = word[hi][i];
+
+  words[n++ * stride] = ((uint32_t) flow->port[lo] << 16) | flow->port[hi];
+  words[n++ * stride] = flow->proto | (flow->addr_len << 8);
+
+  return n;
+}
+
+static inline uint32_t
+flow_mix(uint32_t h, uint32_t k)
+{
+  k *= 0xcc9e2d51;
+  k  = (k << 15) | (k >> 17);
+  k *= 0x1b873593;
+
+  h ^= k;
+  h  = (h << 13) | (h >> 19);
+
+  return h * 5 + 0xe6546b64;
+}
+
+static inline uint32_t
+flow_finalize(uint32_t h)
+{
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+
+  return h;
+}
+
+static void
+flow_hash_scalar(struct flow *const *flows, unsigned int count)
+{
+  uint32_t words[FLOW_KEY_WORDS];
+  uint32_t h;
+  unsigned int i, j, n;
+
+  for (i = 0; i < count; ++i) {
+    n = flow_key_words(flows[i], words, 1);
+    h = 0;
+
+    for (j = 0; j < n; ++j)
+      h = flow_mix(h, words[j]);
+
+    flows[i]->hash = flow_finalize(h);
+  }
+}
+
+#ifdef FLOW_HAVE_AVX2
+static inline FLOW_AVX2 __m256i
+flow_rotl8(__m256i x, int r)
+{
+  return _mm256_or_si256(_mm256_slli_epi32(x, r), _mm256_srli_epi32(x, 32 - r));
+}
+
+static inline FLOW_AVX2 __m256i
+flow_mix8(__m256i h, __m256i k)
+{
+  k = _mm256_mullo_epi32(k, _mm256_set1_epi32(0xcc9e2d51));
+  k = flow_rotl8(k, 15);
+  k = _mm256_mullo_epi32(k, _mm256_set1_epi32(0x1b873593));
+
+  h = _mm256_xor_si256(h, k);
+  h = flow_rotl8(h, 13);
+
+  return _mm256_add_epi32(
+    _mm256_add_epi32(_mm256_slli_epi32(h, 2), h),
+    _mm256_set1_epi32(0xe6546b64));
+}
+
+static inline FLOW_AVX2 __m256i
+flow_finalize8(__m256i h)
+{
+  h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+  h = _mm256_mullo_epi32(h, _mm256_set1_epi32(0x85ebca6b));
+  h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 13));
+  h = _mm256_mullo_epi32(h, _mm256_set1_epi32(0xc2b2ae35));
+  h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+
+  return h;
+}
+
+/*
+ * The scalar hash, eight flows at a time. Keys are laid out one word
+ * per row so each row loads straight into a register. Lanes with
+ * shorter keys (IPv4 next to IPv6) just stop taking the mixed value.
+ */
+static FLOW_AVX2 void
+flow_hash_avx2(struct flow *const *flows, unsigned int count)
+{
+  uint32_t words[FLOW_KEY_WORDS][FLOW_AVX2_LANES] = {{0}};
+  uint32_t len[FLOW_AVX2_LANES];
+  uint32_t hash[FLOW_AVX2_LANES];
+  unsigned int i, j, base, max;
+  __m256i h, n;
+
+  for (base = 0; base + FLOW_AVX2_LANES <= count; base += FLOW_AVX2_LANES) {
+    max = 0;
+
+    for (i = 0; i < FLOW_AVX2_LANES; ++i) {
+      len[i] = flow_key_words(flows[base + i], &words[0][i], FLOW_AVX2_LANES);
+      if (len[i] > max)
+        max = len[i];
+    }
+
+    h = _mm256_setzero_si256();
+    n = _mm256_loadu_si256((const __m256i *) len);
+
+    for (j = 0; j < max; ++j)
+      h = _mm256_blendv_epi8(
+        h,
+        flow_mix8(h, _mm256_loadu_si256((const __m256i *) words[j])),
+        _mm256_cmpgt_epi32(n, _mm256_set1_epi32(j)));
+
+    _mm256_storeu_si256((__m256i *) hash, flow_finalize8(h));
+
+    for (i = 0; i < FLOW_AVX2_LANES; ++i)
+      flows[base + i]->hash = hash[i];
+  }
+
+  flow_hash_scalar(flows + base, count - base);
+}
+#endif /* FLOW_HAVE_AVX2 */
+
+static const struct {
+  const char   *name;
+  flow_kernel_t func;
+} g_flow_kernels[] = {
+  [FLOW_KERNEL_AUTO]   = {"auto",   NULL},
+  [FLOW_KERNEL_SCALAR] = {"scalar", flow_hash_scalar},
+#ifdef FLOW_HAVE_AVX2
+  [FLOW_KERNEL_AVX2]   = {"avx2",   flow_hash_avx2},
+#else
+  [FLOW_KERNEL_AVX2]   = {"avx2",   NULL},
+#endif /* FLOW_HAVE_AVX2 */
+};
+
+/* Resolved on first use */
+static enum flow_kernel g_flow_kernel = FLOW_KERNEL_AUTO;
+
+static bool
+flow_kernel_supported(enum flow_kernel kernel)
+{
+  if (g_flow_kernels[kernel].func == NULL)
+    return false;
+
+#ifdef FLOW_HAVE_AVX2
+  if (kernel == FLOW_KERNEL_AVX2)
+    return __builtin_cpu_supports("avx2");
+#endif /* FLOW_HAVE_AVX2 */
+
+  return true;
+}
+
+bool
+flow_set_kernel(enum flow_kernel kernel)
+{
+  if (kernel == FLOW_KERNEL_AUTO)
+    kernel = flow_kernel_supported(FLOW_KERNEL_AVX2)
+      ? FLOW_KERNEL_AVX2
+      : FLOW_KERNEL_SCALAR;
+  else if (!flow_kernel_supported(kernel))
+    return false;
+
+  __atomic_store_n(&g_flow_kernel, kernel, __ATOMIC_RELAXED);
+
+  return true;
+}
+
+const char *
+flow_kernel_name(void)
+{
+  if (__atomic_load_n(&g_flow_kernel, __ATOMIC_RELAXED) == FLOW_KERNEL_AUTO)
+    flow_set_kernel(FLOW_KERNEL_AUTO);
+
+  return g_flow_kernels[g_flow_kernel].name;
+}
+
+void
+flow_hash_batch(struct flow *const *flows, unsigned int count)
+{
+  enum flow_kernel kernel = __atomic_load_n(&g_flow_kernel, __ATOMIC_RELAXED);
+
+  if (kernel == FLOW_KERNEL_AUTO) {
+    flow_set_kernel(FLOW_KERNEL_AUTO);
+    kernel = __atomic_load_n(&g_flow_kernel, __ATOMIC_RELAXED);
+  }
+
+  (g_flow_kernels[kernel].func) (flows, count);
+}
+
+uint32_t
+flow_hash(const uint8_t *data, size_t size)
+{
+  struct flow flow;
+  struct flow *ptr = &flow;
+
+  flow_parse(&flow, data, size);
+  flow_hash_scalar(&ptr, 1);
+
+  return flow.hash;
+}
@@ -90,6 +90,8 @@ METHOD(fqueue, bool, push_frame, frame_t *frame)
   current->frame = frame;
   frame = NULL;
 
+  __atomic_store_n(&self->count, self->count + 1, __ATOMIC_RELAXED);
+
   pthread_cond_signal(&self->cond);  
 
   ok = true;
@@ -102,40 +104,93 @@ done:
   return ok;
 }
 
-METHOD(fqueue, frame_t *, pop_frame)
+/*
+ * Pops up to max frames, waiting at most timeout_ms for the first one
+ * (forever if negative). Returns 0 on timeout or when the end-of-stream
+ * marker is found.
+ */
+METHOD(
+  fqueue,
+  unsigned int,
+  pop_batch_timeout,
+  frame_t **frames,
+  unsigned int max,
+  int timeout_ms)
 {
-  frame_t *frame = NULL;
-  struct fqueue_frame *first;
-  struct fqueue_frame *last;
+  unsigned int count = 0;
   struct fqueue_frame *current;
+  struct timespec deadline;
+
+  if (timeout_ms >= 0) {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec  += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000l;
+    if (deadline.tv_nsec >= 1000000000l) {
+      deadline.tv_nsec -= 1000000000l;
+      ++deadline.tv_sec;
+    }
+  }
 
   pthread_mutex_lock(&self->mutex);
 
-  while (self->first == NULL)
-    pthread_cond_wait(&self->cond, &self->mutex);
-  
-  /* No inc/ref, ownership is transferred directly to the caller */
-  first   = self->first;
-  last    = self->last;
-  current = first;
+  while (self->first == NULL) {
+    if (timeout_ms < 0) {
+      pthread_cond_wait(&self->cond, &self->mutex);
+    } else if (pthread_cond_timedwait(&self->cond, &self->mutex, &deadline)
+      != 0) {
+      if (self->first == NULL) {
+        pthread_mutex_unlock(&self->mutex);
+        return 0;
+      }
+    }
+  }
 
-  frame   = current->frame;
+  /*
+   * NULL frames act as end-of-stream markers: they are only consumed when
+   * they are at the head of the queue, so that batches never cross them.
+   */
+  if (self->first->frame == NULL)
+    max = 1;
+
+  while (count < max && (current = self->first) != NULL) {
+    if (current->frame == NULL && count > 0)
+      break;
+
+    /* No inc/ref, ownership is transferred directly to the caller */
+    frames[count++] = current->frame;
+
+    self->first = current->next;
+    if (self->first != NULL)
+      self->first->prev = NULL;
+    else
+      self->last = NULL;
+
+    /* Cache this one here */
+    current->prev = NULL;
+    current->next = self->free;
+    self->free    = current;
+  }
 
-  if (first == last)
-    last = NULL;
-  
-  first = first->next;
-  if (first != NULL)
-    first->prev = NULL;
-  
-  self->first       = first;
-  self->last        = last;
-  
-  /* Cache this one here */
-  current->prev = NULL;
-  current->next = self->free;
+  __atomic_store_n(&self->count, self->count - count, __ATOMIC_RELAXED);
 
   pthread_mutex_unlock(&self->mutex);
 
+  if (count == 1 && frames[0] == NULL)
+    count = 0;
+
+  return count;
+}
+
+METHOD(fqueue, unsigned int, pop_batch, frame_t **frames, unsigned int max)
+{
+  return fqueue_pop_batch_timeout(self, frames, max, -1);
+}
+
+METHOD(fqueue, frame_t *, pop_frame)
+{
+  frame_t *frame = NULL;
+
+  (void) fqueue_pop_batch(self, &frame, 1);
+
   return frame;
 }
@@ -19,13 +19,15 @@
 
 #include <frame.h>
 
+#define FRAME_FLOW_BATCH 64
+
 static pthread_mutex_t g_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
 static frame_t        *g_pool       = NULL;
 
-INSTANCER(frame, size_t size)
+static frame_t *
+frame_alloc(void)
 {
   frame_t *new = NULL;
-  bool complete = false;
 
   pthread_mutex_lock(&g_pool_mutex);
 
@@ -41,30 +43,81 @@ INSTANCER(frame, size_t size)
     TRYZ_FAIL(pthread_mutex_init(&new->mutex, NULL));
   }
 
-  complete = true;
+  new->flow_valid = false;
+
+  return new;
+
+fail:
+  if (new != NULL)
+    free(new);
+
+  return NULL;
+}
+
+INSTANCER(frame, size_t size)
+{
+  frame_t *new = NULL;
 
+  TRY_FAIL(new = frame_alloc());
   TRY_FAIL(frame_resize(new, size));
 
   new->refcnt = 0;
   frame_inc_ref(new);
 
-  gettimeofday(&new->timestamp, NULL);
-
   return new;
 
 fail:
-  if (new != NULL) {
-    if (complete)
-      DISPOSE(frame, new);
-    else
-      free(new);
-  }
+  if (new != NULL)
+    DISPOSE(frame, new);
   
   return NULL;
 }
 
+/*
+ * Wraps a buffer owned by someone else (e.g. an AF_XDP UMEM chunk). The
+ * frame's own buffer is put aside, and release() is called when the last
+ * reference is dropped so the owner can reclaim the memory.
+ */
+frame_t *
+frame_wrap(
+  void *data,
+  size_t size,
+  size_t alloc,
+  frame_release_cb_t release,
+  void *release_data)
+{
+  frame_t *new = NULL;
+
+  TRY_FAIL(new = frame_alloc());
+
+  new->own_data     = new->data;
+  new->own_alloc    = new->alloc;
+
+  new->data         = data;
+  new->size         = size;
+  new->alloc        = alloc;
+  new->release      = release;
+  new->release_data = release_data;
+
+  new->refcnt = 0;
+  frame_inc_ref(new);
+
+  return new;
+
+fail:
+  return NULL;
+}
+
 COLLECTOR(frame)
 {
+  if (self->release != NULL) {
+    (self->release) (self, self->release_data);
+
+    self->data    = self->own_data;
+    self->alloc   = self->own_alloc;
+    self->release = NULL;
+  }
+
   pthread_mutex_lock(&g_pool_mutex);
 
   self->next = g_pool;
@@ -77,6 +130,9 @@ METHOD(frame, bool, resize, size_t size)
 {
   bool ok = false;
 
+  /* Borrowed memory cannot grow */
+  TRY(size <= self->alloc || self->release == NULL);
+
   if (size > self->alloc) {
     size_t new_alloc = self->alloc;
     uint8_t *tmp;
@@ -110,6 +166,52 @@ GETTER(frame, size_t, allocation)
   return self->alloc;
 }
 
+METHOD(frame, static void, parse_flow, size_t offset)
+{
+  flow_parse(
+    &self->flow,
+    self->data + offset,
+    self->size > offset ? self->size - offset : 0);
+
+  self->flow_valid = true;
+}
+
+METHOD(frame, const struct flow *, flow, size_t offset)
+{
+  struct flow *flow = &self->flow;
+
+  if (!self->flow_valid) {
+    frame_parse_flow(self, offset);
+    flow_hash_batch(&flow, 1);
+  }
+
+  return flow;
+}
+
+void
+frame_parse_flows(frame_t *const *frames, unsigned int count, size_t offset)
+{
+  struct flow *flows[FRAME_FLOW_BATCH];
+  unsigned int i, n = 0;
+
+  for (i = 0; i < count; ++i) {
+    if (i + FRAME_PREFETCH_DISTANCE < count)
+      __builtin_prefetch(frames[i + FRAME_PREFETCH_DISTANCE]->data + offset);
+
+    if (!frames[i]->flow_valid) {
+      frame_parse_flow(frames[i], offset);
+      flows[n++] = &frames[i]->flow;
+    }
+
+    if (n == FRAME_FLOW_BATCH) {
+      flow_hash_batch(flows, n);
+      n = 0;
+    }
+  }
+
+  flow_hash_batch(flows, n);
+}
+
 METHOD(frame, void, inc_ref)
 {
   pthread_mutex_lock(&self->mutex);
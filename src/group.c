@@ -0,0 +1,372 @@
+/*
+  group.c: Flow-hash load balancing groups
+  Copyright (C) 2025 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, version 3.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#define _GNU_SOURCE
+
+#include <group.h>
+#include <log.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+static struct group *
+group_new(const char *name)
+{
+  struct group *new = NULL;
+  unsigned int i;
+
+  ALLOCATE_FAIL(new, struct group);
+  TRY_FAIL(new->name = strdup(name));
+
+  for (i = 0; i < GROUP_BUCKETS; ++i)
+    new->owner[i] = -1;
+
+  return new;
+
+fail:
+  if (new != NULL)
+    free(new);
+
+  return NULL;
+}
+
+static void
+group_destroy(struct group *self)
+{
+  if (self->members != NULL)
+    free(self->members);
+
+  if (self->load != NULL)
+    free(self->load);
+
+  free(self->name);
+  free(self);
+}
+
+static int
+group_find_member(const struct group *self, const void *member)
+{
+  unsigned int i;
+
+  for (i = 0; i < self->count; ++i)
+    if (self->members[i] == member)
+      return i;
+
+  return -1;
+}
+
+static int
+group_compare_load(const void *a, const void *b, void *userdata)
+{
+  const unsigned int *load = (const unsigned int *) userdata;
+  unsigned int la = load[*(const unsigned int *) a];
+  unsigned int lb = load[*(const unsigned int *) b];
+
+  return la > lb ? -1 : la < lb;
+}
+
+/*
+ * Every member ends up with GROUP_BUCKETS / count buckets, give or take
+ * one. The extra ones go to the members that already had the most, and
+ * only buckets above a member's target (or orphaned) are moved.
+ */
+static bool
+group_rebalance(struct group *self)
+{
+  unsigned int *target = NULL, *order = NULL;
+  unsigned int quota, extra, i, j = 0;
+  int owner;
+  bool ok = false;
+
+  if (self->count == 0) {
+    for (i = 0; i < GROUP_BUCKETS; ++i) {
+      self->owner[i] = -1;
+      __atomic_store_n(&self->buckets[i], NULL, __ATOMIC_RELAXED);
+    }
+
+    return true;
+  }
+
+  TRY(target = malloc(self->count * sizeof(unsigned int)));
+  TRY(order  = malloc(self->count * sizeof(unsigned int)));
+
+  for (i = 0; i < self->count; ++i)
+    order[i] = i;
+
+  qsort_r(
+    order,
+    self->count,
+    sizeof(unsigned int),
+    group_compare_load,
+    self->load);
+
+  quota = GROUP_BUCKETS / self->count;
+  extra = GROUP_BUCKETS % self->count;
+
+  for (i = 0; i < self->count; ++i)
+    target[order[i]] = quota + (i < extra);
+
+  for (i = 0; i < GROUP_BUCKETS; ++i) {
+    owner = self->owner[i];
+
+    if (owner != -1) {
+      if (self->load[owner] <= target[owner])
+        continue;
+      --self->load[owner];
+    }
+
+    while (self->load[j] >= target[j])
+      ++j;
+
+    self->owner[i] = j;
+    ++self->load[j];
+    __atomic_store_n(&self->buckets[i], self->members[j], __ATOMIC_RELAXED);
+  }
+
+  ok = true;
+
+done:
+  if (target != NULL)
+    free(target);
+
+  if (order != NULL)
+    free(order);
+
+  return ok;
+}
+
+static bool
+group_add(struct group *self, void *member)
+{
+  unsigned int alloc;
+  void **members;
+  unsigned int *load;
+
+  if (self->count == self->alloc) {
+    alloc = self->alloc == 0 ? 8 : 2 * self->alloc;
+
+    if ((members = realloc(self->members, alloc * sizeof(void *))) == NULL)
+      return false;
+    self->members = members;
+
+    if ((load = realloc(self->load, alloc * sizeof(unsigned int))) == NULL)
+      return false;
+    self->load = load;
+
+    self->alloc = alloc;
+  }
+
+  self->members[self->count] = member;
+  self->load[self->count]    = 0;
+  ++self->count;
+
+  if (!group_rebalance(self)) {
+    --self->count;
+    return false;
+  }
+
+  return true;
+}
+
+static void
+group_remove(struct group *self, const void *member)
+{
+  int index, last;
+  unsigned int i;
+
+  if ((index = group_find_member(self, member)) == -1)
+    return;
+
+  last = self->count - 1;
+
+  /* Orphan its buckets, and move the last member into the hole */
+  for (i = 0; i < GROUP_BUCKETS; ++i)
+    if (self->owner[i] == index)
+      self->owner[i] = -1;
+    else if (self->owner[i] == last)
+      self->owner[i] = index;
+
+  self->members[index] = self->members[last];
+  self->load[index]    = self->load[last];
+  --self->count;
+
+  /* Out of memory: flows of the orphaned buckets go nowhere */
+  if (!group_rebalance(self))
+    for (i = 0; i < GROUP_BUCKETS; ++i)
+      if (self->owner[i] == -1)
+        __atomic_store_n(&self->buckets[i], NULL, __ATOMIC_RELAXED);
+}
+
+INSTANCER(groups)
+{
+  groups_t *new = NULL;
+
+  ALLOCATE_FAIL(new, groups_t);
+
+  TRYZ_FAIL(pthread_mutex_init(&new->mutex, NULL));
+
+  return new;
+
+fail:
+  if (new != NULL)
+    DISPOSE(groups, new);
+
+  return NULL;
+}
+
+COLLECTOR(groups)
+{
+  struct group *group;
+
+  while ((group = self->list) != NULL) {
+    self->list = group->next;
+    group_destroy(group);
+  }
+
+  pthread_mutex_destroy(&self->mutex);
+
+  free(self);
+}
+
+/*
+ * Empty groups are never freed: the broadcast loop may still be looking
+ * at one through a stale pointer, without any lock. A new name takes an
+ * empty group over instead, so the list only grows with the number of
+ * groups in use at the same time, and never beyond GROUP_MAX.
+ */
+METHOD(groups, static struct group *, lookup, const char *name)
+{
+  struct group *group, *empty = NULL;
+  unsigned int total = 0;
+  char *copy;
+
+  for (group = self->list; group != NULL; group = group->next) {
+    if (strcmp(group->name, name) == 0)
+      return group;
+
+    if (group->count == 0)
+      empty = group;
+
+    ++total;
+  }
+
+  if (empty != NULL) {
+    if ((copy = strdup(name)) == NULL)
+      return NULL;
+
+    Info("New group `%s' (was `%s')\n", name, empty->name);
+
+    free(empty->name);
+    empty->name = copy;
+
+    return empty;
+  }
+
+  if (total >= GROUP_MAX) {
+    Warn("Too many groups, cannot create `%s'\n", name);
+    return NULL;
+  }
+
+  if ((group = group_new(name)) == NULL)
+    return NULL;
+
+  group->next = self->list;
+  self->list  = group;
+
+  Info("New group `%s'\n", name);
+
+  return group;
+}
+
+METHOD(
+  groups,
+  bool,
+  join,
+  void *member,
+  struct group **slot,
+  const char *name)
+{
+  struct group *current, *group = NULL;
+  bool ok = false;
+
+  pthread_mutex_lock(&self->mutex);
+
+  if ((current = *slot) == GROUP_CLOSED)
+    goto done;
+
+  if (name != NULL) {
+    TRY(group = groups_lookup(self, name));
+
+    if (group == current) {
+      ok = true;
+      goto done;
+    }
+
+    TRY(group_add(group, member));
+  }
+
+  if (current != NULL)
+    group_remove(current, member);
+
+  if (current == NULL && group != NULL)
+    __atomic_fetch_add(&self->members, 1, __ATOMIC_RELAXED);
+  else if (current != NULL && group == NULL)
+    __atomic_fetch_sub(&self->members, 1, __ATOMIC_RELAXED);
+
+  __atomic_store_n(slot, group, __ATOMIC_RELEASE);
+
+  ok = true;
+
+done:
+  pthread_mutex_unlock(&self->mutex);
+
+  return ok;
+}
+
+METHOD(groups, void, close, void *member, struct group **slot)
+{
+  struct group *current;
+
+  pthread_mutex_lock(&self->mutex);
+
+  if ((current = *slot) != NULL && current != GROUP_CLOSED) {
+    group_remove(current, member);
+    __atomic_fetch_sub(&self->members, 1, __ATOMIC_RELAXED);
+  }
+
+  __atomic_store_n(slot, GROUP_CLOSED, __ATOMIC_RELEASE);
+
+  pthread_mutex_unlock(&self->mutex);
+}
+
+METHOD(groups, void, dump_stats, FILE *fp)
+{
+  struct group *group;
+
+  pthread_mutex_lock(&self->mutex);
+
+  for (group = self->list; group != NULL; group = group->next)
+    fprintf(
+      fp,
+      "ifshare_group_members{group=\"%s\"} %u\n",
+      group->name,
+      group->count);
+
+  pthread_mutex_unlock(&self->mutex);
+}
@@ -0,0 +1,92 @@
+/*
+  hist.c: Log-linear latency histograms
+  Copyright (C) 2025 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, version 3.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <hist.h>
+#include <string.h>
+
+/* Highest value that falls in the given bucket */
+static uint64_t
+hist_bucket_value(unsigned int index)
+{
+  unsigned int shift;
+  uint64_t base;
+
+  if (index < HIST_SUB_BUCKETS)
+    return index;
+
+  shift = (index >> HIST_SUB_BITS) - 1;
+  base  = (uint64_t) (HIST_SUB_BUCKETS + (index & (HIST_SUB_BUCKETS - 1)));
+
+  return (base << shift) + ((1ull << shift) - 1);
+}
+
+METHOD(hist, void, reset)
+{
+  memset(self, 0, sizeof(hist_t));
+}
+
+/* Adds the samples of `other' to this histogram */
+METHOD(hist, void, merge, const hist_t *other)
+{
+  unsigned int i;
+
+  for (i = 0; i < HIST_BUCKETS; ++i)
+    self->counts[i] += __atomic_load_n(&other->counts[i], __ATOMIC_RELAXED);
+
+  self->count += hist_count(other);
+  self->sum   += __atomic_load_n(&other->sum, __ATOMIC_RELAXED);
+  self->max    = MAX(self->max, hist_max(other));
+}
+
+/* p is in [0, 1]. Returns 0 for empty histograms. */
+GETTER(hist, uint64_t, percentile, double p)
+{
+  uint64_t total = 0, target, acc = 0;
+  unsigned int i;
+
+  for (i = 0; i < HIST_BUCKETS; ++i)
+    total += __atomic_load_n(&self->counts[i], __ATOMIC_RELAXED);
+
+  if (total == 0)
+    return 0;
+
+  target = (uint64_t) (p * total + .5);
+  if (target < 1)
+    target = 1;
+  if (target > total)
+    target = total;
+
+  for (i = 0; i < HIST_BUCKETS; ++i) {
+    acc += __atomic_load_n(&self->counts[i], __ATOMIC_RELAXED);
+    if (acc >= target)
+      return MIN(hist_bucket_value(i), hist_max(self));
+  }
+
+  return hist_max(self);
+}
+
+GETTER(hist, uint64_t, count)
+{
+  return __atomic_load_n(&self->count, __ATOMIC_RELAXED);
+}
+
+GETTER(hist, uint64_t, max)
+{
+  return __atomic_load_n(&self->max, __ATOMIC_RELAXED);
+}
@@ -16,7 +16,6 @@
   <http://www.gnu.org/licenses/>
 
 */
-
 #include <linux/if_packet.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
@@ -29,71 +28,21 @@
 #include <libnet.h>
 #include <sys/poll.h>
 
-#include <ifshare.h>
+#include <libifshare.h>
+#include <defs.h>
+#include <log.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
 
-static int
-tcp_connect(const char *host, uint16_t port)
-{
-  struct sockaddr_in srvAddr;
-  int csfd = -1;
-  struct hostent *ent;
-  struct in_addr *addr;
-  bool ok = false;
-
-  Info("Resolving `%s'...\n", host);
-
-  if ((ent = gethostbyname(host)) == NULL) {
-    switch (h_errno) {
-      case HOST_NOT_FOUND:
-        Err("Failed to resolve hostname `%s'\n", host);
-        break;
-
-      default:
-        Err("Unexpected error while resolving (h_errno = %d)\n", h_errno);
-    }
-
-    goto done;
-  }
-  
-  if ((addr = (struct in_addr *) ent->h_addr_list[0]) == NULL) {
-    Err("Invalid response by gethostbyname()\n");
-    goto done;
-  }
-  
-  Info("Done, connecting to %s:%d...\n", inet_ntoa(*addr), port);
-
-  srvAddr.sin_family = AF_INET;
-  srvAddr.sin_addr   = *addr;
-  srvAddr.sin_port   = htons(port);
-
-  if ((csfd = socket(PF_INET, SOCK_STREAM, 0)) == -1) {
-    Err("Failed to create socket: %s\n", strerror(errno));
-    goto done;
-  }
-  
-  if (connect(
-    csfd,
-    (struct sockaddr *) &srvAddr,
-    sizeof (struct sockaddr_in)) == -1) {
-    Err("Failed to connect to host: %s\n", strerror(errno));
-    goto done;
-  }
-
-  ok = true;
-
-done:
-  if (!ok && csfd != -1) {
-    close(csfd);
-    csfd = -1;
-  }
-  
-  return csfd;
-}
-
+struct ifclient {
+  ifshare_t  *ifshare;
+  const char *tap;
+  int         tapfd;
+  uint64_t    lost;
+  bool        failed;
+};
 
 static int
 open_tap(const char *tap)
@@ -148,112 +97,247 @@ done:
   return fd;
 }
 
+/* Returns false once the TAP stops taking frames */
 static bool
-read_all(int fd, void *buf, size_t size)
+write_frames(
+  const struct ifshare_frame *frames,
+  unsigned int count,
+  void *userdata)
 {
-  uint8_t *as_bytes = (uint8_t *) buf;
-  ssize_t p = 0, got;
+  struct ifclient *client = (struct ifclient *) userdata;
+  ssize_t written;
+  unsigned int i;
+
+  if (ifshare_lost(client->ifshare) != client->lost) {
+    client->lost = ifshare_lost(client->ifshare);
+    LogEvery(
+      1000,
+      LogWarning,
+      "Too slow: %llu frames lost so far\n",
+      (unsigned long long) client->lost);
+  }
 
-  while (p < size) {
-    got = recv(fd, as_bytes + p, size - p, MSG_NOSIGNAL);
-    if (got <= 0)
-      return false;
+  for (i = 0; i < count; ++i)
+    if ((written = write(client->tapfd, frames[i].data, frames[i].size))
+      != (ssize_t) frames[i].size) {
+      if (written >= 0)
+        return false;
 
-    p += got;
-  }
+      Err(
+        "write(%s): cannot write %zu bytes: %s\n",
+        client->tap,
+        frames[i].size,
+        strerror(errno));
+      client->failed = true;
+      return false;
+    }
 
   return true;
 }
 
+/*
+ * Reverse path: frames the host sends through the TAP go to the server.
+ * Whatever the TAP has queued goes out in a single batch.
+ */
 static bool
-consume_tap(int fd)
+forward_tap(struct ifclient *client)
 {
-  struct pollfd fds;
-  static uint8_t frame[IFSHARE_MAX_MTU];
+  static uint8_t buffer[IFSHARE_BATCH_MAX][IFSHARE_MAX_MTU];
+  struct ifshare_frame frames[IFSHARE_BATCH_MAX];
+  unsigned int count = 0;
   ssize_t size;
 
-  fds.fd = fd;
-  fds.events = POLLIN;
+  while (count < IFSHARE_BATCH_MAX) {
+    if ((size = read(client->tapfd, buffer[count], IFSHARE_MAX_MTU)) == -1) {
+      if (errno == EAGAIN)
+        break;
 
-  while (poll(&fds, 1, IFSHARE_MAX_MTU) == 1) {
-    if ((size = read(fd, frame, IFSHARE_MAX_MTU)) == -1) {
-      Err("Failed to consume packet\n");
+      Err("Failed to read from tap: %s\n", strerror(errno));
       return false;
     }
 
-    log_hexdump(LogDebug, frame, size);
+    memset(frames + count, 0, sizeof(struct ifshare_frame));
+    frames[count].data = buffer[count];
+    frames[count].size = size;
+    ++count;
   }
 
-  return true;
+  return count == 0 || ifshare_send_batch(client->ifshare, frames, count);
+}
+
+static bool
+forward_both(struct ifclient *client)
+{
+  struct ifshare_frame frames[IFSHARE_BATCH_MAX];
+  struct pollfd fds[2];
+  int n;
+
+  TRYC(fcntl(
+    client->tapfd,
+    F_SETFL,
+    fcntl(client->tapfd, F_GETFL) | O_NONBLOCK));
+
+  fds[0].fd     = ifshare_fd(client->ifshare);
+  fds[0].events = POLLIN;
+
+  fds[1].fd     = client->tapfd;
+  fds[1].events = POLLIN;
+
+  Info("Forwarding frames from %s to the server\n", client->tap);
+
+  for (;;) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+
+      Err("poll() failed: %s\n", strerror(errno));
+      goto done;
+    }
+
+    if (fds[1].revents & POLLIN)
+      TRY(forward_tap(client));
+
+    if (fds[0].revents == 0)
+      continue;
+
+    /* Drain what is buffered, so that poll() tells the truth again */
+    while ((n = ifshare_recv_batch(
+      client->ifshare,
+      frames,
+      IFSHARE_BATCH_MAX,
+      0)) > 0)
+      if (!write_frames(frames, n, client))
+        return !client->failed;
+
+    if (n == -1)
+      break;
+  }
+
+done:
+  return ifshare_eof(client->ifshare);
+}
+
+/* The library is silent by itself: its messages go to our log */
+static void
+forward_log(enum ifshare_log_level level, const char *message, void *unused)
+{
+  (void) unused;
+
+  Log((enum loglevel) level, "libifshare: %s", message);
 }
 
 int
 main(int argc, char *argv[])
 {
-  struct ifshare_pdu header;
-  static uint8_t frame[IFSHARE_MAX_MTU];
-  uint16_t port;
+  struct ifshare_params params = ifshare_params_INITIALIZER;
+  struct ifclient client;
   const char *tap = "tap0";
-  int tapfd = -1;
-  int srvfd = -1;
-  ssize_t written;
+  bool reverse = false;
+  bool ok;
   int code = EXIT_FAILURE;
+  int c;
 
-  if (argc < 3) {
+  memset(&client, 0, sizeof(struct ifclient));
+  client.tapfd = -1;
+
+  ifshare_set_log_handler(forward_log, NULL);
+
+  while ((c = getopt(argc, argv, "Ru:g:s:")) != -1) {
+    switch (c) {
+      case 'R':
+        reverse = true;
+        break;
+
+      case 'g':
+        params.group = optarg;
+        break;
+
+      case 's':
+        if (!ifshare_sample_from_string(
+          optarg,
+          &params.sample,
+          &params.sample_rate)) {
+          Err("Invalid sampling `%s'\n", optarg);
+          goto done;
+        }
+        break;
+
+      case 'u':
+        params.shm_path = optarg;
+        break;
+
+      default:
+        goto usage;
+    }
+  }
+
+  if (params.shm_path != NULL) {
+    if (reverse
+      || params.group != NULL
+      || params.sample != IFSHARE_SAMPLE_NONE
+      || argc - optind > 1)
+      goto usage;
+
+    if (argc - optind > 0)
+      tap = argv[optind];
+  } else if (argc - optind < 2) {
+usage:
     fprintf(stderr, "Usage:\n");
-    fprintf(stderr, "\t %s HOST PORT [TAP]\n", argv[0]);
+    fprintf(stderr, "\t %s [-R] [-g GROUP] [-s MODE:N] HOST PORT [TAP]\n", argv[0]);
+    fprintf(stderr, "\t %s -u PATH [TAP]\n\n", argv[0]);
+    fprintf(stderr, "  -R         Send frames from TAP to the server, which\n");
+    fprintf(stderr, "             injects them if started with --inject\n");
+    fprintf(stderr, "  -g NAME    Join group NAME: each flow goes to only one\n");
+    fprintf(stderr, "             of its members\n");
+    fprintf(stderr, "  -s MODE:N  Take only part of the traffic: every Nth\n");
+    fprintf(stderr, "             frame (count), frames with probability 1/N\n");
+    fprintf(stderr, "             (random) or all frames of 1 in N flows (flow)\n");
+    fprintf(stderr, "  -u PATH    Read frames from the shared memory ring of a\n");
+    fprintf(stderr, "             local server started with --shm=PATH\n");
     goto done;
-  }
+  } else {
+    params.host = argv[optind];
 
-  if (argc > 3)
-    tap = argv[3];
+    if (sscanf(argv[optind + 1], "%u", &params.port) != 1
+      || params.port < 1
+      || params.port > 65535) {
+      Err("Invalid port `%s'\n", argv[optind + 1]);
+      goto done;
+    }
 
-  if (sscanf(argv[2], "%hu", &port) != 1) {
-    Err("Invalid port `%s'\n", argv[2]);
-    goto done;
+    if (argc - optind > 2)
+      tap = argv[optind + 2];
   }
 
   Info("Ifshare version 0.1\n");
   Info("This is the IF client program\n");
 
-  TRYC(tapfd = open_tap(tap));
+  TRYC(client.tapfd = open_tap(tap));
   Info("Tap device opened: %s\n", tap);
 
-  TRYC(srvfd = tcp_connect(argv[1], port));
+  client.tap = tap;
+
+  MAKE(client.ifshare, ifshare, &params);
 
   Info("Done. Forwarding frames to %s\n", tap);
 
-  while (read_all(srvfd, &header, sizeof(struct ifshare_pdu))) {
-    if (header.is_magic != IFSHARE_MAGIC) {
-      Err("SERVER ERROR: Invalid PDU magic (0x%x)\n", header.is_magic);
-      goto done;
-    }
+  if (reverse)
+    ok = forward_both(&client);
+  else
+    ok = ifshare_run(client.ifshare, write_frames, &client) && !client.failed;
 
-    if (header.is_size > IFSHARE_MAX_MTU) {
-      Err("SERVER ERROR: Invalid PDU size\n");
-      goto done;
-    }
+  if (ifshare_eof(client.ifshare))
+    Info("Server closed the connection\n");
 
-    if (!read_all(srvfd, frame, header.is_size)) {
-      Err("SERVER ERROR: Failed to receive %d bytes\n", header.is_size);
-      goto done;
-    }
+  if (ok)
+    code = EXIT_SUCCESS;
 
-    if ((written = write(tapfd, frame, header.is_size)) != header.is_size) {
-      if (written >= 0)
-        break;
-      
-      Err(
-        "write(%s): cannot write %d bytes: %s\n",
-        tap,
-        header.is_size,
-        strerror(errno));
-      goto done;
-    }
-  }
+done:
+  if (client.ifshare != NULL)
+    DISPOSE(ifshare, client.ifshare);
 
-  code = EXIT_SUCCESS;
+  if (client.tapfd != -1)
+    close(client.tapfd);
 
-done:
   exit(code);
 }
@@ -17,37 +17,464 @@
 
 */
 
+#define _GNU_SOURCE
+
 #include <ifshare.h>
 #include <server.h>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <limits.h>
+#include <signal.h>
+
+enum {
+  OPT_RECORD_SIZE = 256,
+  OPT_RECORD_TIME,
+  OPT_RECORD_DIRECT,
+  OPT_RECORD_QUEUE,
+  OPT_SPEED,
+  OPT_REPLAY_LOOPS,
+  OPT_WAIT_CLIENTS,
+  OPT_CLIENT_CPUS,
+  OPT_NUMA,
+  OPT_FIFO,
+  OPT_BUSY_POLL,
+  OPT_SPIN,
+  OPT_BACKLOG,
+  OPT_LISTENERS,
+  OPT_SNDBUF,
+  OPT_NOTSENT_LOWAT,
+  OPT_NO_CORK,
+  OPT_INJECT_RATE,
+  OPT_SHM_SIZE,
+  OPT_RELAY,
+  OPT_DEDUP
+};
+
+static struct option g_options[] = {
+  {"bind",           required_argument, NULL, 'b'},
+  {"port",           required_argument, NULL, 'p'},
+  {"backlog",        required_argument, NULL, OPT_BACKLOG},
+  {"listeners",      required_argument, NULL, OPT_LISTENERS},
+  {"xdp",            optional_argument, NULL, 'x'},
+  {"xdp-queue",      required_argument, NULL, 'q'},
+  {"stats",          required_argument, NULL, 's'},
+  {"shm",            required_argument, NULL, 'u'},
+  {"shm-size",       required_argument, NULL, OPT_SHM_SIZE},
+  {"dedup",          optional_argument, NULL, OPT_DEDUP},
+  {"max-queue",      required_argument, NULL, 'Q'},
+  {"timestamps",     required_argument, NULL, 't'},
+  {"pdu-timestamps", no_argument,       NULL, 'T'},
+  {"record",         required_argument, NULL, 'w'},
+  {"record-size",    required_argument, NULL, OPT_RECORD_SIZE},
+  {"record-time",    required_argument, NULL, OPT_RECORD_TIME},
+  {"record-direct",  no_argument,       NULL, OPT_RECORD_DIRECT},
+  {"record-queue",   required_argument, NULL, OPT_RECORD_QUEUE},
+  {"replay",         no_argument,       NULL, 'r'},
+  {"speed",          required_argument, NULL, OPT_SPEED},
+  {"replay-loops",   required_argument, NULL, OPT_REPLAY_LOOPS},
+  {"wait-clients",   required_argument, NULL, OPT_WAIT_CLIENTS},
+  {"relay",          no_argument,       NULL, OPT_RELAY},
+  {"capture-cpu",    required_argument, NULL, 'c'},
+  {"client-cpus",    required_argument, NULL, OPT_CLIENT_CPUS},
+  {"numa",           no_argument,       NULL, OPT_NUMA},
+  {"fifo",           optional_argument, NULL, OPT_FIFO},
+  {"busy-poll",      required_argument, NULL, OPT_BUSY_POLL},
+  {"spin",           required_argument, NULL, OPT_SPIN},
+  {"sndbuf",         required_argument, NULL, OPT_SNDBUF},
+  {"notsent-lowat",  required_argument, NULL, OPT_NOTSENT_LOWAT},
+  {"no-cork",        no_argument,       NULL, OPT_NO_CORK},
+  {"inject",         no_argument,       NULL, 'i'},
+  {"inject-rate",    required_argument, NULL, OPT_INJECT_RATE},
+  {"help",           no_argument,       NULL, 'h'},
+  {NULL,             0,                 NULL, 0}
+};
+
+static server_t *g_server = NULL;
+
+static void
+stop_handler(int sig)
+{
+  (void) sig;
+
+  if (g_server != NULL)
+    server_stop(g_server);
+}
+
+static const char *g_ts_sources[] = {"user", "kernel", "hardware"};
+
+static bool
+parse_ts_source(const char *string, enum ifshare_ts_source *source)
+{
+  unsigned int i;
+
+  for (i = 0; i < sizeof(g_ts_sources) / sizeof(g_ts_sources[0]); ++i)
+    if (strcmp(g_ts_sources[i], string) == 0) {
+      *source = (enum ifshare_ts_source) i;
+      return true;
+    }
+
+  return false;
+}
+
+static void
+help(const char *argv0)
+{
+  fprintf(stderr, "Usage:\n");
+  fprintf(stderr, "\t%s [OPTIONS] IFACE\n", argv0);
+  fprintf(stderr, "\t%s [OPTIONS] -r FILE\n", argv0);
+  fprintf(stderr, "\t%s [OPTIONS] --relay HOST[:PORT]\n\n", argv0);
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  -b, --bind=ADDR      Accept clients on ADDR only (default: every\n");
+  fprintf(stderr, "                       IPv6 and IPv4 address)\n");
+  fprintf(stderr, "  -p, --port=PORT      Accept clients on PORT (default: %d)\n", IFSHARE_SERVER_PORT);
+  fprintf(stderr, "      --backlog=N      Pending connections queued by the kernel\n");
+  fprintf(stderr, "                       (default: %d)\n", SERVER_BACKLOG);
+  fprintf(stderr, "      --listeners=N    Accept from N SO_REUSEPORT sockets, each with\n");
+  fprintf(stderr, "                       its own thread (default: 1). With\n");
+  fprintf(stderr, "                       --client-cpus, each gets one CPU of the list\n");
+  fprintf(stderr, "  -x, --xdp[=MODE]     Capture with AF_XDP. MODE is one of auto\n");
+  fprintf(stderr, "                       (default), skb, native or zerocopy\n");
+  fprintf(stderr, "  -q, --xdp-queue=N    NIC queue to capture from (default: 0)\n");
+  fprintf(stderr, "  -s, --stats=PATH     Serve statistics on a Unix socket\n");
+  fprintf(stderr, "  -u, --shm=PATH       Share frames with local readers (ifclient -u)\n");
+  fprintf(stderr, "                       through a memory ring handed out on a\n");
+  fprintf(stderr, "                       Unix socket\n");
+  fprintf(stderr, "      --shm-size=MB    Size of the shared ring (default: %d)\n", SHMRING_DEFAULT_SIZE >> 20);
+  fprintf(stderr, "      --dedup[=US]     Drop frames seen less than US microseconds\n");
+  fprintf(stderr, "                       ago, as mirror ports deliver (default: %d).\n", DEDUP_DEFAULT_WINDOW_US);
+  fprintf(stderr, "                       TTL and IP checksum are ignored\n");
+  fprintf(stderr, "  -Q, --max-queue=N    Frames queued per client before dropping\n");
+  fprintf(stderr, "                       (default: %d, 0 for unbounded)\n", CLIENT_DEFAULT_MAX_QUEUE);
+  fprintf(stderr, "  -t, --timestamps=SRC Capture timestamp source: user, kernel\n");
+  fprintf(stderr, "                       (default) or hardware\n");
+  fprintf(stderr, "  -T, --pdu-timestamps Send capture timestamps to the clients\n");
+  fprintf(stderr, "  -w, --record=PREFIX  Record frames to PREFIX-DATE-N.pcapng\n");
+  fprintf(stderr, "      --record-size=MB Rotate after MB megabytes (default: 1024)\n");
+  fprintf(stderr, "      --record-time=S  Rotate after S seconds (default: never)\n");
+  fprintf(stderr, "      --record-direct  Write recordings with O_DIRECT\n");
+  fprintf(stderr, "      --record-queue=N Frames queued for the disk before dropping\n");
+  fprintf(stderr, "                       (default: 65536)\n");
+  fprintf(stderr, "  -r, --replay         Replay a pcap / pcapng FILE instead of\n");
+  fprintf(stderr, "                       capturing from IFACE\n");
+  fprintf(stderr, "      --speed=X        Replay X times faster than recorded\n");
+  fprintf(stderr, "                       (default: 1, 0 for as fast as possible)\n");
+  fprintf(stderr, "      --replay-loops=N Replay the file N times (default: 1,\n");
+  fprintf(stderr, "                       0 for forever)\n");
+  fprintf(stderr, "      --wait-clients=N Start replaying once N clients connect\n");
+  fprintf(stderr, "      --relay          Relay the frames of the ifshare server at\n");
+  fprintf(stderr, "                       HOST[:PORT] instead of capturing\n");
+  fprintf(stderr, "  -c, --capture-cpu=N  Pin the capture thread to CPU N, or `auto'\n");
+  fprintf(stderr, "                       for the sibling of the NIC's IRQ core\n");
+  fprintf(stderr, "      --client-cpus=L  Pin client threads to a CPU list (0-3,6)\n");
+  fprintf(stderr, "      --numa           Allocate frames on the NIC's NUMA node\n");
+  fprintf(stderr, "      --fifo[=PRIO]    Capture under SCHED_FIFO (default: %d)\n", SERVER_FIFO_PRIORITY);
+  fprintf(stderr, "      --busy-poll=US   Busy poll the NIC for up to US microseconds\n");
+  fprintf(stderr, "                       per read (SO_BUSY_POLL)\n");
+  fprintf(stderr, "      --spin=US        Spin up to US microseconds waiting for\n");
+  fprintf(stderr, "                       packets before sleeping (adaptive)\n");
+  fprintf(stderr, "      --sndbuf=KB      Kernel send buffer of TCP clients\n");
+  fprintf(stderr, "                       (default: system default)\n");
+  fprintf(stderr, "      --notsent-lowat=KB\n");
+  fprintf(stderr, "                       Unsent bytes a TCP client may have in the\n");
+  fprintf(stderr, "                       kernel before frames wait in our queue\n");
+  fprintf(stderr, "                       (default: %d, 0 for no limit)\n", CLIENT_NOTSENT_LOWAT >> 10);
+  fprintf(stderr, "      --no-cork        Do not coalesce sends with MSG_MORE when\n");
+  fprintf(stderr, "                       more frames are queued\n");
+  fprintf(stderr, "  -i, --inject         Transmit frames sent by clients (ifclient -R)\n");
+  fprintf(stderr, "                       on IFACE\n");
+  fprintf(stderr, "      --inject-rate=MBPS\n");
+  fprintf(stderr, "                       Limit each client to MBPS megabits per\n");
+  fprintf(stderr, "                       second (default: 0, unlimited)\n");
+  fprintf(stderr, "  -h, --help           This help\n");
+}
 
 int
 main(int argc, char *argv[])
 {
   int code = EXIT_FAILURE;
   server_t *server = NULL;
+  struct server_params params = server_params_INITIALIZER;
+  struct sigaction sa;
+  unsigned long long ull;
+  double mbps;
+  int c;
+
+  while ((c = getopt_long(argc, argv, "b:p:x::q:s:u:Q:t:Tw:rc:ih", g_options, NULL)) != -1) {
+    switch (c) {
+      case 'b':
+        params.bind_addr = optarg;
+        break;
+
+      case 'p':
+        if (sscanf(optarg, "%u", &params.port) != 1
+          || params.port < 1
+          || params.port > 65535) {
+          fprintf(stderr, "%s: invalid port `%s'\n", argv[0], optarg);
+          goto done;
+        }
+        break;
+
+      case OPT_BACKLOG:
+        if (sscanf(optarg, "%u", &params.backlog) != 1) {
+          fprintf(stderr, "%s: invalid backlog `%s'\n", argv[0], optarg);
+          goto done;
+        }
+        break;
+
+      case OPT_LISTENERS:
+        if (sscanf(optarg, "%u", &params.listeners) != 1
+          || params.listeners < 1
+          || params.listeners > SERVER_MAX_LISTENERS) {
+          fprintf(stderr, "%s: invalid listener count `%s'\n", argv[0], optarg);
+          goto done;
+        }
+        break;
+
+      case 'x':
+        params.capture = SERVER_CAPTURE_XDP;
+        if (optarg != NULL && !xsk_mode_from_string(optarg, &params.xdp_mode)) {
+          fprintf(stderr, "%s: invalid XDP mode `%s'\n", argv[0], optarg);
+          goto done;
+        }
+        break;
+
+      case 'q':
+        if (sscanf(optarg, "%u", &params.xdp_queue) != 1) {
+          fprintf(stderr, "%s: invalid queue `%s'\n", argv[0], optarg);
+          goto done;
+        }
+        break;
+
+      case 's':
+        params.stats_path = optarg;
+        break;
+
+      case 'u':
+        params.shm_path = optarg;
+        break;
+
+      case OPT_SHM_SIZE:
+        if (sscanf(optarg, "%llu", &ull) != 1
+          || ull < 1
+          || ull > (1ull << 20)) {
+          fprintf(stderr, "%s: invalid ring size `%s'\n", argv[0], optarg);
+          goto done;
+        }
+        params.shm_size = ull << 20;
+        break;
+
+      case OPT_DEDUP:
+        params.dedup_window_us = DEDUP_DEFAULT_WINDOW_US;
+        if (optarg != NULL
+          && (sscanf(optarg, "%u", &params.dedup_window_us) != 1
+            || params.dedup_window_us == 0)) {
+          fprintf(stderr, "%s: invalid dedup window `%s'\n", argv[0], optarg);
+          goto done;
+        }
+        break;
+
+      case 'Q':
+        if (sscanf(optarg, "%u", &params.client.max_queue) != 1) {
+          fprintf(stderr, "%s: invalid queue size `%s'\n", argv[0], optarg);
+          goto done;
+        }
+        break;
 
-  if (argc != 2) {
-    fprintf(stderr, "Usage:\n");
-    fprintf(stderr, "\t%s IFACE\n", argv[0]);
+      case 't':
+        if (!parse_ts_source(optarg, &params.timestamps)) {
+          fprintf(stderr, "%s: invalid timestamp source `%s'\n", argv[0], optarg);
+          goto done;
+        }
+        break;
+
+      case 'T':
+        params.pdu_timestamps = true;
+        break;
+
+      case 'w':
+        params.recorder.prefix = optarg;
+        break;
+
+      case OPT_RECORD_SIZE:
+        if (sscanf(optarg, "%llu", &ull) != 1) {
+          fprintf(stderr, "%s: invalid size `%s'\n", argv[0], optarg);
+          goto done;
+        }
+        params.recorder.max_size = ull << 20;
+        break;
+
+      case OPT_RECORD_TIME:
+        if (sscanf(optarg, "%u", &params.recorder.max_time) != 1) {
+          fprintf(stderr, "%s: invalid time `%s'\n", argv[0], optarg);
+          goto done;
+        }
+        break;
+
+      case OPT_RECORD_DIRECT:
+        params.recorder.direct = true;
+        break;
+
+      case OPT_RECORD_QUEUE:
+        if (sscanf(optarg, "%u", &params.recorder.max_queue) != 1) {
+          fprintf(stderr, "%s: invalid queue size `%s'\n", argv[0], optarg);
+          goto done;
+        }
+        break;
+
+      case 'r':
+        params.capture = SERVER_CAPTURE_REPLAY;
+        break;
+
+      case OPT_RELAY:
+        params.capture = SERVER_CAPTURE_RELAY;
+        break;
+
+      case OPT_SPEED:
+        if (sscanf(optarg, "%lf", &params.replay_speed) != 1
+          || params.replay_speed < 0) {
+          fprintf(stderr, "%s: invalid speed `%s'\n", argv[0], optarg);
+          goto done;
+        }
+        break;
+
+      case OPT_REPLAY_LOOPS:
+        if (sscanf(optarg, "%u", &params.replay_loops) != 1) {
+          fprintf(stderr, "%s: invalid loop count `%s'\n", argv[0], optarg);
+          goto done;
+        }
+        break;
+
+      case OPT_WAIT_CLIENTS:
+        if (sscanf(optarg, "%u", &params.replay_clients) != 1) {
+          fprintf(stderr, "%s: invalid client count `%s'\n", argv[0], optarg);
+          goto done;
+        }
+        break;
+
+      case 'c':
+        if (strcmp(optarg, "auto") == 0) {
+          params.capture_cpu = SERVER_CPU_AUTO;
+        } else if (sscanf(optarg, "%d", &params.capture_cpu) != 1
+          || params.capture_cpu < 0) {
+          fprintf(stderr, "%s: invalid CPU `%s'\n", argv[0], optarg);
+          goto done;
+        }
+        break;
+
+      case OPT_CLIENT_CPUS:
+        if (!affinity_parse_cpus(optarg, &params.client.cpus)) {
+          fprintf(stderr, "%s: invalid CPU list `%s'\n", argv[0], optarg);
+          goto done;
+        }
+        break;
+
+      case OPT_NUMA:
+        params.numa = true;
+        break;
+
+      case OPT_FIFO:
+        params.fifo_priority = SERVER_FIFO_PRIORITY;
+        if (optarg != NULL
+          && (sscanf(optarg, "%d", &params.fifo_priority) != 1
+            || params.fifo_priority < 1
+            || params.fifo_priority > 99)) {
+          fprintf(stderr, "%s: invalid priority `%s'\n", argv[0], optarg);
+          goto done;
+        }
+        break;
+
+      case OPT_BUSY_POLL:
+        if (sscanf(optarg, "%u", &params.busy_poll_us) != 1) {
+          fprintf(stderr, "%s: invalid busy poll time `%s'\n", argv[0], optarg);
+          goto done;
+        }
+        break;
+
+      case OPT_SPIN:
+        if (sscanf(optarg, "%u", &params.spin_us) != 1) {
+          fprintf(stderr, "%s: invalid spin time `%s'\n", argv[0], optarg);
+          goto done;
+        }
+        break;
+
+      case OPT_SNDBUF:
+        if (sscanf(optarg, "%u", &params.client.sndbuf) != 1
+          || params.client.sndbuf > (INT_MAX >> 10)) {
+          fprintf(stderr, "%s: invalid buffer size `%s'\n", argv[0], optarg);
+          goto done;
+        }
+        params.client.sndbuf <<= 10;
+        break;
+
+      case OPT_NOTSENT_LOWAT:
+        if (sscanf(optarg, "%u", &params.client.notsent_lowat) != 1
+          || params.client.notsent_lowat > (INT_MAX >> 10)) {
+          fprintf(stderr, "%s: invalid size `%s'\n", argv[0], optarg);
+          goto done;
+        }
+        params.client.notsent_lowat <<= 10;
+        break;
+
+      case OPT_NO_CORK:
+        params.client.cork = false;
+        break;
+
+      case 'i':
+        params.inject = true;
+        break;
+
+      case OPT_INJECT_RATE:
+        if (sscanf(optarg, "%lf", &mbps) != 1 || mbps < 0) {
+          fprintf(stderr, "%s: invalid rate `%s'\n", argv[0], optarg);
+          goto done;
+        }
+        params.client.reverse_rate = (uint64_t) (mbps * 1e6 / 8);
+        break;
+
+      case 'h':
+        help(argv[0]);
+        code = EXIT_SUCCESS;
+        goto done;
+
+      default:
+        help(argv[0]);
+        goto done;
+    }
+  }
+
+  if (argc - optind != 1) {
+    help(argv[0]);
     goto done;
   }
 
   Info("Ifshare version 0.1\n");
   Info("This is the IF server program\n");
 
-  MAKE(server, server);
+  MAKE(server, server, &params);
+
+  /* No SA_RESTART: the signal must interrupt the capture loop's poll() */
+  memset(&sa, 0, sizeof(struct sigaction));
+  sa.sa_handler = stop_handler;
+  g_server = server;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
 
-  Info("Server started, listening on *:%d\n", IFSHARE_SERVER_PORT);
+  Info("Server started\n");
 
-  TRY(server_loop(server, argv[1]));
+  TRY(server_loop(server, argv[optind]));
 
   code = EXIT_SUCCESS;
 
 done:
-  if (server != NULL)
+  if (server != NULL) {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    g_server = NULL;
     DISPOSE(server, server);
+  }
 
   exit(code);
 }
@@ -0,0 +1,276 @@
+/*
+  injector.c: Frame injection through a PACKET_TX_RING
+  Copyright (C) 2025 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, version 3.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <ifshare.h>
+#include <injector.h>
+#include <stats.h>
+
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+/* Frames start right after the header, where the ring expects them */
+#define INJECTOR_DATA_OFFSET \
+  (TPACKET2_HDRLEN - sizeof(struct sockaddr_ll))
+
+static unsigned int
+injector_frame_size(void)
+{
+  unsigned int size = 1;
+
+  while (size < INJECTOR_DATA_OFFSET + IFSHARE_MAX_MTU)
+    size <<= 1;
+
+  return size;
+}
+
+INSTANCER(injector, const char *ifname)
+{
+  injector_t *new = NULL;
+  struct tpacket_req req;
+  struct sockaddr_ll sll;
+  int version = TPACKET_V2;
+  int one = 1;
+  int ifindex;
+
+  ALLOCATE_FAIL(new, injector_t);
+
+  new->fd = -1;
+
+  TRYZ_FAIL(pthread_mutex_init(&new->mutex, NULL));
+  TRY_FAIL(new->ifname = strdup(ifname));
+
+  if ((ifindex = if_nametoindex(ifname)) == 0) {
+    Err("Cannot inject into %s: %s\n", ifname, strerror(errno));
+    goto fail;
+  }
+
+  /* Protocol 0: this socket never receives anything */
+  if ((new->fd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, 0)) == -1) {
+    Err("Failed to create raw socket: %s\n", strerror(errno));
+    goto fail;
+  }
+
+  TRYC_FAIL(setsockopt(
+    new->fd,
+    SOL_PACKET,
+    PACKET_VERSION,
+    &version,
+    sizeof(int)));
+
+  /* Malformed frames are skipped instead of stalling the ring */
+  TRYC_FAIL(setsockopt(new->fd, SOL_PACKET, PACKET_LOSS, &one, sizeof(int)));
+
+  /*
+   * Straight to the driver: no qdisc, and invisible to packet taps.
+   * Without it, the capture socket would see every injected frame and
+   * send it back to the clients, bridged TAPs looping it forever.
+   */
+  if (setsockopt(new->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(int))
+    == -1) {
+    Err("%s: cannot bypass the qdisc: %s\n", ifname, strerror(errno));
+    goto fail;
+  }
+
+  new->frame_size  = injector_frame_size();
+  new->frame_count = INJECTOR_RING_FRAMES;
+
+  memset(&req, 0, sizeof(struct tpacket_req));
+  req.tp_block_size = new->frame_size;
+  req.tp_block_nr   = new->frame_count;
+  req.tp_frame_size = new->frame_size;
+  req.tp_frame_nr   = new->frame_count;
+
+  if (setsockopt(new->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req))
+    == -1) {
+    Err("setsockopt(PACKET_TX_RING): %s\n", strerror(errno));
+    goto fail;
+  }
+
+  new->ring_size = (size_t) new->frame_size * new->frame_count;
+
+  if ((new->ring = mmap(
+    NULL,
+    new->ring_size,
+    PROT_READ | PROT_WRITE,
+    MAP_SHARED,
+    new->fd,
+    0)) == MAP_FAILED) {
+    new->ring = NULL;
+    Err("Cannot map TX ring: %s\n", strerror(errno));
+    goto fail;
+  }
+
+  memset(&sll, 0, sizeof(struct sockaddr_ll));
+  sll.sll_family   = AF_PACKET;
+  sll.sll_ifindex  = ifindex;
+  sll.sll_protocol = htons(ETH_P_ALL);
+
+  if (bind(new->fd, (struct sockaddr *) &sll, sizeof(struct sockaddr_ll))
+    == -1) {
+    Err("bind(%s): %s\n", ifname, strerror(errno));
+    goto fail;
+  }
+
+  Info(
+    "Injecting into %s (%u frames of %u bytes)\n",
+    ifname,
+    new->frame_count,
+    new->frame_size);
+
+  return new;
+
+fail:
+  if (new != NULL)
+    DISPOSE(injector, new);
+
+  return NULL;
+}
+
+COLLECTOR(injector)
+{
+  if (self->ring != NULL) {
+    injector_flush(self);
+    munmap(self->ring, self->ring_size);
+  }
+
+  if (self->fd != -1)
+    close(self->fd);
+
+  if (self->ifname != NULL)
+    free(self->ifname);
+
+  pthread_mutex_destroy(&self->mutex);
+
+  free(self);
+}
+
+static inline struct tpacket2_hdr *
+injector_frame(injector_t *self, unsigned int index)
+{
+  return (struct tpacket2_hdr *) (self->ring + index * self->frame_size);
+}
+
+/* Called with the mutex held. Never waits for the ring to drain. */
+METHOD(injector, static void, kick)
+{
+  STATS_INC(self->stats.kicks);
+  self->pending = 0;
+
+  if (send(self->fd, NULL, 0, MSG_DONTWAIT) == -1
+    && errno != EAGAIN
+    && errno != ENOBUFS)
+    LogEvery(
+      1000,
+      LogWarning,
+      "%s: cannot transmit: %s\n",
+      self->ifname,
+      strerror(errno));
+}
+
+static inline bool
+injector_available(const struct tpacket2_hdr *hdr)
+{
+  return __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE)
+    == TP_STATUS_AVAILABLE;
+}
+
+METHOD(injector, bool, push, const uint8_t *data, size_t size)
+{
+  struct timespec wait = {0, INJECTOR_FULL_WAIT_US * 1000l};
+  struct tpacket2_hdr *hdr;
+  unsigned int retries = 0;
+
+  if (size < ETH_HLEN || size > IFSHARE_MAX_MTU) {
+    STATS_INC(self->stats.dropped);
+    return false;
+  }
+
+  /*
+   * Ring full: give what is queued some time to go out, then give up.
+   * The waiting happens unlocked, so that only this client is held up.
+   */
+  for (;;) {
+    pthread_mutex_lock(&self->mutex);
+
+    hdr = injector_frame(self, self->head);
+    if (injector_available(hdr))
+      break;
+
+    injector_kick(self);
+    if (injector_available(hdr))
+      break;
+
+    pthread_mutex_unlock(&self->mutex);
+
+    if (retries++ == INJECTOR_FULL_RETRIES) {
+      STATS_INC(self->stats.dropped);
+      return false;
+    }
+
+    nanosleep(&wait, NULL);
+  }
+
+  memcpy((uint8_t *) hdr + INJECTOR_DATA_OFFSET, data, size);
+  hdr->tp_len = size;
+  __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+
+  self->head = (self->head + 1) % self->frame_count;
+
+  STATS_INC(self->stats.frames);
+  STATS_ADD(self->stats.bytes, size);
+
+  if (++self->pending >= INJECTOR_KICK_BATCH)
+    injector_kick(self);
+
+  pthread_mutex_unlock(&self->mutex);
+
+  return true;
+}
+
+METHOD(injector, void, flush)
+{
+  pthread_mutex_lock(&self->mutex);
+
+  if (self->pending > 0)
+    injector_kick(self);
+
+  pthread_mutex_unlock(&self->mutex);
+}
+
+#define INJECTOR_STAT(fp, metric, value)  \
+  fprintf(                                \
+    fp,                                   \
+    "ifshare_inject_" metric " %llu\n",   \
+    (unsigned long long) (value))
+
+METHOD(injector, void, dump_stats, FILE *fp)
+{
+  INJECTOR_STAT(fp, "frames", STATS_GET(self->stats.frames));
+  INJECTOR_STAT(fp, "bytes", STATS_GET(self->stats.bytes));
+  INJECTOR_STAT(fp, "dropped", STATS_GET(self->stats.dropped));
+  INJECTOR_STAT(fp, "kicks", STATS_GET(self->stats.kicks));
+}
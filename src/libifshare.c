@@ -0,0 +1,576 @@
+/*
+  libifshare.c: Embeddable ifshare client
+  Copyright (C) 2025 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, version 3.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#define _GNU_SOURCE
+
+#include <libifshare.h>
+#include <defs.h>
+#include <util.h>
+#include <log.h>
+#include <shm.h>
+#include <shmring.h>
+
+#include <sys/socket.h>
+#include <sys/poll.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define IFSHARE_SHM_WAIT_MS 1000 /* Between checks for a dead writer */
+#define IFSHARE_LOG_MAX     256
+
+struct ifshare {
+  struct ifshare_params params;
+
+  int               fd;     /* TCP only */
+  shmring_reader_t *reader; /* Shared memory only */
+
+  uint8_t *buffer;
+  size_t   avail;           /* Bytes in buffer */
+  size_t   pos;             /* Consumed by the previous batch */
+  bool     eof;
+
+  uint8_t *sendbuf;
+};
+
+static ifshare_log_cb_t g_ifshare_log_cb;
+static void            *g_ifshare_log_userdata;
+
+void
+ifshare_set_log_handler(ifshare_log_cb_t cb, void *userdata)
+{
+  g_ifshare_log_cb       = cb;
+  g_ifshare_log_userdata = userdata;
+}
+
+/* Log() in library builds: formatted in place, handed to the application */
+void
+ifshare_log(enum loglevel level, const char *fmt, ...)
+{
+  char message[IFSHARE_LOG_MAX];
+  va_list ap;
+
+  if (g_ifshare_log_cb == NULL)
+    return;
+
+  va_start(ap, fmt);
+  vsnprintf(message, sizeof(message), fmt, ap);
+  va_end(ap);
+
+  (g_ifshare_log_cb) (
+    (enum ifshare_log_level) level,
+    message,
+    g_ifshare_log_userdata);
+}
+
+static int
+ifshare_tcp_connect(const char *host, unsigned int port)
+{
+  struct addrinfo hints, *list = NULL, *ai;
+  char service[16];
+  char *name;
+  int fd = -1;
+  int error;
+
+  snprintf(service, sizeof(service), "%u", port);
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family   = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags    = AI_NUMERICSERV;
+
+  Info("Resolving `%s'...\n", host);
+
+  if ((error = getaddrinfo(host, service, &hints, &list)) != 0) {
+    Err("Failed to resolve hostname `%s': %s\n", host, gai_strerror(error));
+    return -1;
+  }
+
+  for (ai = list; ai != NULL && fd == -1; ai = ai->ai_next) {
+    if ((name = sockaddr_to_string(ai->ai_addr)) != NULL) {
+      Info("Connecting to %s...\n", name);
+      free(name);
+    }
+
+    if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, 0))
+      == -1) {
+      Err("Failed to create socket: %s\n", strerror(errno));
+      continue;
+    }
+
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+      Err("Failed to connect to host: %s\n", strerror(errno));
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  freeaddrinfo(list);
+
+  return fd;
+}
+
+static bool
+ifshare_send_all(int fd, const uint8_t *data, size_t size)
+{
+  ssize_t sent;
+
+  while (size > 0) {
+    if ((sent = send(fd, data, size, MSG_NOSIGNAL)) == -1) {
+      if (errno == EINTR)
+        continue;
+
+      Err("Failed to send to server: %s\n", strerror(errno));
+      return false;
+    }
+
+    data += sent;
+    size -= sent;
+  }
+
+  return true;
+}
+
+/* Settings for the server, see IFSHARE_MAGIC_HELLO */
+METHOD(ifshare, static bool, hello)
+{
+  uint8_t pdu[sizeof(struct ifshare_pdu) + IFSHARE_HELLO_MAX];
+  char *text = (char *) pdu + sizeof(struct ifshare_pdu);
+  struct ifshare_pdu header;
+  int len = 0, got;
+
+  if (self->params.group != NULL) {
+    got = snprintf(text, IFSHARE_HELLO_MAX, "group=%s\n", self->params.group);
+    if (got < 0 || (len += got) >= IFSHARE_HELLO_MAX)
+      goto too_long;
+  }
+
+  if (self->params.sample != IFSHARE_SAMPLE_NONE) {
+    got = snprintf(
+      text + len,
+      IFSHARE_HELLO_MAX - len,
+      "sample=%s:%u\n",
+      ifshare_sample_to_string(self->params.sample),
+      self->params.sample_rate);
+    if (got < 0 || (len += got) >= IFSHARE_HELLO_MAX)
+      goto too_long;
+  }
+
+  if (len == 0)
+    return true;
+
+  header.is_magic = IFSHARE_MAGIC_HELLO;
+  header.is_size  = len;
+  memcpy(pdu, &header, sizeof(struct ifshare_pdu));
+
+  return ifshare_send_all(self->fd, pdu, sizeof(struct ifshare_pdu) + len);
+
+too_long:
+  Err("Hello too long\n");
+  return false;
+}
+
+INSTANCER(ifshare, const struct ifshare_params *params)
+{
+  ifshare_t *new = NULL;
+  int fd = -1;
+
+  ALLOCATE_FAIL(new, ifshare_t);
+
+  new->params = *params;
+  new->fd     = -1;
+
+  ALLOCATE_MANY_FAIL(new->buffer, (int) IFSHARE_RECV_BUFFER, uint8_t);
+
+  if (params->shm_path != NULL) {
+    if (params->group != NULL) {
+      Err("Shared memory readers cannot join groups\n");
+      goto fail;
+    }
+
+    if (params->sample != IFSHARE_SAMPLE_NONE) {
+      Err("Shared memory readers cannot sample\n");
+      goto fail;
+    }
+
+    TRYC_FAIL(fd = shm_connect(params->shm_path));
+    MAKE_FAIL(new->reader, shmring_reader, fd);
+
+    /* The mapping is all we need */
+    close(fd);
+    fd = -1;
+  } else if (params->host != NULL) {
+    TRYC_FAIL(new->fd = ifshare_tcp_connect(params->host, params->port));
+    ALLOCATE_MANY_FAIL(new->sendbuf, (int) IFSHARE_SEND_BUFFER, uint8_t);
+    TRY_FAIL(ifshare_hello(new));
+  } else {
+    Err("No server given\n");
+    goto fail;
+  }
+
+  return new;
+
+fail:
+  if (fd != -1)
+    close(fd);
+
+  if (new != NULL)
+    DISPOSE(ifshare, new);
+
+  return NULL;
+}
+
+COLLECTOR(ifshare)
+{
+  if (self->reader != NULL)
+    DISPOSE(shmring_reader, self->reader);
+
+  if (self->fd != -1)
+    close(self->fd);
+
+  if (self->buffer != NULL)
+    free(self->buffer);
+
+  if (self->sendbuf != NULL)
+    free(self->sendbuf);
+
+  free(self);
+}
+
+/* Both PDU flavours: `pdu' holds at least `hdrsize' bytes */
+static void
+ifshare_fill_frame(
+  struct ifshare_frame *frame,
+  const uint8_t *pdu,
+  size_t hdrsize)
+{
+  struct ifshare_pdu_ts header;
+
+  memcpy(&header, pdu, hdrsize);
+
+  frame->data     = pdu + hdrsize;
+  frame->size     = header.is_size;
+  frame->pdu      = pdu;
+  frame->pdu_size = hdrsize + header.is_size;
+
+  if (header.is_magic == IFSHARE_MAGIC_TS) {
+    frame->timestamp.tv_sec  = header.is_ts_sec;
+    frame->timestamp.tv_nsec = header.is_ts_nsec;
+    frame->ts_source         = header.is_ts_source;
+  } else {
+    frame->timestamp.tv_sec  = 0;
+    frame->timestamp.tv_nsec = 0;
+    frame->ts_source         = IFSHARE_TS_USER;
+  }
+}
+
+/* Complete PDUs already in the buffer, -1 if one of them is invalid */
+METHOD(
+  ifshare,
+  static int,
+  parse,
+  struct ifshare_frame *frames,
+  unsigned int max)
+{
+  struct ifshare_pdu header;
+  size_t hdrsize;
+  unsigned int n = 0;
+
+  while (n < max && self->avail - self->pos >= sizeof(struct ifshare_pdu)) {
+    memcpy(&header, self->buffer + self->pos, sizeof(struct ifshare_pdu));
+
+    if ((hdrsize = ifshare_header_size(header.is_magic)) == 0) {
+      Err("SERVER ERROR: Invalid PDU magic (0x%x)\n", header.is_magic);
+      return -1;
+    }
+
+    if (header.is_size > IFSHARE_MAX_MTU) {
+      Err("SERVER ERROR: Invalid PDU size\n");
+      return -1;
+    }
+
+    if (self->avail - self->pos < hdrsize + header.is_size)
+      break;
+
+    ifshare_fill_frame(frames + n++, self->buffer + self->pos, hdrsize);
+    self->pos += hdrsize + header.is_size;
+  }
+
+  return n;
+}
+
+/*
+ * Read as much as the socket has to offer and split the stream into
+ * PDUs in user space. Under load, a single recv() brings in dozens of
+ * frames, instead of two syscalls per frame.
+ */
+METHOD(
+  ifshare,
+  static int,
+  recv_tcp,
+  struct ifshare_frame *frames,
+  unsigned int max,
+  int timeout_ms)
+{
+  struct pollfd pfd;
+  ssize_t got;
+  int n;
+
+  pfd.fd     = self->fd;
+  pfd.events = POLLIN;
+
+  for (;;) {
+    if ((n = ifshare_parse(self, frames, max)) != 0)
+      return n;
+
+    /* Nothing complete left: keep the incomplete PDU at the beginning */
+    if (self->pos > 0) {
+      memmove(self->buffer, self->buffer + self->pos, self->avail - self->pos);
+      self->avail -= self->pos;
+      self->pos    = 0;
+    }
+
+    if (timeout_ms >= 0) {
+      if ((n = poll(&pfd, 1, timeout_ms)) == 0)
+        return 0;
+
+      if (n == -1) {
+        if (errno == EINTR)
+          return 0;
+
+        Err("poll() failed: %s\n", strerror(errno));
+        return -1;
+      }
+    }
+
+    got = recv(
+      self->fd,
+      self->buffer + self->avail,
+      IFSHARE_RECV_BUFFER - self->avail,
+      0);
+
+    if (got == 0) {
+      self->eof = true;
+      return -1;
+    }
+
+    if (got == -1) {
+      /* Let the caller see signals, as when poll() is interrupted */
+      if (errno == EINTR)
+        return 0;
+
+      if (errno == EAGAIN)
+        continue;
+
+      Err("Failed to receive from server: %s\n", strerror(errno));
+      return -1;
+    }
+
+    self->avail += got;
+  }
+}
+
+/* Records are copied out of the ring: the writer never waits for us */
+METHOD(
+  ifshare,
+  static int,
+  recv_shm,
+  struct ifshare_frame *frames,
+  unsigned int max,
+  int timeout_ms)
+{
+  struct ifshare_pdu header;
+  uint8_t *pdu;
+  size_t used = 0, hdrsize;
+  ssize_t got;
+  unsigned int n = 0;
+  bool waited = false;
+
+  while (n < max
+    && IFSHARE_RECV_BUFFER - used >= IFSHARE_MAX_HEADER + IFSHARE_MAX_MTU) {
+    pdu = self->buffer + used;
+
+    if ((got = shmring_reader_read(
+      self->reader,
+      pdu,
+      IFSHARE_MAX_HEADER + IFSHARE_MAX_MTU)) == -1) {
+      self->eof = true;
+      break;
+    }
+
+    if (got == 0) {
+      if (n > 0 || timeout_ms == 0 || waited)
+        break;
+
+      shmring_reader_wait(
+        self->reader,
+        timeout_ms < 0 ? IFSHARE_SHM_WAIT_MS : timeout_ms);
+      waited = timeout_ms >= 0;
+      continue;
+    }
+
+    memcpy(&header, pdu, sizeof(struct ifshare_pdu));
+
+    if ((hdrsize = ifshare_header_size(header.is_magic)) == 0
+      || hdrsize + header.is_size != (size_t) got) {
+      Err("SERVER ERROR: Invalid PDU in shared ring\n");
+      return -1;
+    }
+
+    ifshare_fill_frame(frames + n++, pdu, hdrsize);
+    used += SHMRING_ALIGN(got);
+  }
+
+  return n == 0 && self->eof ? -1 : (int) n;
+}
+
+METHOD(
+  ifshare,
+  int,
+  recv_batch,
+  struct ifshare_frame *frames,
+  unsigned int max,
+  int timeout_ms)
+{
+  if (self->eof)
+    return -1;
+
+  if (self->reader != NULL)
+    return ifshare_recv_shm(self, frames, max, timeout_ms);
+
+  return ifshare_recv_tcp(self, frames, max, timeout_ms);
+}
+
+METHOD(ifshare, bool, run, ifshare_batch_cb_t cb, void *userdata)
+{
+  struct ifshare_frame frames[IFSHARE_BATCH_MAX];
+  int n;
+
+  while ((n = ifshare_recv_batch(self, frames, IFSHARE_BATCH_MAX, -1)) >= 0)
+    if (n > 0 && !(cb) (frames, n, userdata))
+      return true;
+
+  return self->eof;
+}
+
+/* Everything goes out in as few send() calls as the buffer allows */
+METHOD(
+  ifshare,
+  bool,
+  send_batch,
+  const struct ifshare_frame *frames,
+  unsigned int count)
+{
+  struct ifshare_pdu header;
+  size_t used = 0;
+  unsigned int i;
+
+  if (self->fd == -1) {
+    Err("Frames cannot be sent through a shared memory ring\n");
+    return false;
+  }
+
+  for (i = 0; i < count; ++i) {
+    if (frames[i].size > IFSHARE_MAX_MTU) {
+      Err("Frame too big (%zu bytes)\n", frames[i].size);
+      return false;
+    }
+
+    if (used + sizeof(struct ifshare_pdu) + frames[i].size
+      > IFSHARE_SEND_BUFFER) {
+      if (!ifshare_send_all(self->fd, self->sendbuf, used))
+        return false;
+      used = 0;
+    }
+
+    header.is_magic = IFSHARE_MAGIC;
+    header.is_size  = frames[i].size;
+
+    memcpy(self->sendbuf + used, &header, sizeof(struct ifshare_pdu));
+    used += sizeof(struct ifshare_pdu);
+
+    memcpy(self->sendbuf + used, frames[i].data, frames[i].size);
+    used += frames[i].size;
+  }
+
+  return used == 0 || ifshare_send_all(self->fd, self->sendbuf, used);
+}
+
+GETTER(ifshare, int, fd)
+{
+  return self->fd;
+}
+
+GETTER(ifshare, bool, eof)
+{
+  return self->eof;
+}
+
+GETTER(ifshare, uint64_t, lost)
+{
+  return self->reader != NULL ? self->reader->lost : 0;
+}
+
+static const char *g_sample_names[] = {"none", "count", "random", "flow"};
+
+bool
+ifshare_sample_from_string(
+  const char *string,
+  enum ifshare_sample *sample,
+  unsigned int *rate)
+{
+  const char *colon;
+  unsigned long n;
+  unsigned int i;
+  char *end;
+
+  if ((colon = strchr(string, ':')) == NULL)
+    return false;
+
+  /* strtoul() would take "-1" and wrap it around */
+  if (!isdigit((unsigned char) colon[1]))
+    return false;
+
+  errno = 0;
+  n = strtoul(colon + 1, &end, 10);
+  if (errno != 0 || *end != '\0' || n == 0 || n > UINT_MAX)
+    return false;
+
+  for (i = 1; i < sizeof(g_sample_names) / sizeof(g_sample_names[0]); ++i)
+    if (strlen(g_sample_names[i]) == (size_t) (colon - string)
+      && strncmp(g_sample_names[i], string, colon - string) == 0) {
+      *sample = (enum ifshare_sample) i;
+      *rate   = n;
+      return true;
+    }
+
+  return false;
+}
+
+const char *
+ifshare_sample_to_string(enum ifshare_sample sample)
+{
+  return g_sample_names[sample];
+}
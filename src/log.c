@@ -17,7 +17,7 @@
 
 */
 
-#define _POSIX_SOURCE
+#define _GNU_SOURCE
 
 #include <log.h>
 #include <defs.h>
@@ -33,12 +33,69 @@
 #include <stdint.h>
 #include <ctype.h>
 
-static unsigned g_log_level      = LogDebug;
+/*
+ * Logging is asynchronous: every thread formats its messages into a ring
+ * of its own (single producer, single consumer, no locks) and a writer
+ * thread takes them from there to g_logfp. If a ring is full, the message
+ * is dropped and counted, so that no thread ever waits for the output.
+ *
+ * Records are numbered as they are published, and written in that order
+ * with no gaps: a record whose number was taken but that is not in its
+ * ring yet holds back the ones after it until the next drain. Hexdumps
+ * would not fit in a ring and are written synchronously.
+ */
+#define LOG_RECORD_SIZE 256
+#define LOG_RING_SIZE   64   /* Power of two */
+#define LOG_FLUSH_MS    10
+
+struct log_record {
+  uint64_t       seq;
+  struct timeval tv;
+  enum loglevel  level;
+  bool           line_start;
+  char           msg[LOG_RECORD_SIZE];
+};
+
+struct log_ring {
+  struct log_record records[LOG_RING_SIZE];
+  unsigned int      head; /* Written by the writer thread */
+  unsigned int      tail; /* Written by the owner thread */
+  uint64_t          dropped;
+  bool              orphaned;   /* Owner thread exited */
+
+  bool              line_start; /* Owner thread only */
+
+  unsigned int      pending;    /* Writer thread only */
+  uint64_t          reported;   /* Writer thread only */
+
+  struct log_ring  *next;
+};
+
+struct log_batch_entry {
+  struct log_record *record;
+  struct log_ring   *ring;
+};
+
+unsigned int    g_log_level      = LogDebug;
 bool            g_log_line_start = true;
 FILE           *g_logfp          = NULL;
 bool            g_use_colors     = false;
 pthread_mutex_t g_log_mutex      = PTHREAD_MUTEX_INITIALIZER;
 
+static struct log_ring *g_log_rings   = NULL;
+static uint64_t         g_log_seq     = 0;
+static uint64_t         g_log_written = 0; /* Next seq to write */
+static uint64_t         g_log_dropped = 0;
+static bool             g_log_async   = false;
+static bool             g_log_running = false;
+static pthread_t        g_log_writer;
+static pthread_key_t    g_log_key;
+static pthread_once_t   g_log_once    = PTHREAD_ONCE_INIT;
+/* Set once the ring of this thread was released: log synchronously */
+#define LOG_RING_GONE ((struct log_ring *) -1)
+
+static __thread struct log_ring *t_log_ring = NULL;
+
 static const char *g_months[] = {
   "jan", "feb", "mar",
   "apr", "may", "jun",
@@ -54,39 +111,33 @@ static const char *g_level_abbrev[] = {
   "debug", "info", "warning", "error"
 };
 
-void
-logprintf(
+/* Must be called with g_log_mutex held */
+static void
+log_write(
   enum loglevel level,
-  const char *function,
-  const char *file,
-  int line,
-  const char *fmt,
-  ...)
+  const struct timeval *tv,
+  bool line_start,
+  const char *msg)
 {
-  va_list ap;
-  char *msg = NULL;
-
-  va_start(ap, fmt);
-
-  pthread_mutex_lock(&g_log_mutex);
-
-  if (level < g_log_level)
-    goto done;
+  size_t len = strlen(msg);
 
   if (g_logfp == NULL) {
     g_logfp          = LOG_DEFAULT_FP;
     g_log_line_start = true;
     g_use_colors     = true;
   }
-  
-  if (g_log_line_start) {
-    struct timeval tv;
-    struct tm      tm;
 
-    g_log_line_start = false;
+  if (len == 0)
+    return;
 
-    gettimeofday(&tv, NULL);
-    gmtime_r(&tv.tv_sec, &tm);
+  if (line_start) {
+    struct tm tm;
+
+    /* Whatever was left open by another thread ends here */
+    if (!g_log_line_start)
+      fputc('\n', g_logfp);
+
+    gmtime_r(&tv->tv_sec, &tm);
 
     if (g_use_colors)
       fprintf(g_logfp, "\e[%sm", g_level_colors[level]);
@@ -103,63 +154,395 @@ logprintf(
       g_level_abbrev[level]);
   }
 
-  TRY(msg = vstrbuild(fmt, ap));
+  fputs(msg, g_logfp);
+
+  g_log_line_start = msg[len - 1] == '\r' || msg[len - 1] == '\n';
+  if (g_log_line_start && g_use_colors)
+    fprintf(g_logfp, "\e[0m");
+}
+
+static int
+log_batch_entry_compare(const void *a, const void *b)
+{
+  const struct log_batch_entry *x = (const struct log_batch_entry *) a;
+  const struct log_batch_entry *y = (const struct log_batch_entry *) b;
+
+  return (x->record->seq > y->record->seq)
+    - (x->record->seq < y->record->seq);
+}
 
-done:
-  if (msg != NULL) {
+/*
+ * Writes everything queued so far, up to the first record still being
+ * published unless `force'. Returns the number of records written.
+ */
+static unsigned int
+log_drain(bool force)
+{
+  static struct log_batch_entry *batch = NULL; /* Under g_log_mutex */
+  static unsigned int alloc = 0;
+  struct log_batch_entry *grown;
+  struct log_record *record;
+  struct log_ring *ring, *prev, *next;
+  struct timeval tv;
+  unsigned int i, tail, count = 0, written;
+  uint64_t dropped = 0, total;
+  char msg[64];
 
-    if (g_logfp != NULL) {
-      size_t len = strlen(msg);
+  pthread_mutex_lock(&g_log_mutex);
 
-      if (len > 0) {
-        fputs(msg, g_logfp);
+  for (ring = __atomic_load_n(&g_log_rings, __ATOMIC_ACQUIRE);
+       ring != NULL;
+       ring = ring->next) {
+    tail          = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    ring->pending = 0;
+
+    if (count + LOG_RING_SIZE > alloc) {
+      if ((grown = realloc(
+        batch,
+        (alloc + 4 * LOG_RING_SIZE) * sizeof(struct log_batch_entry)))
+        != NULL) {
+        batch  = grown;
+        alloc += 4 * LOG_RING_SIZE;
+      }
+    }
 
-        g_log_line_start = msg[len - 1] == '\r' || msg[len - 1] == '\n';
-        if (g_log_line_start && g_use_colors && g_logfp != NULL)
-          fprintf(g_logfp, "\e[0m");
+    /* Out of memory: the rest waits, and gaps can no longer be told */
+    for (i = ring->head; i != tail; ++i) {
+      if (count == alloc) {
+        force = true;
+        break;
       }
+
+      batch[count].record = &ring->records[i & (LOG_RING_SIZE - 1)];
+      batch[count].ring   = ring;
+      ++count;
+    }
+
+    total          = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    dropped       += total - ring->reported;
+    ring->reported = total;
+  }
+
+  /*
+   * Restore the order in which messages were logged across threads.
+   * Records of a ring are in order, so what is written of each is a
+   * prefix of it. Late ones (after a forced drain) go out right away.
+   */
+  if (count > 0)
+    qsort(
+      batch,
+      count,
+      sizeof(struct log_batch_entry),
+      log_batch_entry_compare);
+
+  for (written = 0; written < count; ++written) {
+    record = batch[written].record;
+
+    if (!force && record->seq > g_log_written)
+      break;
+
+    log_write(record->level, &record->tv, record->line_start, record->msg);
+    ++batch[written].ring->pending;
+
+    if (record->seq >= g_log_written)
+      g_log_written = record->seq + 1;
+  }
+
+  if (dropped > 0) {
+    gettimeofday(&tv, NULL);
+    snprintf(
+      msg,
+      sizeof(msg),
+      "%llu log messages dropped\n",
+      (unsigned long long) dropped);
+    log_write(LogWarning, &tv, true, msg);
+  }
+
+  if (written > 0 || dropped > 0)
+    fflush(g_logfp);
+
+  /* Producers only ever touch the list head, so the rest can be pruned */
+  prev = NULL;
+  for (ring = __atomic_load_n(&g_log_rings, __ATOMIC_ACQUIRE);
+       ring != NULL;
+       ring = next) {
+    next = ring->next;
+
+    __atomic_store_n(&ring->head, ring->head + ring->pending, __ATOMIC_RELEASE);
+
+    if (prev != NULL
+      && __atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE)
+      && ring->head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+      prev->next = next;
+      free(ring);
+    } else {
+      prev = ring;
     }
-    
-    free(msg);
   }
 
   pthread_mutex_unlock(&g_log_mutex);
 
+  return written;
+}
+
+static void *
+log_writer_thread(void *unused)
+{
+  struct timespec ts = {0, LOG_FLUSH_MS * 1000000l};
+
+  (void) unused;
+
+  while (__atomic_load_n(&g_log_running, __ATOMIC_RELAXED)) {
+    log_drain(false);
+    nanosleep(&ts, NULL);
+  }
+
+  return NULL;
+}
+
+static void
+log_shutdown(void)
+{
+  if (__atomic_exchange_n(&g_log_running, false, __ATOMIC_RELAXED))
+    pthread_join(g_log_writer, NULL);
+
+  while (log_drain(true) > 0);
+}
+
+static void
+log_ring_release(void *data)
+{
+  struct log_ring *ring = (struct log_ring *) data;
+
+  if (ring == LOG_RING_GONE)
+    return;
+
+  /*
+   * The writer frees the ring from now on. Later destructors of this
+   * thread may still log, so they must never see it again.
+   */
+  t_log_ring = LOG_RING_GONE;
+  pthread_setspecific(g_log_key, LOG_RING_GONE);
+
+  __atomic_store_n(&ring->orphaned, true, __ATOMIC_RELEASE);
+}
+
+static void
+log_init(void)
+{
+  if (pthread_key_create(&g_log_key, log_ring_release) != 0)
+    return;
+
+  g_log_running = true;
+
+  if (pthread_create(&g_log_writer, NULL, log_writer_thread, NULL) != 0) {
+    g_log_running = false;
+    return;
+  }
+
+  atexit(log_shutdown);
+  g_log_async = true;
+}
+
+/* Lock-free: the ring is pushed at the head of the list with a CAS */
+static struct log_ring *
+log_get_ring(void)
+{
+  struct log_ring *ring;
+
+  if (t_log_ring == LOG_RING_GONE)
+    return NULL;
+
+  if (t_log_ring != NULL)
+    return t_log_ring;
+
+  pthread_once(&g_log_once, log_init);
+
+  if (!g_log_async || (ring = calloc(1, sizeof(struct log_ring))) == NULL)
+    return NULL;
+
+  ring->line_start = true;
+  ring->next       = __atomic_load_n(&g_log_rings, __ATOMIC_RELAXED);
+
+  while (!__atomic_compare_exchange_n(
+    &g_log_rings,
+    &ring->next,
+    ring,
+    true,
+    __ATOMIC_RELEASE,
+    __ATOMIC_RELAXED));
+
+  pthread_setspecific(g_log_key, ring);
+
+  return t_log_ring = ring;
+}
+
+void
+logprintf(
+  enum loglevel level,
+  const char *function,
+  const char *file,
+  int line,
+  const char *fmt,
+  ...)
+{
+  va_list ap;
+  struct log_ring *ring;
+  struct log_record *record;
+  struct log_record local;
+  unsigned int tail;
+  bool truncated;
+  size_t len;
+
+  if (!log_enabled(level))
+    return;
+
+  /* Once the writer is gone (at exit), fall back to synchronous writes */
+  if ((ring = log_get_ring()) != NULL
+    && !__atomic_load_n(&g_log_running, __ATOMIC_RELAXED))
+    ring = NULL;
+
+  if (ring != NULL) {
+    tail = ring->tail;
+
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE) {
+      /* Global count right away, per ring for the writer's report */
+      __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&g_log_dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+
+    record = &ring->records[tail & (LOG_RING_SIZE - 1)];
+  } else {
+    record = &local;
+  }
+
+  va_start(ap, fmt);
+  truncated = vsnprintf(record->msg, LOG_RECORD_SIZE, fmt, ap)
+    >= LOG_RECORD_SIZE;
   va_end(ap);
+
+  len = strlen(record->msg);
+
+  /* Truncated messages still end the line they started */
+  if (truncated && strchr(fmt, '\n') != NULL)
+    record->msg[len - 1] = '\n';
+
+  record->level = level;
+  gettimeofday(&record->tv, NULL);
+
+  if (ring != NULL) {
+    record->seq        = __atomic_fetch_add(&g_log_seq, 1, __ATOMIC_RELAXED);
+    record->line_start = ring->line_start;
+    ring->line_start   = len > 0
+      && (record->msg[len - 1] == '\n' || record->msg[len - 1] == '\r');
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+  } else {
+    /* No ring for this thread: write it synchronously */
+    pthread_mutex_lock(&g_log_mutex);
+    log_write(level, &record->tv, g_log_line_start, record->msg);
+    pthread_mutex_unlock(&g_log_mutex);
+  }
 }
 
 void
-log_hexdump(enum loglevel level, const void *data, size_t size)
+log_set_level(enum loglevel level)
+{
+  __atomic_store_n(&g_log_level, level, __ATOMIC_RELAXED);
+}
+
+bool
+log_ratelimit(
+  struct log_ratelimit *rl,
+  unsigned int interval_ms,
+  uint64_t *suppressed)
+{
+  struct timespec ts;
+  uint64_t now, next;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  now  = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+  next = __atomic_load_n(&rl->next, __ATOMIC_RELAXED);
+
+  /* Only one of the threads racing for the same slot gets it */
+  if (now < next
+    || !__atomic_compare_exchange_n(
+      &rl->next,
+      &next,
+      now + interval_ms * 1000000ull,
+      false,
+      __ATOMIC_RELAXED,
+      __ATOMIC_RELAXED)) {
+    __atomic_fetch_add(&rl->suppressed, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+
+  *suppressed = __atomic_exchange_n(&rl->suppressed, 0, __ATOMIC_RELAXED);
+
+  return true;
+}
+
+uint64_t
+log_dropped_count(void)
+{
+  return __atomic_load_n(&g_log_dropped, __ATOMIC_RELAXED);
+}
+
+/*
+ * Hundreds of lines for a full frame: more than a ring holds, so they are
+ * written right away, after whatever was queued before, and in one piece.
+ */
+void
+logdump(enum loglevel level, const void *data, size_t size)
 {
   const uint8_t *bytes = (const uint8_t *) data;
-  int i, j;
+  struct timeval tv;
+  char line[128];
+  size_t i, j, p;
 
-  for (i = 0; i < size; ++i) {
-    if ((i & 0xf) == 0)
-      Log(level, "%08x  ", i);
+  if (!log_enabled(level))
+    return;
 
-    Log(level, "%s%02x ", (i & 0xf) == 8 ? " " : "", bytes[i]);
+  log_drain(true);
 
-    if ((i & 0xf) == 0xf) {
-      Log(level, " | ");
+  gettimeofday(&tv, NULL);
 
-      for (j = i - 15; j <= i; ++j)
-        Log(level, "%c", isprint(bytes[j]) ? bytes[j] : '.');
+  pthread_mutex_lock(&g_log_mutex);
 
-      Log(level, "\n");
+  for (i = 0; i < size; i += 16) {
+    p = snprintf(line, sizeof(line), "%08zx  ", i);
+
+    for (j = i; j < i + 16; ++j) {
+      if (j < size)
+        p += snprintf(
+          line + p,
+          sizeof(line) - p,
+          "%s%02x ",
+          (j & 0xf) == 8 ? " " : "",
+          bytes[j]);
+      else
+        p += snprintf(
+          line + p,
+          sizeof(line) - p,
+          "   %s",
+          (j & 0xf) == 8 ? " " : "");
     }
-  }
 
-  if ((i & 0xf) != 0) {
-    for (j = i; j < ((size + 0xf) >> 4) << 4; ++j)
-      Log(level, "   %s", (j & 0xf) == 8 ? " " : "");
-    Log(level, " | ");
+    p += snprintf(line + p, sizeof(line) - p, " | ");
+
+    for (j = i; j < size && j < i + 16; ++j)
+      line[p++] = isprint(bytes[j]) ? bytes[j] : '.';
 
-    for (j = i & ~0xf; j < size; ++j)
-      Log(level, "%c", isprint (bytes[j]) ? bytes[j] : '.');
+    line[p++] = '\n';
+    line[p]   = '\0';
 
-    Log(level, "\n");
+    log_write(level, &tv, true, line);
   }
 
-  Log(level, "%08x  \n", i);
+  snprintf(line, sizeof(line), "%08zx  \n", size);
+  log_write(level, &tv, true, line);
+
+  fflush(g_logfp);
+
+  pthread_mutex_unlock(&g_log_mutex);
 }
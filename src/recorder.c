@@ -0,0 +1,425 @@
+/*
+  recorder.c: pcapng recording sink
+  Copyright (C) 2025 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, version 3.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#define _GNU_SOURCE
+
+#include <ifshare.h>
+#include <recorder.h>
+#include <util.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#define PCAPNG_SHB_TYPE       0x0a0d0d0a
+#define PCAPNG_IDB_TYPE       0x00000001
+#define PCAPNG_EPB_TYPE       0x00000006
+#define PCAPNG_BYTE_ORDER     0x1a2b3c4d
+#define PCAPNG_LINKTYPE_ETH   1
+#define PCAPNG_OPT_TSRESOL    9
+#define PCAPNG_PAD(x)         (((x) + 3) & ~3)
+
+struct pcapng_shb {
+  uint32_t type;
+  uint32_t length;
+  uint32_t byte_order;
+  uint16_t major;
+  uint16_t minor;
+  int64_t  section_length;
+  uint32_t length2;
+} __attribute__((packed));
+
+struct pcapng_idb {
+  uint32_t type;
+  uint32_t length;
+  uint16_t linktype;
+  uint16_t reserved;
+  uint32_t snaplen;
+  uint16_t tsresol_code;
+  uint16_t tsresol_length;
+  uint8_t  tsresol;
+  uint8_t  tsresol_pad[3];
+  uint32_t end_of_options;
+  uint32_t length2;
+} __attribute__((packed));
+
+struct pcapng_epb {
+  uint32_t type;
+  uint32_t length;
+  uint32_t interface;
+  uint32_t ts_high;
+  uint32_t ts_low;
+  uint32_t captured;
+  uint32_t original;
+  uint8_t  data[0];
+} __attribute__((packed));
+
+METHOD(recorder, static bool, write, const uint8_t *data, size_t size)
+{
+  ssize_t got;
+
+  while (size > 0) {
+    got = write(self->fd, data, size);
+
+    if (got == -1) {
+      if (errno == EINTR)
+        continue;
+
+      Err("Recorder: write failed: %s\n", strerror(errno));
+      return false;
+    }
+
+    data += got;
+    size -= got;
+  }
+
+  return true;
+}
+
+/*
+ * Writes as many whole RECORDER_ALIGNMENT blocks as there are in the
+ * buffer. If `all' is set, the unaligned tail is written too (only
+ * right before closing the file, as it breaks O_DIRECT alignment).
+ */
+METHOD(recorder, static bool, flush, bool all)
+{
+  size_t aligned = self->used & ~((size_t) RECORDER_ALIGNMENT - 1);
+  bool ok = false;
+
+  if (self->fd == -1)
+    return false;
+
+  if (aligned > 0) {
+    TRY(recorder_write(self, self->buffer, aligned));
+
+    memmove(self->buffer, self->buffer + aligned, self->used - aligned);
+    self->used -= aligned;
+  }
+
+  if (all && self->used > 0) {
+    if (self->params.direct)
+      fcntl(self->fd, F_SETFL, fcntl(self->fd, F_GETFL) & ~O_DIRECT);
+
+    TRY(recorder_write(self, self->buffer, self->used));
+    self->used = 0;
+  }
+
+  ok = true;
+
+done:
+  return ok;
+}
+
+METHOD(recorder, static void *, reserve, size_t size)
+{
+  if (self->used + size > RECORDER_BUFFER_SIZE)
+    if (!recorder_flush(self, false))
+      return NULL;
+
+  self->used      += size;
+  self->file_size += size;
+
+  return self->buffer + self->used - size;
+}
+
+METHOD(recorder, static void, close_file)
+{
+  if (self->fd != -1) {
+    recorder_flush(self, true);
+    close(self->fd);
+    self->fd   = -1;
+    self->used = 0;
+  }
+}
+
+METHOD(recorder, static bool, open_file)
+{
+  struct pcapng_shb *shb;
+  struct pcapng_idb *idb;
+  struct tm tm;
+  char stamp[32];
+  char *path = NULL;
+  int flags = O_WRONLY | O_CREAT | O_TRUNC;
+  bool ok = false;
+
+  self->file_opened = time(NULL);
+  gmtime_r(&self->file_opened, &tm);
+  strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%SZ", &tm);
+
+  TRY(path = strbuild(
+    "%s-%s-%04u.pcapng",
+    self->params.prefix,
+    stamp,
+    self->file_index++));
+
+  if (self->params.direct)
+    flags |= O_DIRECT;
+
+  self->fd = open(path, flags, 0644);
+
+  if (self->fd == -1 && self->params.direct && errno == EINVAL) {
+    Warn("Recorder: %s does not support O_DIRECT, disabling it\n", path);
+    self->params.direct = false;
+    self->fd = open(path, flags & ~O_DIRECT, 0644);
+  }
+
+  if (self->fd == -1) {
+    Err("Recorder: cannot open %s: %s\n", path, strerror(errno));
+    goto done;
+  }
+
+  self->used      = 0;
+  self->file_size = 0;
+
+  TRY(shb = recorder_reserve(self, sizeof(struct pcapng_shb)));
+  shb->type           = PCAPNG_SHB_TYPE;
+  shb->length         = sizeof(struct pcapng_shb);
+  shb->byte_order     = PCAPNG_BYTE_ORDER;
+  shb->major          = 1;
+  shb->minor          = 0;
+  shb->section_length = -1;
+  shb->length2        = sizeof(struct pcapng_shb);
+
+  TRY(idb = recorder_reserve(self, sizeof(struct pcapng_idb)));
+  memset(idb, 0, sizeof(struct pcapng_idb));
+  idb->type           = PCAPNG_IDB_TYPE;
+  idb->length         = sizeof(struct pcapng_idb);
+  idb->linktype       = PCAPNG_LINKTYPE_ETH;
+  idb->snaplen        = IFSHARE_MAX_MTU;
+  idb->tsresol_code   = PCAPNG_OPT_TSRESOL;
+  idb->tsresol_length = 1;
+  idb->tsresol        = 9; /* Nanoseconds */
+  idb->length2        = sizeof(struct pcapng_idb);
+
+  STATS_INC(self->stats.files);
+  Info("Recorder: writing to %s\n", path);
+
+  ok = true;
+
+done:
+  if (path != NULL)
+    free(path);
+
+  return ok;
+}
+
+/* Returns false while recording is off, after a failure */
+METHOD(recorder, static bool, rotate_if_needed)
+{
+  bool rotate = self->fd == -1 && !self->failed;
+
+  if (self->params.max_size > 0 && self->file_size >= self->params.max_size)
+    rotate = true;
+
+  if (self->params.max_time > 0
+    && time(NULL) - self->file_opened >= self->params.max_time)
+    rotate = true;
+
+  /* A new file every RECORDER_RETRY_S, until one can be written again */
+  if (self->failed && time(NULL) - self->file_opened >= RECORDER_RETRY_S)
+    rotate = true;
+
+  if (rotate) {
+    recorder_close_file(self);
+
+    if (!recorder_open_file(self))
+      return false;
+
+    if (self->failed)
+      Info("Recorder: recording again\n");
+
+    self->failed = false;
+  }
+
+  return !self->failed;
+}
+
+METHOD(recorder, static bool, record, const frame_t *frame)
+{
+  struct pcapng_epb *epb;
+  size_t hdrsize = ifshare_header_size(*(const uint32_t *) frame->data);
+  size_t size    = frame->size - hdrsize;
+  size_t padded  = PCAPNG_PAD(size);
+  size_t total   = sizeof(struct pcapng_epb) + padded + sizeof(uint32_t);
+  uint64_t ts    = frame_timestamp_ns(frame);
+  bool ok = false;
+
+  TRY(epb = recorder_reserve(self, total));
+
+  epb->type      = PCAPNG_EPB_TYPE;
+  epb->length    = total;
+  epb->interface = 0;
+  epb->ts_high   = ts >> 32;
+  epb->ts_low    = ts & 0xffffffff;
+  epb->captured  = size;
+  epb->original  = size;
+
+  memcpy(epb->data, frame->data + hdrsize, size);
+  memset(epb->data + size, 0, padded - size);
+  memcpy(epb->data + padded, &epb->length, sizeof(uint32_t));
+
+  STATS_INC(self->stats.recorded_frames);
+  STATS_ADD(self->stats.recorded_bytes, size);
+
+  ok = true;
+
+done:
+  return ok;
+}
+
+METHOD(
+  recorder,
+  static void,
+  record_batch,
+  frame_t **frames,
+  unsigned int count)
+{
+  unsigned int i;
+
+  if (!recorder_rotate_if_needed(self))
+    self->failed = true;
+
+  for (i = 0; i < count; ++i) {
+    if (self->failed || !recorder_record(self, frames[i])) {
+      self->failed = true;
+      STATS_INC(self->stats.dropped_frames);
+    }
+
+    frame_dec_ref(frames[i]);
+  }
+}
+
+static void *
+recorder_thread(void *userdata)
+{
+  recorder_t *self = (recorder_t *) userdata;
+  frame_t *frames[RECORDER_BATCH];
+  unsigned int count;
+
+  while (__atomic_load_n(&self->running, __ATOMIC_RELAXED)) {
+    count = fqueue_pop_batch_timeout(
+      self->queue,
+      frames,
+      RECORDER_BATCH,
+      RECORDER_FLUSH_MS);
+
+    recorder_record_batch(self, frames, count);
+
+    /* Idle: push whatever can be written without breaking alignment */
+    if (count == 0 && !self->failed)
+      if (!recorder_flush(self, !self->params.direct))
+        self->failed = true;
+  }
+
+  /* Frames queued before recorder_destroy() still make it to the file */
+  while ((count = fqueue_pop_batch_timeout(
+    self->queue,
+    frames,
+    RECORDER_BATCH,
+    0)) > 0
+    || fqueue_count(self->queue) > 0)
+    recorder_record_batch(self, frames, count);
+
+  recorder_close_file(self);
+
+  return NULL;
+}
+
+INSTANCER(recorder, const struct recorder_params *params)
+{
+  recorder_t *new = NULL;
+
+  ALLOCATE_FAIL(new, recorder_t);
+
+  new->params = *params;
+  new->fd     = -1;
+
+  MAKE_FAIL(new->queue, fqueue);
+
+  TRYZ_FAIL(posix_memalign(
+    (void **) &new->buffer,
+    RECORDER_ALIGNMENT,
+    RECORDER_BUFFER_SIZE));
+
+  TRY_FAIL(recorder_open_file(new));
+
+  new->running = true;
+  TRYZ_FAIL(pthread_create(&new->thread, NULL, recorder_thread, new));
+  new->thread_started = true;
+
+  return new;
+
+fail:
+  if (new != NULL)
+    DISPOSE(recorder, new);
+
+  return NULL;
+}
+
+COLLECTOR(recorder)
+{
+  if (self->thread_started) {
+    __atomic_store_n(&self->running, false, __ATOMIC_RELAXED);
+    fqueue_push_frame(self->queue, NULL); /* Wake up */
+    pthread_join(self->thread, NULL);
+  } else {
+    recorder_close_file(self);
+  }
+
+  if (self->queue != NULL)
+    DISPOSE(fqueue, self->queue);
+
+  if (self->buffer != NULL)
+    free(self->buffer);
+
+  free(self);
+}
+
+/* Called from the capture thread. Never waits for the disk. */
+METHOD(recorder, void, push_frame, frame_t *frame)
+{
+  if (__atomic_load_n(&self->failed, __ATOMIC_RELAXED)
+    || fqueue_count(self->queue) >= self->params.max_queue) {
+    STATS_INC(self->stats.dropped_frames);
+    return;
+  }
+
+  frame_inc_ref(frame);
+
+  if (!fqueue_push_frame(self->queue, frame))
+    STATS_INC(self->stats.dropped_frames);
+}
+
+#define RECORDER_STAT(fp, metric, value)  \
+  fprintf(                                \
+    fp,                                   \
+    "ifshare_recorder_" metric " %llu\n", \
+    (unsigned long long) (value))
+
+METHOD(recorder, void, dump_stats, FILE *fp)
+{
+  RECORDER_STAT(fp, "queue_depth", fqueue_count(self->queue));
+  RECORDER_STAT(fp, "recorded_frames", STATS_GET(self->stats.recorded_frames));
+  RECORDER_STAT(fp, "recorded_bytes", STATS_GET(self->stats.recorded_bytes));
+  RECORDER_STAT(fp, "dropped_frames", STATS_GET(self->stats.dropped_frames));
+  RECORDER_STAT(fp, "files", STATS_GET(self->stats.files));
+  RECORDER_STAT(fp, "failed", self->failed);
+}
@@ -0,0 +1,327 @@
+/*
+  registry.c: Generation-indexed registry with lock-free snapshots
+  Copyright (C) 2025 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, version 3.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <registry.h>
+
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+
+#define REGISTRY_NO_SLOT     UINT32_MAX
+#define REGISTRY_INDEX_MASK  0xffffffffu
+#define REGISTRY_SPIN_YIELDS 64
+#define REGISTRY_WAIT_NS     100000
+
+static inline registry_handle_t
+registry_make_handle(uint32_t index, uint32_t generation)
+{
+  return ((registry_handle_t) generation << 32) | index;
+}
+
+static struct registry_snapshot *
+registry_snapshot_resize(struct registry_snapshot *snapshot, unsigned int capacity)
+{
+  struct registry_snapshot *new;
+
+  if ((new = realloc(
+    snapshot,
+    sizeof(struct registry_snapshot)
+    + capacity * sizeof(struct registry_entry))) == NULL)
+    return NULL;
+
+  if (snapshot == NULL)
+    new->count = 0;
+
+  new->capacity = capacity;
+
+  return new;
+}
+
+INSTANCER(registry)
+{
+  registry_t *new = NULL;
+
+  ALLOCATE_FAIL(new, registry_t);
+
+  new->free_head = REGISTRY_NO_SLOT;
+
+  TRYZ_FAIL(pthread_mutex_init(&new->mutex, NULL));
+  TRY_FAIL(new->snapshot = registry_snapshot_resize(NULL, 0));
+  TRY_FAIL(new->spare    = registry_snapshot_resize(NULL, 0));
+
+  return new;
+
+fail:
+  if (new != NULL)
+    DISPOSE(registry, new);
+
+  return NULL;
+}
+
+/* Items are owned by the caller, they are not released here */
+COLLECTOR(registry)
+{
+  if (self->snapshot != NULL)
+    free(self->snapshot);
+
+  if (self->spare != NULL)
+    free(self->spare);
+
+  if (self->live != NULL)
+    free(self->live);
+
+  if (self->slots != NULL)
+    free(self->slots);
+
+  pthread_mutex_destroy(&self->mutex);
+
+  free(self);
+}
+
+/* Waits until no reader can hold a snapshot older than the current one */
+METHOD(registry, static void, synchronize)
+{
+  struct timespec ts = {0, REGISTRY_WAIT_NS};
+  unsigned int old;
+  unsigned int n = 0;
+
+  old = __atomic_fetch_add(&self->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+
+  /* Readers are usually gone in a few microseconds, but not always */
+  while (__atomic_load_n(&self->readers[old], __ATOMIC_SEQ_CST) != 0)
+    if (n++ < REGISTRY_SPIN_YIELDS)
+      sched_yield();
+    else
+      nanosleep(&ts, NULL);
+}
+
+/*
+ * Copies the live array into the spare snapshot and swaps it with the
+ * published one. The caller makes sure the spare is big enough.
+ */
+METHOD(registry, static void, publish)
+{
+  struct registry_snapshot *new = self->spare;
+
+  new->count = self->live_count;
+  memcpy(
+    new->entries,
+    self->live,
+    self->live_count * sizeof(struct registry_entry));
+
+  self->spare = __atomic_exchange_n(&self->snapshot, new, __ATOMIC_SEQ_CST);
+
+  registry_synchronize(self);
+}
+
+METHOD(registry, static bool, grow)
+{
+  struct registry_slot *slots;
+  struct registry_entry *live;
+  unsigned int alloc = self->slot_alloc == 0 ? 16 : 2 * self->slot_alloc;
+
+  if ((slots = realloc(self->slots, alloc * sizeof(struct registry_slot)))
+    == NULL)
+    return false;
+  self->slots = slots;
+
+  if ((live = realloc(self->live, alloc * sizeof(struct registry_entry)))
+    == NULL)
+    return false;
+  self->live = live;
+
+  self->slot_alloc = alloc;
+
+  return true;
+}
+
+METHOD(registry, static void, release_slot, uint32_t index)
+{
+  struct registry_slot *slot = self->slots + index;
+
+  slot->item  = NULL;
+  slot->dense = self->free_head;
+  ++slot->generation;
+  self->free_head = index;
+}
+
+METHOD(registry, registry_handle_t, insert, void *item)
+{
+  registry_handle_t handle = REGISTRY_INVALID_HANDLE;
+  struct registry_snapshot *spare;
+  struct registry_slot *slot;
+  uint32_t index;
+
+  pthread_mutex_lock(&self->mutex);
+
+  /*
+   * Removals never need more room than the spare has: it holds the
+   * snapshot previous to the current one, which was at most one item
+   * smaller. Only insertions have to check.
+   */
+  if (self->spare->capacity < self->live_count + 1) {
+    if ((spare = registry_snapshot_resize(
+      self->spare,
+      self->slot_alloc > self->live_count
+        ? self->slot_alloc
+        : self->live_count + 1)) == NULL)
+      goto done;
+    self->spare = spare;
+  }
+
+  if (self->free_head != REGISTRY_NO_SLOT) {
+    index           = self->free_head;
+    self->free_head = self->slots[index].dense;
+  } else {
+    if (self->slot_count == self->slot_alloc && !registry_grow(self))
+      goto done;
+
+    index = self->slot_count++;
+    self->slots[index].generation = 0;
+  }
+
+  slot        = self->slots + index;
+  slot->item  = item;
+  slot->dense = self->live_count;
+
+  handle = registry_make_handle(index, slot->generation);
+
+  self->live[self->live_count].item   = item;
+  self->live[self->live_count].handle = handle;
+  ++self->live_count;
+
+  registry_publish(self);
+
+done:
+  pthread_mutex_unlock(&self->mutex);
+
+  return handle;
+}
+
+/* Returns the item, or NULL if the handle is stale */
+METHOD(registry, void *, remove, registry_handle_t handle)
+{
+  uint32_t index      = handle & REGISTRY_INDEX_MASK;
+  uint32_t generation = handle >> 32;
+  struct registry_slot *slot;
+  struct registry_entry *last;
+  void *item = NULL;
+
+  pthread_mutex_lock(&self->mutex);
+
+  if (index >= self->slot_count)
+    goto done;
+
+  slot = self->slots + index;
+
+  if (slot->item == NULL || slot->generation != generation)
+    goto done;
+
+  item = slot->item;
+
+  /* Move the last live entry into the hole */
+  last = self->live + --self->live_count;
+  if (slot->dense != self->live_count) {
+    self->live[slot->dense] = *last;
+    self->slots[last->handle & REGISTRY_INDEX_MASK].dense = slot->dense;
+  }
+
+  registry_release_slot(self, index);
+  registry_publish(self);
+
+done:
+  pthread_mutex_unlock(&self->mutex);
+
+  return item;
+}
+
+METHOD(
+  registry,
+  unsigned int,
+  remove_if,
+  bool (*pred)(void *, void *),
+  void (*removed)(void *, void *),
+  void *userdata)
+{
+  struct registry_entry tmp;
+  unsigned int i = 0, count;
+  unsigned int n = 0;
+
+  pthread_mutex_lock(&self->mutex);
+
+  count = self->live_count;
+
+  /* Removed entries are swapped to the tail, past live_count */
+  while (i < self->live_count) {
+    if (!pred(self->live[i].item, userdata)) {
+      ++i;
+      continue;
+    }
+
+    registry_release_slot(self, self->live[i].handle & REGISTRY_INDEX_MASK);
+
+    tmp = self->live[i];
+    self->live[i] = self->live[--self->live_count];
+    self->live[self->live_count] = tmp;
+
+    if (i < self->live_count)
+      self->slots[self->live[i].handle & REGISTRY_INDEX_MASK].dense = i;
+  }
+
+  if ((n = count - self->live_count) > 0) {
+    registry_publish(self);
+
+    if (removed != NULL)
+      for (i = self->live_count; i < count; ++i)
+        removed(self->live[i].item, userdata);
+  }
+
+  pthread_mutex_unlock(&self->mutex);
+
+  return n;
+}
+
+METHOD(
+  registry,
+  const struct registry_snapshot *,
+  read_lock,
+  unsigned int *token)
+{
+  unsigned int epoch;
+
+  /* Retry if a writer flipped the epoch before we were counted */
+  for (;;) {
+    epoch = __atomic_load_n(&self->epoch, __ATOMIC_SEQ_CST) & 1;
+    __atomic_fetch_add(&self->readers[epoch], 1, __ATOMIC_SEQ_CST);
+
+    if ((__atomic_load_n(&self->epoch, __ATOMIC_SEQ_CST) & 1) == epoch)
+      break;
+
+    __atomic_fetch_sub(&self->readers[epoch], 1, __ATOMIC_SEQ_CST);
+  }
+
+  *token = epoch;
+
+  return __atomic_load_n(&self->snapshot, __ATOMIC_SEQ_CST);
+}
+
+METHOD(registry, void, read_unlock, unsigned int token)
+{
+  __atomic_fetch_sub(&self->readers[token], 1, __ATOMIC_RELEASE);
+}
@@ -17,68 +17,216 @@
 
 */
 
+#define _GNU_SOURCE
+
 #include <ifshare.h>
 
+#include <time.h>
+
 #include <linux/if_packet.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+#include <linux/errqueue.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <linux/if.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netinet/ether.h>
+#include <netdb.h>
 
 #include <server.h>
+#include <capfile.h>
+#include <libifshare.h>
+#include <flow.h>
 
 #include <sys/poll.h>
 #include <util.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
+
+
+/* Watched clients are still in some acceptor's poll set */
+static bool
+server_client_finished(void *item, void *userdata)
+{
+  client_t *client = (client_t *) item;
+
+  (void) userdata;
+
+  return !client_running(client)
+    && !__atomic_load_n(&client->watched, __ATOMIC_ACQUIRE);
+}
+
+static bool
+server_client_any(void *item, void *userdata)
+{
+  (void) item;
+  (void) userdata;
+
+  return true;
+}
+
+/* Called once the client is out of every snapshot */
+static void
+server_client_dispose(void *item, void *userdata)
+{
+  server_t *self = (server_t *) userdata;
+  client_t *client = (client_t *) item;
+
+  groups_close(self->groups, client, &client->group);
+  DISPOSE(client, client);
+}
+
+/* Called by the client's reader thread */
+static bool
+server_client_hello(
+  void *userdata,
+  client_t *client,
+  const struct client_hello *hello)
+{
+  server_t *self = (server_t *) userdata;
+  const char *group = hello->group[0] != '\0' ? hello->group : NULL;
 
+  if (!groups_join(self->groups, client, &client->group, group))
+    return false;
+
+  if (group != NULL)
+    Info("[%16s] Joined group `%s'\n", client->name, group);
+
+  return true;
+}
+
+/* Client frames are dropped until the loop creates the injector */
+static bool
+server_reverse_push(void *userdata, const uint8_t *data, size_t size)
+{
+  server_t *self = (server_t *) userdata;
+  injector_t *injector = __atomic_load_n(&self->injector, __ATOMIC_ACQUIRE);
+
+  return injector != NULL && injector_push(injector, data, size);
+}
+
+static void
+server_reverse_flush(void *userdata)
+{
+  server_t *self = (server_t *) userdata;
+  injector_t *injector = __atomic_load_n(&self->injector, __ATOMIC_ACQUIRE);
+
+  if (injector != NULL)
+    injector_flush(injector);
+}
 
 METHOD(server, static void, cleanup_clients)
 {
-  unsigned int i;
+  registry_remove_if(
+    self->clients,
+    server_client_finished,
+    server_client_dispose,
+    self);
+}
 
-  pthread_mutex_lock(&self->client_mutex);
+static bool
+server_listener_watch(struct server_listener *listener, client_t *client)
+{
+  struct pollfd *fds;
+  client_t **list;
+  unsigned int alloc;
+  bool ok = false;
 
-  for (i = 0; i < self->client_count; ++i) {
-    if (self->client_list[i] != NULL && !client_running(self->client_list[i])) {
-      DISPOSE(client, self->client_list[i]);
-      self->client_list[i] = NULL;
-    }
+  if (listener->quiet_count == listener->quiet_alloc) {
+    alloc = listener->quiet_alloc == 0
+      ? SERVER_QUIET_ALLOC
+      : 2 * listener->quiet_alloc;
+
+    TRY(fds = realloc(
+      listener->fds,
+      (SERVER_ACCEPTOR_FDS + alloc) * sizeof(struct pollfd)));
+    listener->fds = fds;
+
+    TRY(list = realloc(listener->quiet_list, alloc * sizeof(client_t *)));
+    listener->quiet_list  = list;
+    listener->quiet_alloc = alloc;
   }
 
-  pthread_mutex_unlock(&self->client_mutex);
+  fds = listener->fds + SERVER_ACCEPTOR_FDS + listener->quiet_count;
+  fds->fd      = client->sfd;
+  fds->events  = POLLIN;
+  fds->revents = 0;
+
+  client->watched = true;
+  listener->quiet_list[listener->quiet_count++] = client;
+
+  ok = true;
+
+done:
+  return ok;
+}
+
+/* The client sent something, or went away: its reader takes over */
+METHOD(
+  server,
+  static void,
+  unwatch_client,
+  struct server_listener *listener,
+  unsigned int index)
+{
+  client_t *client = listener->quiet_list[index];
+  unsigned int last = --listener->quiet_count;
+  uint64_t one = 1;
+
+  if (!client_start_reader(client))
+    shutdown(client->sfd, SHUT_RDWR);
+
+  listener->quiet_list[index] = listener->quiet_list[last];
+  listener->fds[SERVER_ACCEPTOR_FDS + index] =
+    listener->fds[SERVER_ACCEPTOR_FDS + last];
+
+  __atomic_store_n(&client->watched, false, __ATOMIC_RELEASE);
+
+  /* Its exit may have been signalled while it could not be reaped */
+  if (!client_running(client))
+    write(self->reapfd, &one, sizeof(uint64_t));
 }
 
-METHOD(server, static bool, accept_client)
+METHOD(server, static bool, accept_client, struct server_listener *listener)
 {
   int sfd;
   bool ok = false;
-  bool acquired = false;
   
-  struct sockaddr_in addr;
+  struct client_params params = self->params.client;
   client_t *client = NULL;
-  socklen_t len;
 
-  TRYC(sfd = accept(self->listenfd, (struct sockaddr *) &addr, &len));
+  /* Running out of descriptors would make this fail on every poll() */
+  if ((sfd = accept4(listener->fd, NULL, NULL, SOCK_CLOEXEC)) == -1) {
+    LogEvery(1000, LogWarning, "accept() failed: %s\n", strerror(errno));
+    goto done;
+  }
 
-  MAKE(client, client, sfd, NULL);
+  params.cpus = listener->cpus;
+  MAKE(client, client, sfd, NULL, &params);
 
-  pthread_mutex_lock(&self->client_mutex);
-  acquired = true;
+  /* Frames flow right away, whether the client says hello or not */
+  if (!server_listener_watch(listener, client))
+    TRY(client_start_reader(client));
+
+  if (registry_insert(self->clients, client) == REGISTRY_INVALID_HANDLE) {
+    if (client->watched)
+      --listener->quiet_count;
+    goto done;
+  }
 
-  TRYC(PTR_LIST_APPEND_CHECK(self->client, client));
   client = NULL;
 
+  STATS_INC(self->stats.clients_accepted);
+
   ok = true;
 
 done:
-  if (acquired)
-    pthread_mutex_unlock(&self->client_mutex);
-  
   if (client != NULL)
     DISPOSE(client, client);
   
@@ -88,108 +236,438 @@ done:
 static void *
 acceptor_thread(void *userdata)
 {
-  server_t *self = (server_t *) userdata;
-  struct pollfd fds[2];
-  char ack;
+  struct server_listener *listener = (struct server_listener *) userdata;
+  server_t *self = listener->server;
+  struct pollfd *fds;
+  unsigned int i;
+  uint64_t exited;
+
+  fds = listener->fds;
 
   fds[0].fd     = self->cancelfd[0];
   fds[0].events = POLLIN;
 
-  fds[1].fd     = self->listenfd;
+  fds[1].fd     = listener->fd;
   fds[1].events = POLLIN;
 
-  Info("Acceptor thread started\n");
+  /* Reaping is left to the first acceptor. poll() skips negative fds. */
+  fds[2].fd     = listener->index == 0 ? self->reapfd : -1;
+  fds[2].events = POLLIN;
+
+  Info("Acceptor thread %u started\n", listener->index);
+
+  if (CPU_COUNT(&listener->cpus) > 0)
+    affinity_pin(&listener->cpus);
+
+  /*
+   * No timeout: finished clients are reaped as soon as they exit. The
+   * cancellation byte is never read, so that every acceptor sees it.
+   */
+  for (;;) {
+    if (poll(
+      listener->fds,
+      SERVER_ACCEPTOR_FDS + listener->quiet_count,
+      -1) == -1) {
+      /* Signals meant for the capture loop land here too */
+      if (errno == EINTR && !server_stopping(self))
+        continue;
+
+      if (errno != EINTR)
+        Err(
+          "Acceptor %u: poll() failed: %s\n",
+          listener->index,
+          strerror(errno));
+      break;
+    }
+
+    fds = listener->fds;
 
-  while (poll(fds, 2, 1000) != -1) {
-    if (fds[0].revents & POLLIN) {
-      read(self->cancelfd[0], &ack, 1);
+    if (fds[0].revents & POLLIN)
       break;
-    } else if (fds[1].revents & POLLIN) {
-      TRY(server_accept_client(self));
-    } else {
+
+    /* Before accepting: the poll set may move */
+    for (i = 0; i < listener->quiet_count;)
+      if (listener->fds[SERVER_ACCEPTOR_FDS + i].revents != 0)
+        server_unwatch_client(self, listener, i);
+      else
+        ++i;
+
+    if (fds[2].revents & POLLIN) {
+      read(self->reapfd, &exited, sizeof(uint64_t));
       server_cleanup_clients(self);
     }
+
+    if (fds[1].revents & POLLIN)
+      server_accept_client(self, listener);
   }
 
-done:
-  self->thread_running = false;
+  return NULL;
 }
 
-METHOD(server, static bool, broadcast, frame_t *frame)
+/* Where the packet starts: relayed frames keep the upstream's header */
+static inline size_t
+server_frame_offset(const frame_t *frame)
 {
+  return ifshare_header_size(*(const uint32_t *) frame->data);
+}
+
+static uint32_t
+server_frame_hash(frame_t *frame)
+{
+  return frame_flow(frame, server_frame_offset(frame))->hash;
+}
+
+/*
+ * Grouped clients only take the flows of the buckets they own, and
+ * sampling clients only what they sample. Frames cache their hash, so
+ * it is computed once per frame, and only if someone needs it.
+ */
+static inline bool
+server_client_wants(client_t *client, frame_t *frame)
+{
+  const struct group *group;
+
+  if (!client_running(client))
+    return false;
+
+  if ((group = __atomic_load_n(&client->group, __ATOMIC_ACQUIRE)) != NULL
+    && !group_owns(group, server_frame_hash(frame), client))
+    return false;
+
+  return client_sample(client, frame, server_frame_offset(frame));
+}
+
+/* Lock-free: the acceptor never makes us wait for it */
+METHOD(server, bool, broadcast, frame_t *frame)
+{
+  const struct registry_snapshot *clients;
+  client_t *client;
+  unsigned int token;
   bool ok = false;
-  unsigned int i;
 
-  pthread_mutex_lock(&self->client_mutex);
+  /* Duplicates go nowhere, not even to the recorder */
+  if (self->dedup != NULL
+    && dedup_check(self->dedup, frame, server_frame_offset(frame)))
+    return true;
+
+  if (self->recorder != NULL)
+    recorder_push_frame(self->recorder, frame);
+
+  if (self->shm != NULL)
+    shm_push_frame(self->shm, frame);
 
-  for (i = 0; i < self->client_count; ++i)
-    if (self->client_list[i] != NULL && client_running(self->client_list[i]))
-      TRY(client_push_frame(self->client_list[i], frame));
+  clients = registry_read_lock(self->clients, &token);
+
+  REGISTRY_FOR_EACH(client, clients)
+    if (server_client_wants(client, frame))
+      TRY(client_push_frame(client, frame));
 
   ok = true;
 
 done:
-  pthread_mutex_unlock(&self->client_mutex);
+  registry_read_unlock(self->clients, token);
   return ok;
 }
 
-METHOD(server, static bool, init_listener)
+static int
+server_listen_on(const struct addrinfo *ai, const struct server_params *params)
 {
-  struct sockaddr_in serv_addr;
-  int reuse = 1;
-  
-  self->listenfd = socket(AF_INET, SOCK_STREAM, 0);
+  int fd;
+  int on  = 1;
+  int off = 0;
 
-  if (self->listenfd == -1) {
-    Err("socket(AF_INET, SOCK_STREAM, 0) failed: %s\n", strerror(errno));
-    return false;
-  }
-  
-  if (setsockopt(
-    self->listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1) {
-    Err("set SO_REUSEADDR failed: %s\n", strerror(errno));
-    close(self->listenfd);
-    return false;
+  if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, 0)) == -1)
+    return -1;
+
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(int)) == -1)
+    goto fail;
+
+  if (params->listeners > 1
+    && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(int)) == -1)
+    goto fail;
+
+  /* Dual stack: IPv4 clients arrive as IPv4-mapped addresses */
+  if (ai->ai_family == AF_INET6
+    && params->bind_addr == NULL
+    && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(int)) == -1)
+    goto fail;
+
+  if (bind(fd, ai->ai_addr, ai->ai_addrlen) == -1)
+    goto fail;
+
+  if (listen(fd, params->backlog) == -1)
+    goto fail;
+
+  return fd;
+
+fail:
+  on = errno;
+  close(fd);
+  errno = on;
+
+  return -1;
+}
+
+METHOD(server, static bool, init_listener, struct server_listener *listener)
+{
+  struct addrinfo hints, *list = NULL, *ai;
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(struct sockaddr_storage);
+  char port[16];
+  char *name = NULL;
+  int error;
+
+  snprintf(port, sizeof(port), "%u", self->params.port);
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags    = AI_PASSIVE | AI_NUMERICSERV;
+  hints.ai_family   = self->params.bind_addr == NULL ? AF_INET6 : AF_UNSPEC;
+
+  /* Without a bind address, try the IPv6 wildcard first, then IPv4 */
+  for (;;) {
+    if ((error = getaddrinfo(self->params.bind_addr, port, &hints, &list))
+      == 0) {
+      for (ai = list; ai != NULL && listener->fd == -1; ai = ai->ai_next)
+        listener->fd = server_listen_on(ai, &self->params);
+      error = errno;
+      freeaddrinfo(list);
+    } else if (hints.ai_family != AF_INET6) {
+      Err(
+        "Cannot resolve `%s': %s\n",
+        self->params.bind_addr,
+        gai_strerror(error));
+      return false;
+    }
+
+    if (listener->fd != -1 || hints.ai_family != AF_INET6)
+      break;
+
+    hints.ai_family = AF_INET;
   }
 
-  memset(&serv_addr, 0, sizeof(serv_addr));
-   
-  serv_addr.sin_family = AF_INET;
-  serv_addr.sin_addr.s_addr = INADDR_ANY;
-  serv_addr.sin_port = htons(IFSHARE_SERVER_PORT);
-   
-  if (bind(self->listenfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) == -1) {
-    Err("bind(self->listenfd, port = %d) failed: %s\n", IFSHARE_SERVER_PORT, strerror(errno));
-    close(self->listenfd);
+  if (listener->fd == -1) {
+    Err(
+      "Cannot listen on %s:%u: %s\n",
+      self->params.bind_addr != NULL ? self->params.bind_addr : "*",
+      self->params.port,
+      strerror(error));
     return false;
   }
-   
-  if (listen(self->listenfd, 10) == -1) {
-    Err("listen(self->listenfd, 10) failed: %s\n", strerror(errno));
-    close(self->listenfd);
-    return false;
+
+  if (listener->index == 0
+    && getsockname(listener->fd, (struct sockaddr *) &addr, &len) != -1
+    && (name = sockaddr_to_string((struct sockaddr *) &addr)) != NULL) {
+    Info(
+      "Listening on %s (%u listener%s, backlog %u)\n",
+      name,
+      self->params.listeners,
+      self->params.listeners == 1 ? "" : "s",
+      self->params.backlog);
+    free(name);
   }
 
   return true;
 }
 
-INSTANCER(server)
+#define SERVER_STAT(fp, metric, value) \
+  fprintf(fp, "ifshare_" metric " %llu\n", (unsigned long long) (value))
+
+/* PACKET_STATISTICS counters are reset on every read: accumulate them */
+METHOD(server, static void, update_kernel_stats)
+{
+  struct tpacket_stats tp;
+  socklen_t optlen = sizeof(struct tpacket_stats);
+  int fd = __atomic_load_n(&self->rawfd, __ATOMIC_RELAXED);
+
+  if (fd != -1
+    && getsockopt(fd, SOL_PACKET, PACKET_STATISTICS, &tp, &optlen) == 0)
+    STATS_ADD(self->stats.kernel_drops, tp.tp_drops);
+}
+
+static void
+server_dump_stats(FILE *fp, void *userdata)
+{
+  server_t *self = (server_t *) userdata;
+  const struct registry_snapshot *clients;
+  struct xdp_statistics xs;
+  injector_t *injector;
+  client_t *client;
+  unsigned int token;
+  unsigned int active = 0;
+
+  server_update_kernel_stats(self);
+
+  SERVER_STAT(fp, "captured_frames", STATS_GET(self->stats.captured_frames));
+  SERVER_STAT(fp, "captured_bytes", STATS_GET(self->stats.captured_bytes));
+  SERVER_STAT(fp, "kernel_drops", STATS_GET(self->stats.kernel_drops));
+
+  if (self->xsk != NULL && xsk_get_stats(self->xsk, &xs)) {
+    SERVER_STAT(fp, "xdp_rx_dropped", xs.rx_dropped);
+    SERVER_STAT(fp, "xdp_rx_invalid_descs", xs.rx_invalid_descs);
+    SERVER_STAT(fp, "xdp_rx_ring_full", xs.rx_ring_full);
+    SERVER_STAT(fp, "xdp_rx_fill_ring_empty", xs.rx_fill_ring_empty_descs);
+  }
+
+  SERVER_STAT(fp, "clients_accepted", STATS_GET(self->stats.clients_accepted));
+  SERVER_STAT(fp, "spin_hits", STATS_GET(self->stats.spin_hits));
+  SERVER_STAT(fp, "spin_misses", STATS_GET(self->stats.spin_misses));
+
+  if (self->params.capture == SERVER_CAPTURE_RELAY)
+    SERVER_STAT(
+      fp,
+      "upstream_connects",
+      STATS_GET(self->stats.upstream_connects));
+
+  if (self->recorder != NULL)
+    recorder_dump_stats(self->recorder, fp);
+
+  if ((injector = __atomic_load_n(&self->injector, __ATOMIC_ACQUIRE)) != NULL)
+    injector_dump_stats(injector, fp);
+
+  if (self->shm != NULL)
+    shm_dump_stats(self->shm, fp);
+
+  if (self->dedup != NULL)
+    dedup_dump_stats(self->dedup, fp);
+
+  groups_dump_stats(self->groups, fp);
+
+  clients = registry_read_lock(self->clients, &token);
+
+  REGISTRY_FOR_EACH(client, clients) {
+    client_dump_stats(client, fp);
+    ++active;
+  }
+
+  registry_read_unlock(self->clients, token);
+
+  SERVER_STAT(fp, "clients_active", active);
+  SERVER_STAT(fp, "log_dropped", log_dropped_count());
+}
+
+/*
+ * With several listeners and a client CPU list, each acceptor and its
+ * clients get one CPU of the list, round robin. Otherwise, all of them
+ * share the whole list.
+ */
+METHOD(server, static void, listener_cpus, struct server_listener *listener)
+{
+  const cpu_set_t *cpus = &self->params.client.cpus;
+  unsigned int nth;
+  int cpu;
+
+  listener->cpus = *cpus;
+
+  if (self->params.listeners < 2 || CPU_COUNT(cpus) == 0)
+    return;
+
+  nth = listener->index % CPU_COUNT(cpus);
+
+  for (cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    if (CPU_ISSET(cpu, cpus) && nth-- == 0) {
+      CPU_ZERO(&listener->cpus);
+      CPU_SET(cpu, &listener->cpus);
+      break;
+    }
+}
+
+INSTANCER(server, const struct server_params *params)
 {
   server_t *new = NULL;
+  struct server_listener *listener;
+  unsigned int i;
+  struct server_params defaults = server_params_INITIALIZER;
 
   ALLOCATE_FAIL(new, server_t);
 
+  new->params = params != NULL ? *params : defaults;
+
   new->cancelfd[0] = -1;
   new->cancelfd[1] = -1;
-  new->listenfd    = -1;
+  new->reapfd      = -1;
+  new->rawfd       = -1;
+  new->spin_ns     = new->params.spin_us * 1000ull;
+
+  if (new->params.listeners < 1
+    || new->params.listeners > SERVER_MAX_LISTENERS) {
+    Err(
+      "Invalid listener count %u (1-%d)\n",
+      new->params.listeners,
+      SERVER_MAX_LISTENERS);
+    goto fail;
+  }
 
-  TRY_FAIL(server_init_listener(new));
+  if (new->params.inject) {
+    if (new->params.capture == SERVER_CAPTURE_REPLAY) {
+      Err("Frames from clients cannot be injected while replaying\n");
+      goto fail;
+    }
+
+    if (new->params.capture == SERVER_CAPTURE_RELAY) {
+      Err("Frames from clients cannot be injected while relaying\n");
+      goto fail;
+    }
+
+    new->params.client.reverse.push     = server_reverse_push;
+    new->params.client.reverse.flush    = server_reverse_flush;
+    new->params.client.reverse.userdata = new;
+  }
+
+  new->params.client.control.hello    = server_client_hello;
+  new->params.client.control.userdata = new;
+
+  MAKE_FAIL(new->clients, registry);
+  MAKE_FAIL(new->groups, groups);
+
+  ALLOCATE_MANY_FAIL(
+    new->listener_list,
+    new->params.listeners,
+    struct server_listener);
+
+  for (i = 0; i < new->params.listeners; ++i) {
+    listener = new->listener_list + i;
+
+    listener->server = new;
+    listener->index  = i;
+    listener->fd     = -1;
+    ++new->listener_count;
+
+    ALLOCATE_MANY_FAIL(listener->fds, SERVER_ACCEPTOR_FDS, struct pollfd);
+
+    TRY_FAIL(server_init_listener(new, listener));
+    server_listener_cpus(new, listener);
+  }
+
+  if (new->params.recorder.prefix != NULL)
+    MAKE_FAIL(new->recorder, recorder, &new->params.recorder);
+
+  if (new->params.shm_path != NULL)
+    MAKE_FAIL(new->shm, shm, new->params.shm_path, new->params.shm_size);
+
+  if (new->params.dedup_window_us > 0)
+    MAKE_FAIL(new->dedup, dedup, new->params.dedup_window_us);
+
+  if (new->params.stats_path != NULL)
+    MAKE_FAIL(
+      new->stats_endpoint,
+      stats,
+      new->params.stats_path,
+      server_dump_stats,
+      new);
+
+  TRYC_FAIL(new->reapfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+  new->params.client.exitfd = new->reapfd;
 
   TRYC_FAIL(pipe(new->cancelfd));
-  TRYZ_FAIL(pthread_create(&new->acceptor_thread, NULL, acceptor_thread, new));
-  
-  new->thread_running = true;
-  new->thread_started = true;
+
+  for (i = 0; i < new->listener_count; ++i) {
+    listener = new->listener_list + i;
+
+    TRYZ_FAIL(
+      pthread_create(&listener->thread, NULL, acceptor_thread, listener));
+    listener->thread_started = true;
+  }
   
   return new;
 
@@ -203,36 +681,322 @@ fail:
 COLLECTOR(server)
 {
   unsigned int i;
+  char b = 1;
 
-  if (self->thread_started) {
-    if (self->thread_running) {
-      char b = 1;
-      write(self->cancelfd[1], &b, 1); /* Force cancellation */
-    }
+  if (self->stats_endpoint != NULL)
+    DISPOSE(stats, self->stats_endpoint);
 
-    pthread_join(self->acceptor_thread, NULL);
-  }
+  if (self->cancelfd[1] != -1)
+    write(self->cancelfd[1], &b, 1); /* Force cancellation */
+
+  for (i = 0; i < self->listener_count; ++i)
+    if (self->listener_list[i].thread_started)
+      pthread_join(self->listener_list[i].thread, NULL);
 
   if (self->cancelfd[0] != -1)
     close(self->cancelfd[0]);
-  else if (self->cancelfd[1] != -1)
+
+  if (self->cancelfd[1] != -1)
     close(self->cancelfd[1]);
 
-  pthread_mutex_destroy(&self->client_mutex);
+  if (self->clients != NULL) {
+    registry_remove_if(
+      self->clients,
+      server_client_any,
+      server_client_dispose,
+      self);
+    DISPOSE(registry, self->clients);
+  }
+
+  /* After the clients: they are members */
+  if (self->groups != NULL)
+    DISPOSE(groups, self->groups);
 
-  for (i = 0; i < self->client_count; ++i)
-    if (self->client_list[i] != NULL)
-      DISPOSE(client, self->client_list[i]);
-  
-  if (self->client_list != NULL)
-    free(self->client_list);
+  /* After the clients: their threads signal it */
+  if (self->reapfd != -1)
+    close(self->reapfd);
   
-  if (self->listenfd != -1)
-    close(self->listenfd);
+  if (self->listener_list != NULL) {
+    for (i = 0; i < self->listener_count; ++i) {
+      if (self->listener_list[i].fd != -1)
+        close(self->listener_list[i].fd);
+
+      if (self->listener_list[i].fds != NULL)
+        free(self->listener_list[i].fds);
+
+      if (self->listener_list[i].quiet_list != NULL)
+        free(self->listener_list[i].quiet_list);
+    }
+
+    free(self->listener_list);
+  }
+
+  if (self->recorder != NULL)
+    DISPOSE(recorder, self->recorder);
+
+  if (self->shm != NULL)
+    DISPOSE(shm, self->shm);
+
+  if (self->dedup != NULL) {
+    Info(
+      "%llu duplicate frames suppressed\n",
+      (unsigned long long) STATS_GET(self->dedup->stats.dropped));
+    DISPOSE(dedup, self->dedup);
+  }
+
+  /* After the clients: their readers feed it */
+  if (self->injector != NULL)
+    DISPOSE(injector, self->injector);
+
+  /* After the clients: queued frames may still point to the UMEM */
+  if (self->xsk != NULL)
+    DISPOSE(xsk, self->xsk);
 
   free(self);
 }
 
+METHOD_CONST(server, static inline size_t, header_size)
+{
+  return self->params.pdu_timestamps
+    ? sizeof(struct ifshare_pdu_ts)
+    : sizeof(struct ifshare_pdu);
+}
+
+/* Frames are captured header_size() bytes into the frame */
+METHOD_CONST(
+  server,
+  static void,
+  fill_pdu,
+  frame_t *frame,
+  enum ifshare_ts_source source)
+{
+  struct ifshare_pdu_ts *pdu = (struct ifshare_pdu_ts *) frame->data;
+  size_t size = frame->size - server_header_size(self);
+  const struct timespec *ts = source == IFSHARE_TS_HARDWARE
+    ? &frame->hw_timestamp
+    : &frame->timestamp;
+
+  if (self->params.pdu_timestamps) {
+    pdu->is_magic     = IFSHARE_MAGIC_TS;
+    pdu->is_size      = size;
+    pdu->is_ts_sec    = ts->tv_sec;
+    pdu->is_ts_nsec   = ts->tv_nsec;
+    pdu->is_ts_source = source;
+  } else {
+    pdu->is_magic     = IFSHARE_MAGIC;
+    pdu->is_size      = size;
+  }
+}
+
+/*
+ * Hardware timestamps need the NIC to stamp incoming packets. If it
+ * cannot, we fall back to software timestamps taken by the kernel.
+ */
+METHOD(server, static bool, enable_timestamps, int fd, const char *eth)
+{
+  struct hwtstamp_config hwc;
+  struct ifreq ifr;
+  int flags;
+  int on = 1;
+
+  switch (self->params.timestamps) {
+    case IFSHARE_TS_USER:
+      return true;
+
+    case IFSHARE_TS_KERNEL:
+      if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(int)) == -1) {
+        Err("setsockopt(SO_TIMESTAMPNS): %s\n", strerror(errno));
+        return false;
+      }
+
+      return true;
+
+    case IFSHARE_TS_HARDWARE:
+      memset(&hwc, 0, sizeof(struct hwtstamp_config));
+      memset(&ifr, 0, sizeof(struct ifreq));
+
+      hwc.tx_type   = HWTSTAMP_TX_OFF;
+      hwc.rx_filter = HWTSTAMP_FILTER_ALL;
+
+      strncpy(ifr.ifr_name, eth, IFNAMSIZ - 1);
+      ifr.ifr_data = (char *) &hwc;
+
+      if (ioctl(fd, SIOCSHWTSTAMP, &ifr) == -1)
+        Warn(
+          "%s: cannot enable hardware timestamps (%s), using kernel ones\n",
+          eth,
+          strerror(errno));
+
+      flags = SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE
+        | SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+
+      if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(int))
+        == -1) {
+        Err("setsockopt(SO_TIMESTAMPING): %s\n", strerror(errno));
+        return false;
+      }
+
+      return true;
+  }
+
+  return false;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define SERVER_CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#  define SERVER_CPU_RELAX() __asm__ __volatile__("yield")
+#else
+#  define SERVER_CPU_RELAX()
+#endif
+
+#ifndef SO_PREFER_BUSY_POLL
+#  define SO_PREFER_BUSY_POLL 69
+#endif /* SO_PREFER_BUSY_POLL */
+
+#ifndef SO_BUSY_POLL_BUDGET
+#  define SO_BUSY_POLL_BUDGET 70
+#endif /* SO_BUSY_POLL_BUDGET */
+
+/*
+ * Lets reads on the capture socket poll the NIC queue directly instead
+ * of waiting for its interrupt. Not fatal: values above the
+ * net.core.busy_read sysctl need CAP_NET_ADMIN.
+ */
+METHOD(server, static void, enable_busy_poll, int fd)
+{
+  int usecs  = self->params.busy_poll_us;
+  int on     = 1;
+  int budget = SERVER_CAPTURE_BATCH;
+
+  if (usecs == 0)
+    return;
+
+  if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(int)) == -1) {
+    Warn("setsockopt(SO_BUSY_POLL): %s\n", strerror(errno));
+    return;
+  }
+
+  if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(int)) == -1)
+    Warn("setsockopt(SO_PREFER_BUSY_POLL): %s\n", strerror(errno));
+
+  if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &budget, sizeof(int))
+    == -1)
+    Warn("setsockopt(SO_BUSY_POLL_BUDGET): %s\n", strerror(errno));
+
+  Info("Busy polling enabled (%d us)\n", usecs);
+}
+
+/* Whether there is input, without blocking */
+METHOD(server, static bool, input_ready, struct pollfd *fd)
+{
+  if (self->xsk != NULL) {
+    /* Busy polling AF_XDP sockets is driven by these empty reads */
+    if (self->params.busy_poll_us > 0)
+      recvfrom(fd->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+
+    return xsk_pending(self->xsk);
+  }
+
+  return poll(fd, 1, 0) > 0;
+}
+
+/*
+ * Waits for input on the capture socket. If spinning is enabled, input
+ * is polled for up to spin_ns before going to sleep. The spin budget
+ * adapts: it grows when the sleep that followed a fruitless spin was
+ * short (a bit more spinning would have caught it) and shrinks when it
+ * was long (traffic is sparse and spinning just burns the CPU).
+ */
+METHOD(server, static bool, wait_input, struct pollfd *fd)
+{
+  uint64_t max_spin = self->params.spin_us * 1000ull;
+  uint64_t start, deadline, slept;
+  bool ok;
+
+  if (max_spin > 0) {
+    start    = stats_now_ns();
+    deadline = start + self->spin_ns;
+
+    do {
+      /* Looks like an interrupted wait to the capture loops */
+      if (server_stopping(self)) {
+        errno = EINTR;
+        return false;
+      }
+
+      if (server_input_ready(self, fd)) {
+        STATS_INC(self->stats.spin_hits);
+        return true;
+      }
+
+      SERVER_CPU_RELAX();
+    } while (stats_now_ns() < deadline);
+
+    STATS_INC(self->stats.spin_misses);
+  }
+
+  start = stats_now_ns();
+
+  if (self->xsk != NULL)
+    ok = xsk_wait(self->xsk, -1);
+  else
+    ok = poll(fd, 1, -1) != -1;
+
+  if (ok && max_spin > 0) {
+    slept = stats_now_ns() - start;
+
+    if (slept < max_spin)
+      self->spin_ns = MIN(self->spin_ns * 2, max_spin);
+    else
+      self->spin_ns = MAX(self->spin_ns / 2, SERVER_SPIN_MIN_NS);
+  }
+
+  return ok;
+}
+
+/* Stamps the frame with whatever came in the control messages */
+static enum ifshare_ts_source
+server_stamp_frame(frame_t *frame, struct msghdr *msg)
+{
+  struct cmsghdr *cmsg;
+  struct scm_timestamping *tss;
+
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET)
+      continue;
+
+    if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      memcpy(&frame->timestamp, CMSG_DATA(cmsg), sizeof(struct timespec));
+      return IFSHARE_TS_KERNEL;
+    }
+
+    if (cmsg->cmsg_type == SCM_TIMESTAMPING) {
+      tss = (struct scm_timestamping *) CMSG_DATA(cmsg);
+
+      if (tss->ts[2].tv_sec != 0 || tss->ts[2].tv_nsec != 0) {
+        frame->hw_timestamp = tss->ts[2];
+
+        if (tss->ts[0].tv_sec != 0 || tss->ts[0].tv_nsec != 0)
+          frame->timestamp = tss->ts[0];
+        else
+          frame_stamp(frame);
+
+        return IFSHARE_TS_HARDWARE;
+      }
+
+      if (tss->ts[0].tv_sec != 0 || tss->ts[0].tv_nsec != 0) {
+        frame->timestamp = tss->ts[0];
+        return IFSHARE_TS_KERNEL;
+      }
+    }
+  }
+
+  frame_stamp(frame);
+
+  return IFSHARE_TS_USER;
+}
+
 METHOD(server, static int, open_raw_socket, const char *eth)
 {
   struct ifreq if_idx;
@@ -304,30 +1068,54 @@ done:
   return fd;
 }
 
-METHOD(server, bool, loop, const char *eth)
+METHOD(server, static bool, loop_packet, const char *eth)
 {
   bool ok = false;
   int rawfd = -1;
   ssize_t ret;
   struct pollfd fd;
   frame_t *frame = NULL;
-  const char *message = "Hello world (broadcast)\n";
+  size_t hdrsize = server_header_size(self);
+  enum ifshare_ts_source source;
+  struct msghdr msg;
+  struct iovec iov;
+  union {
+    char           buf[CMSG_SPACE(sizeof(struct scm_timestamping))];
+    struct cmsghdr align;
+  } control;
 
   TRYC(rawfd = server_open_raw_socket(self, eth));
+  TRY(server_enable_timestamps(self, rawfd, eth));
+  server_enable_busy_poll(self, rawfd);
+  __atomic_store_n(&self->rawfd, rawfd, __ATOMIC_RELAXED);
 
   fd.fd = rawfd;
   fd.events = POLLIN;
 
   for (;;) {
-    TRYC(poll(&fd, 1, -1));
+    /* Signal handlers only raise the flag: a busy socket never sees EINTR */
+    if (server_stopping(self))
+      break;
+
+    if (!server_wait_input(self, &fd)) {
+      if (errno == EINTR && !server_stopping(self))
+        continue;
+      TRY(server_stopping(self));
+      break;
+    }
 
-    MAKE(frame, frame, IFSHARE_MAX_MTU + sizeof(struct ifshare_pdu));
+    MAKE(frame, frame, IFSHARE_MAX_MTU + hdrsize);
 
-    struct ifshare_pdu *pdu = (struct ifshare_pdu *) frame->data;
+    iov.iov_base = frame->data + hdrsize;
+    iov.iov_len  = IFSHARE_MAX_MTU;
 
-    pdu->is_magic = IFSHARE_MAGIC;
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
 
-    ret = recv(rawfd, pdu->is_data, IFSHARE_MAX_MTU, 0);
+    ret = recvmsg(rawfd, &msg, 0);
 
     if (ret == -1) {
       Err("recv RAW failed: %s\n", strerror(errno));
@@ -337,21 +1125,461 @@ METHOD(server, bool, loop, const char *eth)
       break;
     }
 
-    pdu->is_size = ret;
+    STATS_INC(self->stats.captured_frames);
+    STATS_ADD(self->stats.captured_bytes, ret);
 
-    //Debug("FRAME[0x%x, %d] (%d)\n", pdu->is_magic, pdu->is_size, sizeof(struct ifshare_pdu) + ret);
+    source = server_stamp_frame(frame, &msg);
+
+    TRY(frame_resize(frame, hdrsize + ret));
+    server_fill_pdu(self, frame, source);
 
-    TRY(frame_resize(frame, sizeof(struct ifshare_pdu) + ret));
     TRY(server_broadcast(self, frame));
 
     frame_dec_ref(frame);
+    frame = NULL;
   }
 
   ok = true;
 
 done:
-  if (rawfd != -1)
+  if (frame != NULL)
+    frame_dec_ref(frame);
+
+  if (rawfd != -1) {
+    __atomic_store_n(&self->rawfd, -1, __ATOMIC_RELAXED);
     close(rawfd);
+  }
   
   return ok;
 }
+
+/*
+ * AF_XDP capture. Frames wrap UMEM chunks directly, and the XSK leaves
+ * room for the PDU header right before the packet data, so captured
+ * packets reach the clients without a single copy. AF_XDP does not
+ * deliver capture timestamps, so frames are stamped once per batch.
+ */
+METHOD(server, static bool, loop_xdp, const char *eth)
+{
+  bool ok = false;
+  frame_t *frames[SERVER_CAPTURE_BATCH];
+  unsigned int i, count = 0;
+  struct pollfd fd;
+
+  MAKE(
+    self->xsk,
+    xsk,
+    eth,
+    self->params.xdp_queue,
+    self->params.xdp_mode,
+    server_header_size(self));
+
+  server_enable_busy_poll(self, self->xsk->fd);
+
+  fd.fd     = self->xsk->fd;
+  fd.events = POLLIN;
+
+  for (;;) {
+    /* Signal handlers only raise the flag: a busy socket never sees EINTR */
+    if (server_stopping(self))
+      break;
+
+    if (!server_wait_input(self, &fd)) {
+      if (errno == EINTR && !server_stopping(self))
+        continue;
+      TRY(server_stopping(self));
+      break;
+    }
+
+    count = xsk_recv_batch(self->xsk, frames, SERVER_CAPTURE_BATCH);
+
+    if (count > 0)
+      frame_stamp(frames[0]);
+
+    for (i = 0; i < count; ++i) {
+      frames[i]->timestamp = frames[0]->timestamp;
+      server_fill_pdu(self, frames[i], IFSHARE_TS_USER);
+
+      STATS_INC(self->stats.captured_frames);
+      STATS_ADD(
+        self->stats.captured_bytes,
+        frames[i]->size - server_header_size(self));
+    }
+
+    if (self->dedup != NULL || groups_active(self->groups))
+      frame_parse_flows(frames, count, server_header_size(self));
+
+    for (i = 0; i < count; ++i)
+      TRY(server_broadcast(self, frames[i]));
+
+    for (i = 0; i < count; ++i)
+      frame_dec_ref(frames[i]);
+    count = 0;
+  }
+
+  ok = true;
+
+done:
+  for (i = 0; i < count; ++i)
+    frame_dec_ref(frames[i]);
+
+  return ok;
+}
+
+/* Lets every client send what it has queued before the server goes away */
+METHOD(server, static unsigned int, active_clients)
+{
+  const struct registry_snapshot *clients;
+  client_t *client;
+  unsigned int token;
+  unsigned int active = 0;
+
+  clients = registry_read_lock(self->clients, &token);
+
+  REGISTRY_FOR_EACH(client, clients)
+    if (client_running(client))
+      ++active;
+
+  registry_read_unlock(self->clients, token);
+
+  return active;
+}
+
+/*
+ * Every client gets its end-of-stream marker first, so that they all
+ * drain at once, against a single deadline. Their threads are joined by
+ * the reaper as they exit: nothing waits under the registry lock.
+ */
+METHOD(server, static void, drain, unsigned int timeout_ms)
+{
+  struct timespec wait = {0, SERVER_DRAIN_POLL_MS * 1000000l};
+  const struct registry_snapshot *clients;
+  uint64_t deadline = stats_now_ns() + timeout_ms * 1000000ull;
+  client_t *client;
+  unsigned int token;
+
+  clients = registry_read_lock(self->clients, &token);
+
+  REGISTRY_FOR_EACH(client, clients)
+    if (client_running(client) && !client_end_stream(client))
+      Warn("[%16s] Cannot end the stream\n", client->name);
+
+  registry_read_unlock(self->clients, token);
+
+  while (server_active_clients(self) > 0 && stats_now_ns() < deadline)
+    nanosleep(&wait, NULL);
+
+  clients = registry_read_lock(self->clients, &token);
+
+  REGISTRY_FOR_EACH(client, clients)
+    if (client_running(client))
+      Warn("[%16s] Client did not drain in time\n", client->name);
+
+  registry_read_unlock(self->clients, token);
+}
+
+/* Sleeps until `deadline' (CLOCK_MONOTONIC, ns). False if stopped. */
+METHOD(server, static bool, sleep_until, uint64_t deadline)
+{
+  struct timespec ts;
+
+  ts.tv_sec  = deadline / 1000000000ull;
+  ts.tv_nsec = deadline % 1000000000ull;
+
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    if (server_stopping(self))
+      return false;
+
+  return true;
+}
+
+/*
+ * Replays a pcap / pcapng file through the broadcast path. Packets keep
+ * their original spacing divided by the replay speed (a speed of 0 sends
+ * them as fast as possible), and are stamped with the time they are
+ * replayed at, so that latency figures stay meaningful.
+ */
+METHOD(server, static bool, loop_replay, const char *path)
+{
+  bool ok = false;
+  capfile_t *cap = NULL;
+  frame_t *frame = NULL;
+  struct capfile_packet packet;
+  size_t hdrsize = server_header_size(self);
+  size_t size;
+  double speed = self->params.replay_speed;
+  uint64_t base_ts = 0, base_time = 0, offset;
+  uint64_t pass_frames = 0;
+  unsigned int pass = 0;
+  bool first = true;
+
+  MAKE(cap, capfile, path);
+
+  if (self->params.replay_clients > 0) {
+    Info("Waiting for %u clients\n", self->params.replay_clients);
+
+    while (!server_stopping(self)
+      && server_active_clients(self) < self->params.replay_clients)
+      server_sleep_until(self, stats_now_ns() + 10000000);
+  }
+
+  Info("Replaying %s at %gx\n", path, speed);
+
+  while (!server_stopping(self)) {
+    if (!capfile_next(cap, &packet)) {
+      if (pass_frames == 0) {
+        Warn("%s: no packets to replay\n", path);
+        break;
+      }
+
+      if (++pass == self->params.replay_loops)
+        break;
+
+      capfile_rewind(cap);
+      pass_frames = 0;
+      first       = true;
+      continue;
+    }
+
+    ++pass_frames;
+
+    if (speed > 0) {
+      if (first) {
+        base_ts   = packet.ts_ns;
+        base_time = stats_now_ns();
+        first     = false;
+      } else if (packet.ts_ns > base_ts) {
+        offset = (uint64_t) ((packet.ts_ns - base_ts) / speed);
+        if (!server_sleep_until(self, base_time + offset))
+          break;
+      }
+    }
+
+    size = MIN(packet.size, IFSHARE_MAX_MTU);
+
+    MAKE(frame, frame, hdrsize + size);
+    memcpy(frame->data + hdrsize, packet.data, size);
+    frame_stamp(frame);
+    server_fill_pdu(self, frame, IFSHARE_TS_USER);
+
+    STATS_INC(self->stats.captured_frames);
+    STATS_ADD(self->stats.captured_bytes, size);
+
+    TRY(server_broadcast(self, frame));
+
+    frame_dec_ref(frame);
+    frame = NULL;
+  }
+
+  Info("Replay finished, draining clients\n");
+  server_drain(self, SERVER_DRAIN_TIMEOUT_MS);
+
+  ok = true;
+
+done:
+  if (frame != NULL)
+    frame_dec_ref(frame);
+
+  if (cap != NULL)
+    DISPOSE(capfile, cap);
+
+  return ok;
+}
+
+/* HOST, HOST:PORT or [HOST]:PORT. An IPv6 address alone needs no brackets. */
+static bool
+server_parse_upstream(const char *spec, struct ifshare_params *params)
+{
+  char *host = NULL;
+  const char *colon;
+  const char *end = NULL;
+
+  if (*spec == '[') {
+    if ((end = strchr(spec, ']')) == NULL)
+      goto fail;
+    colon = end[1] == ':' ? end + 1 : NULL;
+    ++spec;
+  } else if ((colon = strchr(spec, ':')) != NULL && strchr(colon + 1, ':')) {
+    colon = NULL;
+  }
+
+  if (end == NULL)
+    end = colon != NULL ? colon : spec + strlen(spec);
+
+  if (end == spec || (host = strndup(spec, end - spec)) == NULL)
+    goto fail;
+
+  if (colon != NULL
+    && (sscanf(colon + 1, "%u", &params->port) != 1
+      || params->port < 1
+      || params->port > 65535))
+    goto fail;
+
+  params->host = host;
+
+  return true;
+
+fail:
+  if (host != NULL)
+    free(host);
+
+  Err("Invalid upstream server `%s'\n", spec);
+
+  return false;
+}
+
+/*
+ * Relay mode: frames come from another ifserver. PDUs are forwarded as
+ * the upstream framed them (timestamps included), so the only cost is
+ * one copy out of the receive buffer. If the upstream goes away, we
+ * keep our clients and reconnect.
+ */
+METHOD(server, static bool, loop_relay, const char *upstream)
+{
+  bool ok = false;
+  ifshare_t *ifshare = NULL;
+  struct ifshare_params params = ifshare_params_INITIALIZER;
+  struct ifshare_frame frames[SERVER_CAPTURE_BATCH];
+  frame_t *frame = NULL;
+  int i, count;
+
+  TRY(server_parse_upstream(upstream, &params));
+
+  if (self->params.pdu_timestamps)
+    Warn("Relaying PDUs as framed by the upstream server, ignoring -T\n");
+
+  while (!server_stopping(self)) {
+    if ((ifshare = ifshare_new(&params)) == NULL) {
+      server_sleep_until(
+        self,
+        stats_now_ns() + SERVER_RELAY_RETRY_MS * 1000000ull);
+      continue;
+    }
+
+    STATS_INC(self->stats.upstream_connects);
+    Info("Relaying frames from %s\n", upstream);
+
+    while ((count = ifshare_recv_batch(
+      ifshare,
+      frames,
+      SERVER_CAPTURE_BATCH,
+      -1)) >= 0 && !server_stopping(self)) {
+      for (i = 0; i < count; ++i) {
+        MAKE(frame, frame, frames[i].pdu_size);
+        memcpy(frame->data, frames[i].pdu, frames[i].pdu_size);
+
+        /* Upstream hardware stamps are in its NIC's clock, not ours */
+        if (frames[i].timestamp.tv_sec != 0
+          && frames[i].ts_source != IFSHARE_TS_HARDWARE)
+          frame->timestamp = frames[i].timestamp;
+        else
+          frame_stamp(frame);
+
+        STATS_INC(self->stats.captured_frames);
+        STATS_ADD(self->stats.captured_bytes, frames[i].size);
+
+        TRY(server_broadcast(self, frame));
+
+        frame_dec_ref(frame);
+        frame = NULL;
+      }
+    }
+
+    DISPOSE(ifshare, ifshare);
+    ifshare = NULL;
+
+    if (!server_stopping(self))
+      Warn("Lost upstream server %s, reconnecting\n", upstream);
+  }
+
+  ok = true;
+
+done:
+  if (frame != NULL)
+    frame_dec_ref(frame);
+
+  if (ifshare != NULL)
+    DISPOSE(ifshare, ifshare);
+
+  if (params.host != NULL)
+    free((char *) params.host);
+
+  return ok;
+}
+
+/* Async-signal-safe: interrupted capture loops return cleanly */
+METHOD(server, void, stop)
+{
+  __atomic_store_n(&self->stopping, true, __ATOMIC_RELAXED);
+}
+
+/* Placement of the capture thread, which is the one calling loop() */
+METHOD(server, static bool, tune_capture_thread, const char *eth)
+{
+  bool live = self->params.capture == SERVER_CAPTURE_PACKET
+    || self->params.capture == SERVER_CAPTURE_XDP;
+  int cpu = self->params.capture_cpu;
+  int node;
+
+  if (cpu == SERVER_CPU_AUTO) {
+    if (!live || (cpu = affinity_nic_capture_cpu(eth)) == -1)
+      Warn("Cannot tell which CPU is closest to `%s', not pinning\n", eth);
+  }
+
+  if (cpu >= 0) {
+    if (!affinity_pin_cpu(cpu))
+      return false;
+    Info("Capture thread pinned to CPU %d\n", cpu);
+  }
+
+  if (self->params.numa) {
+    if (!live || (node = affinity_nic_node(eth)) < 0) {
+      Warn("`%s' has no NUMA node, frames allocated anywhere\n", eth);
+    } else {
+      if (!affinity_prefer_node(node))
+        return false;
+      Info("Frames allocated on NUMA node %d\n", node);
+    }
+  }
+
+  if (self->params.fifo_priority > 0) {
+    if (!affinity_set_fifo(self->params.fifo_priority))
+      return false;
+    Info(
+      "Capture thread running with SCHED_FIFO priority %d\n",
+      self->params.fifo_priority);
+  }
+
+  return true;
+}
+
+METHOD(server, bool, loop, const char *eth)
+{
+  injector_t *injector;
+
+  if (!server_tune_capture_thread(self, eth))
+    return false;
+
+  if (self->params.inject && self->injector == NULL) {
+    if ((injector = injector_new(eth)) == NULL)
+      return false;
+
+    __atomic_store_n(&self->injector, injector, __ATOMIC_RELEASE);
+  }
+
+  switch (self->params.capture) {
+    case SERVER_CAPTURE_PACKET:
+      return server_loop_packet(self, eth);
+
+    case SERVER_CAPTURE_XDP:
+      return server_loop_xdp(self, eth);
+
+    case SERVER_CAPTURE_REPLAY:
+      return server_loop_replay(self, eth);
+
+    case SERVER_CAPTURE_RELAY:
+      return server_loop_relay(self, eth);
+  }
+
+  return false;
+}
@@ -0,0 +1,273 @@
+/*
+  shm.c: Shared-memory endpoint for local consumers
+  Copyright (C) 2025 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, version 3.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#define _GNU_SOURCE
+
+#include <ifshare.h>
+#include <shm.h>
+#include <stats.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/poll.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+static bool
+shm_fill_addr(struct sockaddr_un *addr, const char *path)
+{
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    Err("Shared memory socket path `%s' is too long\n", path);
+    return false;
+  }
+
+  memset(addr, 0, sizeof(struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+  strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1);
+
+  return true;
+}
+
+/* Server side. Clients only connect(), so libifshare leaves it out. */
+#ifndef IFSHARE_LIBRARY
+static bool
+shm_send_fd(int sfd, int fd)
+{
+  union {
+    struct cmsghdr align;
+    char           buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct iovec iov;
+  uint32_t magic = SHMRING_MAGIC;
+
+  memset(&msg, 0, sizeof(struct msghdr));
+  memset(&control, 0, sizeof(control));
+
+  iov.iov_base       = &magic;
+  iov.iov_len        = sizeof(uint32_t);
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  cmsg             = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type  = SCM_RIGHTS;
+  cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  return sendmsg(sfd, &msg, MSG_NOSIGNAL) == sizeof(uint32_t);
+}
+
+static void *
+shm_thread(void *userdata)
+{
+  shm_t *self = (shm_t *) userdata;
+  struct pollfd fds[2];
+  char ack;
+  int sfd;
+
+  fds[0].fd     = self->cancelfd[0];
+  fds[0].events = POLLIN;
+
+  fds[1].fd     = self->listenfd;
+  fds[1].events = POLLIN;
+
+  while (poll(fds, 2, -1) != -1) {
+    if (fds[0].revents & POLLIN) {
+      read(self->cancelfd[0], &ack, 1);
+      break;
+    }
+
+    if (fds[1].revents & POLLIN) {
+      if ((sfd = accept4(self->listenfd, NULL, NULL, SOCK_CLOEXEC)) == -1)
+        continue;
+
+      if (shm_send_fd(sfd, self->ring->fd))
+        STATS_INC(self->readers);
+      else
+        Warn("Cannot pass the shared ring: %s\n", strerror(errno));
+
+      close(sfd);
+    }
+  }
+
+  return NULL;
+}
+
+INSTANCER(shm, const char *path, size_t size)
+{
+  shm_t *new = NULL;
+  struct sockaddr_un addr;
+
+  ALLOCATE_FAIL(new, shm_t);
+
+  new->listenfd    = -1;
+  new->cancelfd[0] = -1;
+  new->cancelfd[1] = -1;
+
+  TRY_FAIL(shm_fill_addr(&addr, path));
+  TRY_FAIL(new->path = strdup(path));
+
+  MAKE_FAIL(new->ring, shmring, size);
+
+  if ((new->listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0))
+    == -1) {
+    Err("socket(AF_UNIX, SOCK_STREAM, 0) failed: %s\n", strerror(errno));
+    goto fail;
+  }
+
+  /* Stale socket from a previous run */
+  unlink(path);
+
+  if (bind(new->listenfd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+    Err("bind(%s) failed: %s\n", path, strerror(errno));
+    goto fail;
+  }
+
+  TRYC_FAIL(listen(new->listenfd, 16));
+  TRYC_FAIL(pipe(new->cancelfd));
+  TRYZ_FAIL(pthread_create(&new->thread, NULL, shm_thread, new));
+
+  new->thread_started = true;
+
+  Info(
+    "Shared memory ring available at %s (%llu KiB)\n",
+    path,
+    (unsigned long long) new->ring->header->size >> 10);
+
+  return new;
+
+fail:
+  if (new != NULL)
+    DISPOSE(shm, new);
+
+  return NULL;
+}
+
+COLLECTOR(shm)
+{
+  if (self->thread_started) {
+    char b = 1;
+    write(self->cancelfd[1], &b, 1);
+    pthread_join(self->thread, NULL);
+  }
+
+  if (self->cancelfd[0] != -1)
+    close(self->cancelfd[0]);
+
+  if (self->cancelfd[1] != -1)
+    close(self->cancelfd[1]);
+
+  if (self->listenfd != -1) {
+    close(self->listenfd);
+    unlink(self->path);
+  }
+
+  /* Readers keep their mapping: they see the ring closed */
+  if (self->ring != NULL)
+    DISPOSE(shmring, self->ring);
+
+  if (self->path != NULL)
+    free(self->path);
+
+  free(self);
+}
+
+METHOD(shm, void, push_frame, const frame_t *frame)
+{
+  shmring_push(self->ring, frame->data, frame->size);
+}
+
+#define SHM_STAT(fp, metric, value)  \
+  fprintf(                           \
+    fp,                              \
+    "ifshare_shm_" metric " %llu\n", \
+    (unsigned long long) (value))
+
+METHOD(shm, void, dump_stats, FILE *fp)
+{
+  SHM_STAT(fp, "frames", STATS_GET(self->ring->stats.frames));
+  SHM_STAT(fp, "bytes", STATS_GET(self->ring->stats.bytes));
+  SHM_STAT(fp, "wakeups", STATS_GET(self->ring->stats.wakeups));
+  SHM_STAT(fp, "readers", STATS_GET(self->readers));
+}
+#endif /* IFSHARE_LIBRARY */
+
+int
+shm_connect(const char *path)
+{
+  union {
+    struct cmsghdr align;
+    char           buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct sockaddr_un addr;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct iovec iov;
+  uint32_t magic = 0;
+  int sfd = -1;
+  int fd = -1;
+
+  if (!shm_fill_addr(&addr, path))
+    goto done;
+
+  if ((sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+    Err("socket(AF_UNIX, SOCK_STREAM, 0) failed: %s\n", strerror(errno));
+    goto done;
+  }
+
+  if (connect(sfd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+    Err("Cannot connect to %s: %s\n", path, strerror(errno));
+    goto done;
+  }
+
+  memset(&msg, 0, sizeof(struct msghdr));
+
+  iov.iov_base       = &magic;
+  iov.iov_len        = sizeof(uint32_t);
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  if (recvmsg(sfd, &msg, MSG_CMSG_CLOEXEC) != sizeof(uint32_t)
+    || magic != SHMRING_MAGIC) {
+    Err("%s: not an ifshare shared memory endpoint\n", path);
+    goto done;
+  }
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    if (cmsg->cmsg_level == SOL_SOCKET
+      && cmsg->cmsg_type == SCM_RIGHTS
+      && cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+      memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+  if (fd == -1)
+    Err("%s: no descriptor received\n", path);
+
+done:
+  if (sfd != -1)
+    close(sfd);
+
+  return fd;
+}
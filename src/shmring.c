@@ -0,0 +1,374 @@
+/*
+  shmring.c: Shared-memory frame ring for local consumers
+  Copyright (C) 2025 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, version 3.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#define _GNU_SOURCE
+
+#include <ifshare.h>
+#include <shmring.h>
+#include <stats.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+
+#define SHMRING_WAIT_YIELDS 16
+
+static inline long
+shmring_futex(uint32_t *addr, int op, uint32_t val, const struct timespec *ts)
+{
+  /* Not FUTEX_PRIVATE_FLAG: waiter and waker live in different processes */
+  return syscall(SYS_futex, addr, op, val, ts, NULL, 0);
+}
+
+static inline struct shmring_record *
+shmring_record_at(uint8_t *data, uint64_t size, uint64_t pos)
+{
+  return (struct shmring_record *) (data + (pos & (size - 1)));
+}
+
+/* Bytes taken by the record at `pos', pad records included */
+static inline uint64_t
+shmring_record_len(uint32_t record_size, uint64_t size, uint64_t pos)
+{
+  if (record_size == SHMRING_PAD)
+    return size - (pos & (size - 1));
+
+  return SHMRING_ALIGN(sizeof(struct shmring_record) + record_size);
+}
+
+/************************************ Writer **********************************/
+INSTANCER(shmring, size_t size)
+{
+  shmring_t *new = NULL;
+  uint64_t data_size = 4096;
+
+  ALLOCATE_FAIL(new, shmring_t);
+
+  new->fd = -1;
+
+  while (data_size < size)
+    data_size <<= 1;
+
+  new->map_size = SHMRING_HEADER_SIZE + data_size;
+
+  if ((new->fd = memfd_create(
+    "ifshare-ring",
+    MFD_CLOEXEC | MFD_ALLOW_SEALING)) == -1) {
+    Err("memfd_create() failed: %s\n", strerror(errno));
+    goto fail;
+  }
+
+  TRYC_FAIL(ftruncate(new->fd, new->map_size));
+
+  /* Readers map it read-write (for the futex): keep them from resizing */
+  TRYC_FAIL(fcntl(
+    new->fd,
+    F_ADD_SEALS,
+    F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL));
+
+  if ((new->map = mmap(
+    NULL,
+    new->map_size,
+    PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE,
+    new->fd,
+    0)) == MAP_FAILED) {
+    new->map = NULL;
+    Err("Cannot map shared ring: %s\n", strerror(errno));
+    goto fail;
+  }
+
+  new->header = (struct shmring_header *) new->map;
+  new->data   = new->map + SHMRING_HEADER_SIZE;
+
+  new->header->version     = SHMRING_VERSION;
+  new->header->size        = data_size;
+  new->header->data_offset = SHMRING_HEADER_SIZE;
+  new->header->pid         = getpid();
+
+  __atomic_store_n(&new->header->magic, SHMRING_MAGIC, __ATOMIC_RELEASE);
+
+  return new;
+
+fail:
+  if (new != NULL)
+    DISPOSE(shmring, new);
+
+  return NULL;
+}
+
+COLLECTOR(shmring)
+{
+  if (self->map != NULL) {
+    shmring_close(self);
+    munmap(self->map, self->map_size);
+  }
+
+  if (self->fd != -1)
+    close(self->fd);
+
+  free(self);
+}
+
+METHOD(shmring, static void, wake)
+{
+  struct shmring_header *header = self->header;
+
+  if (__atomic_load_n(&header->waiters, __ATOMIC_SEQ_CST) > 0) {
+    __atomic_fetch_add(&header->futex, 1, __ATOMIC_SEQ_CST);
+    shmring_futex(&header->futex, FUTEX_WAKE, INT_MAX, NULL);
+    STATS_INC(self->stats.wakeups);
+  }
+}
+
+/* Moves the tail past everything that writing `len' bytes will destroy */
+METHOD(shmring, static void, reserve, uint64_t head, uint64_t len)
+{
+  struct shmring_header *header = self->header;
+  uint64_t size = header->size;
+  uint64_t tail = header->tail;
+  struct shmring_record *record;
+
+  if (head + len - tail <= size)
+    return;
+
+  do {
+    record = shmring_record_at(self->data, size, tail);
+    tail  += shmring_record_len(record->size, size, tail);
+  } while (head + len - tail > size);
+
+  /* Readers must see the new tail before any of the overwritten bytes */
+  __atomic_store_n(&header->tail, tail, __ATOMIC_RELEASE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+METHOD(shmring, bool, push, const void *data, size_t size)
+{
+  struct shmring_header *header = self->header;
+  uint64_t ring = header->size;
+  uint64_t head = header->head;
+  uint64_t len  = SHMRING_ALIGN(sizeof(struct shmring_record) + size);
+  uint64_t gap  = ring - (head & (ring - 1));
+  struct shmring_record *record;
+
+  if (len > ring / 2)
+    return false;
+
+  if (gap < len) {
+    shmring_reserve(self, head, gap);
+    shmring_record_at(self->data, ring, head)->size = SHMRING_PAD;
+    head += gap;
+  }
+
+  shmring_reserve(self, head, len);
+
+  record = shmring_record_at(self->data, ring, head);
+  record->size = size;
+  memcpy(record->data, data, size);
+
+  __atomic_store_n(&header->head, head + len, __ATOMIC_SEQ_CST);
+
+  STATS_INC(self->stats.frames);
+  STATS_ADD(self->stats.bytes, size);
+
+  shmring_wake(self);
+
+  return true;
+}
+
+/* Readers get -1 once they have read everything */
+METHOD(shmring, void, close)
+{
+  __atomic_store_n(&self->header->closed, 1, __ATOMIC_SEQ_CST);
+  __atomic_fetch_add(&self->header->futex, 1, __ATOMIC_SEQ_CST);
+  shmring_futex(&self->header->futex, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+/************************************ Reader **********************************/
+INSTANCER(shmring_reader, int fd)
+{
+  shmring_reader_t *new = NULL;
+  struct shmring_header header;
+  struct stat sbuf;
+
+  ALLOCATE_FAIL(new, shmring_reader_t);
+
+  TRYC_FAIL(fstat(fd, &sbuf));
+
+  if (sbuf.st_size < SHMRING_HEADER_SIZE) {
+    Err("Shared ring too small\n");
+    goto fail;
+  }
+
+  new->map_size = sbuf.st_size;
+
+  if ((new->map = mmap(
+    NULL,
+    new->map_size,
+    PROT_READ | PROT_WRITE,
+    MAP_SHARED,
+    fd,
+    0)) == MAP_FAILED) {
+    new->map = NULL;
+    Err("Cannot map shared ring: %s\n", strerror(errno));
+    goto fail;
+  }
+
+  new->header = (struct shmring_header *) new->map;
+  memcpy(&header, new->header, sizeof(struct shmring_header));
+
+  if (header.magic != SHMRING_MAGIC || header.version != SHMRING_VERSION) {
+    Err("Not an ifshare ring, or an incompatible version\n");
+    goto fail;
+  }
+
+  if ((header.size & (header.size - 1)) != 0
+    || header.data_offset + header.size > new->map_size) {
+    Err("Corrupted shared ring header\n");
+    goto fail;
+  }
+
+  new->data = new->map + header.data_offset;
+
+  /* Only what comes from now on */
+  new->pos = __atomic_load_n(&new->header->head, __ATOMIC_ACQUIRE);
+
+  return new;
+
+fail:
+  if (new != NULL)
+    DISPOSE(shmring_reader, new);
+
+  return NULL;
+}
+
+COLLECTOR(shmring_reader)
+{
+  if (self->map != NULL)
+    munmap(self->map, self->map_size);
+
+  free(self);
+}
+
+METHOD(shmring_reader, static bool, closed)
+{
+  if (__atomic_load_n(&self->header->closed, __ATOMIC_ACQUIRE))
+    return true;
+
+  /* The writer died without closing */
+  return kill(self->header->pid, 0) == -1 && errno == ESRCH;
+}
+
+METHOD(shmring_reader, ssize_t, read, void *buf, size_t bufsize)
+{
+  struct shmring_header *header = self->header;
+  uint64_t ring = header->size;
+  uint64_t head, tail, len;
+  const struct shmring_record *record;
+  uint32_t size;
+
+  for (;;) {
+    head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+
+    if (self->pos == head)
+      return __atomic_load_n(&header->closed, __ATOMIC_ACQUIRE) ? -1 : 0;
+
+    /* Lapped by the writer: resume from the oldest record left */
+    if (self->pos < (tail = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE))) {
+      ++self->lost;
+      self->pos = tail;
+      continue;
+    }
+
+    record = shmring_record_at((uint8_t *) self->data, ring, self->pos);
+    size   = __atomic_load_n(&record->size, __ATOMIC_RELAXED);
+
+    if (size != SHMRING_PAD && size <= bufsize)
+      memcpy(buf, record->data, size);
+
+    /* Was any of that overwritten meanwhile? */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (self->pos < __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE))
+      continue;
+
+    len = shmring_record_len(size, ring, self->pos);
+    if (size != SHMRING_PAD && len > ring - (self->pos & (ring - 1))) {
+      Err("Corrupted shared ring record\n");
+      return -1;
+    }
+
+    self->pos += len;
+
+    if (size == SHMRING_PAD)
+      continue;
+
+    if (size > bufsize) {
+      ++self->lost;
+      continue;
+    }
+
+    return size;
+  }
+}
+
+METHOD(shmring_reader, bool, wait, int timeout_ms)
+{
+  struct shmring_header *header = self->header;
+  struct timespec ts, *tsp = NULL;
+  uint32_t value;
+  unsigned int i;
+  bool ready;
+
+  /* Under load the next record is usually a yield away: skip the futex */
+  for (i = 0; i < SHMRING_WAIT_YIELDS; ++i) {
+    if (self->pos != __atomic_load_n(&header->head, __ATOMIC_ACQUIRE))
+      return true;
+
+    sched_yield();
+  }
+
+  if (timeout_ms >= 0) {
+    ts.tv_sec  = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+    tsp        = &ts;
+  }
+
+  value = __atomic_load_n(&header->futex, __ATOMIC_SEQ_CST);
+  __atomic_fetch_add(&header->waiters, 1, __ATOMIC_SEQ_CST);
+
+  /* The writer checks `waiters' after publishing: check again after it */
+  if (self->pos == __atomic_load_n(&header->head, __ATOMIC_SEQ_CST)
+    && !shmring_reader_closed(self))
+    shmring_futex(&header->futex, FUTEX_WAIT, value, tsp);
+
+  __atomic_fetch_sub(&header->waiters, 1, __ATOMIC_SEQ_CST);
+
+  ready = self->pos != __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+
+  return ready || shmring_reader_closed(self);
+}
@@ -0,0 +1,190 @@
+/*
+  stats.c: Statistics endpoint
+  Copyright (C) 2025 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, version 3.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#define _GNU_SOURCE
+
+#include <stats.h>
+#include <util.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/poll.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+/*
+ * The dump callbacks hold locks (the client registry, the groups) while
+ * they print, so they print to memory. Only then is the text sent, and
+ * a consumer that stops reading just gets cut off.
+ */
+METHOD(stats, static void, serve, int sfd)
+{
+  struct timeval tv;
+  char *text = NULL;
+  size_t size = 0, sent = 0;
+  ssize_t got;
+  FILE *fp;
+
+  if ((fp = open_memstream(&text, &size)) == NULL) {
+    Err("Statistics: cannot allocate the dump: %s\n", strerror(errno));
+    return;
+  }
+
+  (self->dump) (fp, self->userdata);
+  fclose(fp);
+
+  tv.tv_sec  = STATS_SEND_TIMEOUT_MS / 1000;
+  tv.tv_usec = (STATS_SEND_TIMEOUT_MS % 1000) * 1000;
+  setsockopt(sfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(struct timeval));
+
+  while (sent < size) {
+    if ((got = send(sfd, text + sent, size - sent, MSG_NOSIGNAL)) == -1) {
+      if (errno == EINTR)
+        continue;
+
+      Warn("Statistics: consumer not reading, dump cut short\n");
+      break;
+    }
+
+    sent += got;
+  }
+
+  free(text);
+}
+
+static void *
+stats_thread(void *userdata)
+{
+  stats_t *self = (stats_t *) userdata;
+  struct pollfd fds[2];
+  char ack;
+  int sfd;
+
+  fds[0].fd     = self->cancelfd[0];
+  fds[0].events = POLLIN;
+
+  fds[1].fd     = self->listenfd;
+  fds[1].events = POLLIN;
+
+  for (;;) {
+    /* Stopped through the cancellation pipe only */
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+
+      Err("Statistics: poll() failed: %s\n", strerror(errno));
+      break;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      read(self->cancelfd[0], &ack, 1);
+      break;
+    }
+
+    if (fds[1].revents & POLLIN) {
+      if ((sfd = accept4(self->listenfd, NULL, NULL, SOCK_CLOEXEC)) == -1)
+        continue;
+
+      stats_serve(self, sfd);
+      close(sfd);
+    }
+  }
+
+  return NULL;
+}
+
+INSTANCER(stats, const char *path, stats_dump_cb_t dump, void *userdata)
+{
+  stats_t *new = NULL;
+  struct sockaddr_un addr;
+
+  ALLOCATE_FAIL(new, stats_t);
+
+  new->listenfd    = -1;
+  new->cancelfd[0] = -1;
+  new->cancelfd[1] = -1;
+  new->dump        = dump;
+  new->userdata    = userdata;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    Err("Stats socket path `%s' is too long\n", path);
+    goto fail;
+  }
+
+  TRY_FAIL(new->path = strdup(path));
+
+  if ((new->listenfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+    Err("socket(AF_UNIX, SOCK_STREAM, 0) failed: %s\n", strerror(errno));
+    goto fail;
+  }
+
+  memset(&addr, 0, sizeof(struct sockaddr_un));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  /* Stale socket from a previous run */
+  unlink(path);
+
+  if (bind(new->listenfd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+    Err("bind(%s) failed: %s\n", path, strerror(errno));
+    goto fail;
+  }
+
+  TRYC_FAIL(listen(new->listenfd, 16));
+  TRYC_FAIL(pipe(new->cancelfd));
+  TRYZ_FAIL(pthread_create(&new->thread, NULL, stats_thread, new));
+
+  new->thread_started = true;
+
+  Info("Statistics available at %s\n", path);
+
+  return new;
+
+fail:
+  if (new != NULL)
+    DISPOSE(stats, new);
+
+  return NULL;
+}
+
+COLLECTOR(stats)
+{
+  if (self->thread_started) {
+    char b = 1;
+    write(self->cancelfd[1], &b, 1);
+    pthread_join(self->thread, NULL);
+  }
+
+  if (self->cancelfd[0] != -1)
+    close(self->cancelfd[0]);
+
+  if (self->cancelfd[1] != -1)
+    close(self->cancelfd[1]);
+
+  if (self->listenfd != -1) {
+    close(self->listenfd);
+    unlink(self->path);
+  }
+
+  if (self->path != NULL)
+    free(self->path);
+
+  free(self);
+}
@@ -22,6 +22,9 @@
 #include <stdarg.h>
 #include <defs.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #define STRBUILD_BSIZ 16
 
@@ -140,6 +143,31 @@ ptr_list_append(void ***list, unsigned int *count, void *new)
   (void) ptr_list_append_check(list, count, new);
 }
 
+char *
+sockaddr_to_string(const struct sockaddr *sa)
+{
+  const struct sockaddr_in  *sin  = (const struct sockaddr_in *) sa;
+  const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) sa;
+  char host[INET6_ADDRSTRLEN];
+
+  switch (sa->sa_family) {
+    case AF_INET:
+      inet_ntop(AF_INET, &sin->sin_addr, host, sizeof(host));
+      return strbuild("%s:%d", host, ntohs(sin->sin_port));
+
+    case AF_INET6:
+      if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+        inet_ntop(AF_INET, sin6->sin6_addr.s6_addr + 12, host, sizeof(host));
+        return strbuild("%s:%d", host, ntohs(sin6->sin6_port));
+      }
+
+      inet_ntop(AF_INET6, &sin6->sin6_addr, host, sizeof(host));
+      return strbuild("[%s]:%d", host, ntohs(sin6->sin6_port));
+  }
+
+  return strbuild("(family %d)", sa->sa_family);
+}
+
 int
 ptr_list_remove_first(void ***list, unsigned int *count, void *ptr)
 {
@@ -0,0 +1,591 @@
+/*
+  xsk.c: AF_XDP capture socket
+  Copyright (C) 2025 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, version 3.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#define _GNU_SOURCE
+
+#include <xsk.h>
+#include <util.h>
+
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/poll.h>
+#include <net/if.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef AF_XDP
+#  define AF_XDP 44
+#endif /* AF_XDP */
+
+#ifndef SOL_XDP
+#  define SOL_XDP 283
+#endif /* SOL_XDP */
+
+#define BPF_INSN(c, d, s, o, i)                               \
+  ((struct bpf_insn) {                                        \
+    .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+
+static const char *g_mode_names[] = {
+  "auto", "skb", "native", "zerocopy"
+};
+
+bool
+xsk_mode_from_string(const char *string, enum xsk_mode *mode)
+{
+  unsigned int i;
+
+  for (i = 0; i < sizeof(g_mode_names) / sizeof(g_mode_names[0]); ++i)
+    if (strcmp(g_mode_names[i], string) == 0) {
+      *mode = (enum xsk_mode) i;
+      return true;
+    }
+
+  return false;
+}
+
+const char *
+xsk_mode_to_string(enum xsk_mode mode)
+{
+  return g_mode_names[mode];
+}
+
+static int
+bpf_sys(int cmd, union bpf_attr *attr)
+{
+  return syscall(__NR_bpf, cmd, attr, sizeof(union bpf_attr));
+}
+
+/*
+ * Redirects every packet arriving to the captured queue to our socket.
+ * Packets of other queues (or arriving while the socket is not in the
+ * map yet) are passed to the stack untouched.
+ */
+METHOD(xsk, static bool, load_program)
+{
+  union bpf_attr attr;
+  bool ok = false;
+  struct bpf_insn prog[] = {
+    /* r2 = ctx->rx_queue_index */
+    BPF_INSN(
+      BPF_LDX | BPF_MEM | BPF_W,
+      BPF_REG_2,
+      BPF_REG_1,
+      offsetof(struct xdp_md, rx_queue_index),
+      0),
+
+    /* r1 = &xsks_map */
+    BPF_INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, 0),
+    BPF_INSN(0, 0, 0, 0, 0),
+
+    /* r3 = XDP_PASS, returned if there is no socket for this queue */
+    BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS),
+
+    /* return bpf_redirect_map(r1, r2, r3) */
+    BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+    BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+  };
+
+  memset(&attr, 0, sizeof(union bpf_attr));
+  attr.map_type    = BPF_MAP_TYPE_XSKMAP;
+  attr.key_size    = sizeof(uint32_t);
+  attr.value_size  = sizeof(uint32_t);
+  attr.max_entries = self->queue + 1;
+
+  if ((self->map_fd = bpf_sys(BPF_MAP_CREATE, &attr)) == -1) {
+    Err("Failed to create XSK map: %s\n", strerror(errno));
+    goto done;
+  }
+
+  prog[1].imm = self->map_fd;
+
+  memset(&attr, 0, sizeof(union bpf_attr));
+  attr.prog_type = BPF_PROG_TYPE_XDP;
+  attr.insns     = (uint64_t) (uintptr_t) prog;
+  attr.insn_cnt  = sizeof(prog) / sizeof(prog[0]);
+  attr.license   = (uint64_t) (uintptr_t) "GPL";
+
+  if ((self->prog_fd = bpf_sys(BPF_PROG_LOAD, &attr)) == -1) {
+    Err("Failed to load XDP program: %s\n", strerror(errno));
+    goto done;
+  }
+
+  ok = true;
+
+done:
+  return ok;
+}
+
+METHOD(xsk, static bool, attach_program, uint32_t flags)
+{
+  union bpf_attr attr;
+
+  memset(&attr, 0, sizeof(union bpf_attr));
+  attr.link_create.prog_fd        = self->prog_fd;
+  attr.link_create.target_ifindex = self->ifindex;
+  attr.link_create.attach_type    = BPF_XDP;
+  attr.link_create.flags          = flags;
+
+  self->link_fd = bpf_sys(BPF_LINK_CREATE, &attr);
+
+  return self->link_fd != -1;
+}
+
+METHOD(xsk, static bool, register_socket)
+{
+  union bpf_attr attr;
+  uint32_t key   = self->queue;
+  uint32_t value = self->fd;
+
+  memset(&attr, 0, sizeof(union bpf_attr));
+  attr.map_fd = self->map_fd;
+  attr.key    = (uint64_t) (uintptr_t) &key;
+  attr.value  = (uint64_t) (uintptr_t) &value;
+  attr.flags  = BPF_ANY;
+
+  if (bpf_sys(BPF_MAP_UPDATE_ELEM, &attr) == -1) {
+    Err("Failed to register XSK in map: %s\n", strerror(errno));
+    return false;
+  }
+
+  return true;
+}
+
+static bool
+xsk_ring_map(
+  struct xsk_ring *ring,
+  int fd,
+  const struct xdp_ring_offset *off,
+  off_t pgoff,
+  size_t desc_size)
+{
+  ring->map_size = off->desc + XSK_RING_SIZE * desc_size;
+  ring->map      = mmap(
+    NULL,
+    ring->map_size,
+    PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE,
+    fd,
+    pgoff);
+
+  if (ring->map == MAP_FAILED) {
+    ring->map = NULL;
+    Err("Failed to map XSK ring: %s\n", strerror(errno));
+    return false;
+  }
+
+  ring->producer = (uint32_t *) ((uint8_t *) ring->map + off->producer);
+  ring->consumer = (uint32_t *) ((uint8_t *) ring->map + off->consumer);
+  ring->flags    = (uint32_t *) ((uint8_t *) ring->map + off->flags);
+  ring->ring     = (uint8_t *) ring->map + off->desc;
+  ring->size     = XSK_RING_SIZE;
+
+  return true;
+}
+
+static void
+xsk_ring_unmap(struct xsk_ring *ring)
+{
+  if (ring->map != NULL)
+    munmap(ring->map, ring->map_size);
+}
+
+METHOD(xsk, static bool, set_promisc, bool promisc)
+{
+  struct ifreq ifr;
+  int fd = -1;
+  bool ok = false;
+
+  TRYC(fd = socket(AF_INET, SOCK_DGRAM, 0));
+
+  memset(&ifr, 0, sizeof(struct ifreq));
+  strncpy(ifr.ifr_name, self->ifname, IFNAMSIZ - 1);
+
+  TRYC(ioctl(fd, SIOCGIFFLAGS, &ifr));
+
+  if (promisc) {
+    if (ifr.ifr_flags & IFF_PROMISC) {
+      ok = true;
+      goto done;
+    }
+
+    ifr.ifr_flags |= IFF_PROMISC;
+  } else {
+    ifr.ifr_flags &= ~IFF_PROMISC;
+  }
+
+  TRYC(ioctl(fd, SIOCSIFFLAGS, &ifr));
+
+  self->promisc_set = promisc;
+  ok = true;
+
+done:
+  if (fd != -1)
+    close(fd);
+
+  return ok;
+}
+
+/* Called by the capture thread only */
+METHOD(xsk, static void, refill)
+{
+  uint32_t prod, cons, room, i;
+  uint64_t *fill = (uint64_t *) self->fill.ring;
+
+  prod = *self->fill.producer;
+  cons = __atomic_load_n(self->fill.consumer, __ATOMIC_ACQUIRE);
+  room = self->fill.size - (prod - cons);
+
+  if (room == 0)
+    return;
+
+  pthread_mutex_lock(&self->recycle_mutex);
+
+  room = MIN(room, self->recycle_count);
+
+  for (i = 0; i < room; ++i)
+    fill[(prod + i) & (self->fill.size - 1)] =
+      self->recycle[--self->recycle_count];
+
+  pthread_mutex_unlock(&self->recycle_mutex);
+
+  if (room > 0) {
+    __atomic_store_n(self->fill.producer, prod + room, __ATOMIC_RELEASE);
+
+    if (__atomic_load_n(self->fill.flags, __ATOMIC_RELAXED)
+      & XDP_RING_NEED_WAKEUP)
+      recvfrom(self->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+  }
+}
+
+static void
+xsk_recycle_chunk(xsk_t *self, uint64_t addr)
+{
+  pthread_mutex_lock(&self->recycle_mutex);
+  self->recycle[self->recycle_count++] = addr & ~((uint64_t) XSK_CHUNK_SIZE - 1);
+  pthread_mutex_unlock(&self->recycle_mutex);
+}
+
+static void
+xsk_release_frame(frame_t *frame, void *userdata)
+{
+  xsk_t *self = (xsk_t *) userdata;
+
+  xsk_recycle_chunk(self, frame->data - self->umem);
+  __atomic_sub_fetch(&self->lent, 1, __ATOMIC_RELAXED);
+}
+
+METHOD(xsk, static bool, bind, uint32_t link_flags, uint16_t bind_flags)
+{
+  struct sockaddr_xdp sxdp;
+
+  if (!xsk_attach_program(self, link_flags))
+    return false;
+
+  memset(&sxdp, 0, sizeof(struct sockaddr_xdp));
+  sxdp.sxdp_family   = AF_XDP;
+  sxdp.sxdp_ifindex  = self->ifindex;
+  sxdp.sxdp_queue_id = self->queue;
+  sxdp.sxdp_flags    = bind_flags | XDP_USE_NEED_WAKEUP;
+
+  if (bind(self->fd, (struct sockaddr *) &sxdp, sizeof(sxdp)) == -1) {
+    close(self->link_fd);
+    self->link_fd = -1;
+    return false;
+  }
+
+  return true;
+}
+
+METHOD(xsk, static bool, bind_mode)
+{
+  switch (self->mode) {
+    case XSK_MODE_AUTO:
+      if (xsk_bind(self, XDP_FLAGS_DRV_MODE, XDP_ZEROCOPY)) {
+        self->mode = XSK_MODE_ZEROCOPY;
+        return true;
+      }
+
+      if (xsk_bind(self, XDP_FLAGS_DRV_MODE, XDP_COPY)) {
+        self->mode = XSK_MODE_NATIVE;
+        return true;
+      }
+
+      if (xsk_bind(self, XDP_FLAGS_SKB_MODE, XDP_COPY)) {
+        self->mode = XSK_MODE_SKB;
+        return true;
+      }
+
+      break;
+
+    case XSK_MODE_SKB:
+      return xsk_bind(self, XDP_FLAGS_SKB_MODE, XDP_COPY);
+
+    case XSK_MODE_NATIVE:
+      return xsk_bind(self, XDP_FLAGS_DRV_MODE, XDP_COPY);
+
+    case XSK_MODE_ZEROCOPY:
+      return xsk_bind(self, XDP_FLAGS_DRV_MODE, XDP_ZEROCOPY);
+  }
+
+  return false;
+}
+
+INSTANCER(
+  xsk,
+  const char *ifname,
+  unsigned int queue,
+  enum xsk_mode mode,
+  size_t headroom)
+{
+  xsk_t *new = NULL;
+  struct xdp_umem_reg reg;
+  struct xdp_mmap_offsets off;
+  socklen_t optlen;
+  unsigned int i;
+  int ring_size = XSK_RING_SIZE;
+
+  ALLOCATE_FAIL(new, xsk_t);
+
+  new->fd       = -1;
+  new->prog_fd  = -1;
+  new->map_fd   = -1;
+  new->link_fd  = -1;
+  new->queue    = queue;
+  new->mode     = mode;
+  new->headroom = headroom;
+
+  TRYZ_FAIL(pthread_mutex_init(&new->recycle_mutex, NULL));
+  TRY_FAIL(new->ifname = strdup(ifname));
+
+  if ((new->ifindex = if_nametoindex(ifname)) == 0) {
+    Err("Unknown interface `%s'\n", ifname);
+    goto fail;
+  }
+
+  /* UMEM */
+  new->umem_size = (size_t) XSK_NUM_CHUNKS * XSK_CHUNK_SIZE;
+  new->umem      = mmap(
+    NULL,
+    new->umem_size,
+    PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE,
+    -1,
+    0);
+
+  if (new->umem == MAP_FAILED) {
+    new->umem = NULL;
+    Err("Failed to allocate UMEM: %s\n", strerror(errno));
+    goto fail;
+  }
+
+  ALLOCATE_MANY_FAIL(new->recycle, XSK_NUM_CHUNKS, uint64_t);
+
+  for (i = 0; i < XSK_NUM_CHUNKS; ++i)
+    new->recycle[new->recycle_count++] = (uint64_t) i * XSK_CHUNK_SIZE;
+
+  if ((new->fd = socket(AF_XDP, SOCK_RAW, 0)) == -1) {
+    Err("Failed to create AF_XDP socket: %s\n", strerror(errno));
+    goto fail;
+  }
+
+  memset(&reg, 0, sizeof(struct xdp_umem_reg));
+  reg.addr       = (uint64_t) (uintptr_t) new->umem;
+  reg.len        = new->umem_size;
+  reg.chunk_size = XSK_CHUNK_SIZE;
+  reg.headroom   = headroom;
+
+  TRYC_FAIL(setsockopt(new->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)));
+  TRYC_FAIL(setsockopt(
+    new->fd,
+    SOL_XDP,
+    XDP_UMEM_FILL_RING,
+    &ring_size,
+    sizeof(int)));
+  TRYC_FAIL(setsockopt(
+    new->fd,
+    SOL_XDP,
+    XDP_UMEM_COMPLETION_RING,
+    &ring_size,
+    sizeof(int)));
+  TRYC_FAIL(setsockopt(new->fd, SOL_XDP, XDP_RX_RING, &ring_size, sizeof(int)));
+
+  optlen = sizeof(struct xdp_mmap_offsets);
+  TRYC_FAIL(getsockopt(new->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen));
+
+  TRY_FAIL(xsk_ring_map(
+    &new->rx,
+    new->fd,
+    &off.rx,
+    XDP_PGOFF_RX_RING,
+    sizeof(struct xdp_desc)));
+  TRY_FAIL(xsk_ring_map(
+    &new->fill,
+    new->fd,
+    &off.fr,
+    XDP_UMEM_PGOFF_FILL_RING,
+    sizeof(uint64_t)));
+  TRY_FAIL(xsk_ring_map(
+    &new->comp,
+    new->fd,
+    &off.cr,
+    XDP_UMEM_PGOFF_COMPLETION_RING,
+    sizeof(uint64_t)));
+
+  xsk_refill(new);
+
+  TRY_FAIL(xsk_load_program(new));
+
+  if (!xsk_bind_mode(new)) {
+    Err(
+      "Cannot bind AF_XDP socket to %s:%d in %s mode: %s\n",
+      ifname,
+      queue,
+      xsk_mode_to_string(mode),
+      strerror(errno));
+    goto fail;
+  }
+
+  TRY_FAIL(xsk_register_socket(new));
+  TRY_FAIL(xsk_set_promisc(new, true));
+
+  Info(
+    "%s: AF_XDP capture on queue %d (%s mode)\n",
+    ifname,
+    queue,
+    xsk_mode_to_string(new->mode));
+
+  return new;
+
+fail:
+  if (new != NULL)
+    DISPOSE(xsk, new);
+
+  return NULL;
+}
+
+COLLECTOR(xsk)
+{
+  if (self->promisc_set)
+    xsk_set_promisc(self, false);
+
+  if (self->link_fd != -1)
+    close(self->link_fd);
+
+  if (self->prog_fd != -1)
+    close(self->prog_fd);
+
+  if (self->map_fd != -1)
+    close(self->map_fd);
+
+  xsk_ring_unmap(&self->rx);
+  xsk_ring_unmap(&self->fill);
+  xsk_ring_unmap(&self->comp);
+
+  if (self->fd != -1)
+    close(self->fd);
+
+  if (self->umem != NULL)
+    munmap(self->umem, self->umem_size);
+
+  if (self->recycle != NULL)
+    free(self->recycle);
+
+  if (self->ifname != NULL)
+    free(self->ifname);
+
+  pthread_mutex_destroy(&self->recycle_mutex);
+
+  free(self);
+}
+
+METHOD(xsk, bool, wait, int timeout)
+{
+  struct pollfd fd;
+
+  fd.fd     = self->fd;
+  fd.events = POLLIN;
+
+  return poll(&fd, 1, timeout) != -1;
+}
+
+/*
+ * Returns up to max frames. Each frame starts `headroom' bytes before the
+ * packet, so that the caller can prepend its own header in place.
+ */
+METHOD(xsk, unsigned int, recv_batch, frame_t **frames, unsigned int max)
+{
+  const struct xdp_desc *descs = (const struct xdp_desc *) self->rx.ring;
+  uint32_t prod, cons, avail, i;
+  unsigned int count = 0;
+  frame_t *frame;
+
+  xsk_refill(self);
+
+  cons  = *self->rx.consumer;
+  prod  = __atomic_load_n(self->rx.producer, __ATOMIC_ACQUIRE);
+  avail = MIN(prod - cons, max);
+
+  for (i = 0; i < avail; ++i) {
+    const struct xdp_desc *desc = descs + ((cons + i) & (self->rx.size - 1));
+    uint8_t *packet = self->umem + desc->addr;
+    size_t   size   = self->headroom + desc->len;
+
+    if (__atomic_load_n(&self->lent, __ATOMIC_RELAXED)
+      < XSK_LENT_HIGH_WATERMARK) {
+      frame = frame_wrap(
+        packet - self->headroom,
+        size,
+        size,
+        xsk_release_frame,
+        self);
+
+      if (frame != NULL)
+        __atomic_add_fetch(&self->lent, 1, __ATOMIC_RELAXED);
+      else
+        xsk_recycle_chunk(self, desc->addr);
+    } else {
+      if ((frame = frame_new(size)) != NULL)
+        memcpy(frame->data + self->headroom, packet, desc->len);
+
+      xsk_recycle_chunk(self, desc->addr);
+    }
+
+    if (frame != NULL)
+      frames[count++] = frame;
+  }
+
+  __atomic_store_n(self->rx.consumer, cons + avail, __ATOMIC_RELEASE);
+
+  return count;
+}
+
+METHOD(xsk, bool, get_stats, struct xdp_statistics *stats)
+{
+  socklen_t optlen = sizeof(struct xdp_statistics);
+
+  memset(stats, 0, sizeof(struct xdp_statistics));
+
+  return getsockopt(self->fd, SOL_XDP, XDP_STATISTICS, stats, &optlen) == 0;
+}
@@ -0,0 +1,57 @@
+#!/bin/bash
+#
+# stop_under_load.sh: a server spinning on a busy socket must still stop
+# on SIGTERM, even though its poll() never blocks and never sees EINTR.
+#
+# Usage: stop_under_load.sh IFSERVER
+#
+
+SERVER=$1
+PORT=15668
+LOG=$(mktemp)
+FLOODERS=""
+
+# Capturing from `lo' takes CAP_NET_RAW
+if [ "$(id -u)" != 0 ]; then
+  echo "Not root, skipping"
+  exit 77
+fi
+
+cleanup() {
+  [ -n "$FLOODERS" ] && kill $FLOODERS 2> /dev/null
+  rm -f "$LOG"
+}
+
+trap cleanup EXIT
+
+"$SERVER" -p $PORT --spin=100000 lo > "$LOG" 2>&1 &
+PID=$!
+sleep 0.5
+
+if ! kill -0 $PID 2> /dev/null; then
+  echo "Server did not start:"
+  cat "$LOG"
+  exit 1
+fi
+
+for i in 1 2 3 4; do
+  (while :; do echo flood > /dev/udp/127.0.0.1/9; done) 2> /dev/null &
+  FLOODERS="$FLOODERS $!"
+done
+
+sleep 1
+kill -TERM $PID
+
+for i in $(seq 50); do
+  kill -0 $PID 2> /dev/null || break
+  sleep 0.1
+done
+
+if kill -0 $PID 2> /dev/null; then
+  echo "Server ignored SIGTERM under load"
+  kill -KILL $PID
+  exit 1
+fi
+
+wait $PID
+echo "Server exited with code $?"